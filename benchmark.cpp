@@ -0,0 +1,304 @@
+#include <boost/program_options.hpp>
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+#include "genie4l2.h"
+#include "cpu_bucketer.h"
+#include "dataset_io.h"
+#include "synthetic.h"
+#include "parallel.h"
+#include "util.h"
+#include "stage_stats.h"
+#include "exact_knn.h"
+#include "flat_index.h"
+
+#include <fmt/format.h>
+
+using namespace std;
+using namespace boost::program_options;
+
+//one point of a sweep
+struct BenchConfig
+{
+    //0 for the exact scan of FlatIndex, which ignores r, numCandidates, stableAfter and numProbes
+    int nLines;
+    double r;
+    int k;
+    int queryPerBatch;
+    //#candidates per query from the bucketer, 0 for the default of Genie4l2
+    int numCandidates;
+    int stableAfter;
+    //see Genie4l2::numProbes, only the cpu backend looks probes up
+    int numProbes;
+};
+
+struct BenchResult
+{
+    BenchConfig config;
+    double buildSec;
+    //what the queries of this config recorded, see stage_stats.h
+    StageSnapshot stages;
+    double qps;
+    //a query waits for its whole batch, so its latency is that of the batch
+    double p50Ms, p99Ms;
+    double recall;
+};
+
+template<class T>
+static vector<T> parse_list(const string& s)
+{
+    vector<T> ret;
+    stringstream ss(s);
+    string item;
+    while(getline(ss, item, ',')) {
+        if(!item.empty()) {
+            stringstream is(item);
+            T v;
+            is >> v;
+            ret.push_back(v);
+        }
+    }
+    return ret;
+}
+
+static double percentile(vector<double> v, double p)
+{
+    if(v.empty()) {
+        return 0.;
+    }
+    size_t i = std::min(v.size()-1, size_t(p * v.size()));
+    std::nth_element(v.begin(), v.begin()+i, v.end());
+    return v[i];
+}
+
+//build index and answer the queries of c with it
+template<class Index>
+static BenchResult run_index(Index& index, const BenchConfig& c, MatrixView<float> data, MatrixView<float> queries, const vector<vector<pair<float, int> > >& truth)
+{
+    using Clock = chrono::steady_clock;
+    BenchResult res;
+    res.config = c;
+
+    auto t0 = Clock::now();
+    index.build(data);
+    res.buildSec = chrono::duration<double>(Clock::now() - t0).count();
+
+    //batch by batch such that the latency of each is known, stages are not overlapped
+    index.pipelineDepth = 0;
+    StageSnapshot before = stage_snapshot();
+    vector<double> latencies;
+    vector<vector<pair<float, int> > > ress(queries.rows);
+    auto tq = Clock::now();
+    for(int beg=0;beg<queries.rows;beg+=c.queryPerBatch){
+        int end = std::min(beg + c.queryPerBatch, queries.rows);
+        auto tb = Clock::now();
+        auto batchRess = index.query_vec(queries.slice(beg, end), data);
+        double ms = chrono::duration<double, milli>(Clock::now() - tb).count();
+        for(int i=beg;i<end;i++){
+            latencies.push_back(ms);
+            ress[i] = std::move(batchRess[i-beg]);
+        }
+    }
+    double sec = chrono::duration<double>(Clock::now() - tq).count();
+    res.stages = stage_snapshot() - before;
+    res.qps = queries.rows / std::max(sec, 1e-9);
+    res.p50Ms = percentile(latencies, 0.5);
+    res.p99Ms = percentile(latencies, 0.99);
+    res.recall = recall_at_k(ress, truth, c.k);
+    return res;
+}
+
+template<class Bucketer>
+static BenchResult run_config(const BenchConfig& c, MatrixView<float> data, MatrixView<float> queries, const vector<vector<pair<float, int> > >& truth, int GPUID)
+{
+    if(c.nLines == 0) {
+        FlatIndex<float> index(data.cols, c.k, c.queryPerBatch);
+        return run_index(index, c, data, queries, truth);
+    }
+    Genie4l2<float, Bucketer> index(data.cols, c.nLines, c.r, c.k, c.queryPerBatch, GPUID, c.numCandidates);
+    index.rerankStore.budget.stableAfter = c.stableAfter;
+    index.numProbes = c.numProbes;
+    return run_index(index, c, data, queries, truth);
+}
+
+//total seconds and p99 of each stage follow the fixed columns
+static string to_csv_header()
+{
+    string ret = "nLines,r,k,queryPerBatch,numCandidates,stableAfter,numProbes,build_s,qps,p50_ms,p99_ms,recall";
+    for(int s=0;s<numStages;s++){
+        ret += fmt::format(",{0}_s,{0}_p99_ms", stage_name(Stage(s)));
+    }
+    return ret + "\n";
+}
+static string to_csv(const BenchResult& res)
+{
+    const BenchConfig& c = res.config;
+    string ret = fmt::format("{},{},{},{},{},{},{},{:.4f},{:.1f},{:.3f},{:.3f},{:.4f}",
+        c.nLines, c.r, c.k, c.queryPerBatch, c.numCandidates, c.stableAfter, c.numProbes,
+        res.buildSec, res.qps, res.p50Ms, res.p99Ms, res.recall);
+    for(const StageStats& st:res.stages.stages){
+        ret += fmt::format(",{:.6f},{:.4f}", st.total_sec(), st.quantile_ms(0.99));
+    }
+    return ret + "\n";
+}
+static string to_json(const BenchResult& res)
+{
+    const BenchConfig& c = res.config;
+    return fmt::format("{{\"nLines\": {}, \"r\": {}, \"k\": {}, \"queryPerBatch\": {}, \"numCandidates\": {}, \"stableAfter\": {}, \"numProbes\": {}, "
+        "\"build_s\": {:.4f}, \"qps\": {:.1f}, \"p50_ms\": {:.3f}, \"p99_ms\": {:.3f}, \"recall\": {:.4f}, \"stages\": {}}}",
+        c.nLines, c.r, c.k, c.queryPerBatch, c.numCandidates, c.stableAfter, c.numProbes,
+        res.buildSec, res.qps, res.p50Ms, res.p99Ms, res.recall, res.stages.to_json());
+}
+
+//sweep the parameters of Genie4l2 on a dataset (or a synthetic gaussian mixture) and report
+//build time, time per query stage, qps, latency percentiles and recall@k of every combination
+int main(int argc, char **argv)
+{
+    int n, qn, d, numClusters, GPUID;
+    uint64_t seed;
+    bool flatBaseline;
+    string datasetFilename, queryFilename, backend, format, outputFilename;
+    string nLinesList, rList, kList, batchList, candidatesList, stableAfterList, probesList;
+
+    options_description desc("Allowed options");
+    desc.add_options()
+        ("help,h", "produce help message")
+
+        ("n,n", value(&n)->default_value(100000), "the number of data points")
+        ("d,d", value(&d)->default_value(64), "the dimension of data")
+        ("qn,q", value(&qn)->default_value(1000), "the number of query points")
+        ("dataset_filename,D", value(&datasetFilename)->default_value(""), "path to dataset filename, a synthetic gaussian mixture if empty")
+        ("queryset_filename,Q", value(&queryFilename)->default_value(""), "path to query filename, drawn from the synthetic mixture if empty")
+        ("clusters", value(&numClusters)->default_value(100), "#gaussians of the synthetic mixture")
+        ("seed", value(&seed)->default_value(1), "seed of the synthetic mixture")
+
+        ("nLines,L", value(&nLinesList)->default_value("64"), "comma separated #projection lines to sweep")
+        ("r,r", value(&rList)->default_value("2"), "comma separated projection radii to sweep")
+        ("k,k", value(&kList)->default_value("10"), "comma separated k to sweep")
+        ("queryPerBatch,b", value(&batchList)->default_value("256"), "comma separated #query per batch to sweep")
+        ("candidates", value(&candidatesList)->default_value("0"), "comma separated #candidates per query to sweep, 0 for 3*k+3*nLines")
+        ("stable_after", value(&stableAfterList)->default_value("0"), "comma separated --stable_after of re-ranking to sweep, 0 for never")
+        ("probes", value(&probesList)->default_value("0"), "comma separated #probes per query to sweep (multi-probe, cpu backend only), 0 for none")
+        ("flat", bool_switch(&flatBaseline), "also run the exact scan of FlatIndex for each k and #query per batch, reported with nLines 0")
+
+        ("backend", value(&backend)->default_value("cpu"), "bucketer backend: genie (gpu) or cpu")
+        ("GPUID", value(&GPUID)->default_value(0), "GPUID used for genie")
+        ("format", value(&format)->default_value("json"), "json or csv")
+        ("output_filename,O", value(&outputFilename)->default_value(""), "where the results go, stdout if empty (anything else printed goes to stderr)")
+    ;
+
+    variables_map vm;
+    try {
+        store(parse_command_line(argc, argv, desc), vm);
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 1;
+        }
+        notify(vm);
+    } catch (const boost::program_options::error & e) {
+        std::cout << e.what() << std::endl << desc << std::endl;
+        return 1;
+    }
+    if(format != "json" && format != "csv") {
+        fmt::print("Unknown format {}\n", format);
+        return 1;
+    }
+    if(backend != "cpu" && backend != "genie") {
+        fmt::print("Unknown backend {}\n", backend);
+        return 1;
+    }
+
+    //the results go to the real stdout, everything else printed goes to stderr
+    FILE* out = nullptr;
+    if(outputFilename.empty()) {
+        fflush(stdout);
+        out = fdopen(dup(1), "w");
+        dup2(2, 1);
+    } else {
+        out = fopen(outputFilename.c_str(), "w");
+    }
+    if(out == nullptr) {
+        fmt::print("Could not open {}\n", outputFilename);
+        return 1;
+    }
+
+    Matrix<float> data, queries;
+    if(datasetFilename != "") {
+        if(read_data_binary(n, d, datasetFilename.c_str(), data) == 1) {
+            fmt::print("Reading dataset error!\n");
+            return 1;
+        }
+    }
+    GaussianMixture mixture(d, numClusters, seed);
+    if(datasetFilename == "") {
+        data = mixture.sample(n, 0);
+    }
+    if(queryFilename != "") {
+        if(read_data_binary(qn, d, queryFilename.c_str(), queries) == 1) {
+            fmt::print("Reading query set error!\n");
+            return 1;
+        }
+    } else {
+        queries = mixture.sample(qn, 1);
+    }
+
+    vector<BenchConfig> configs;
+    auto ks = parse_list<int>(kList);
+    if(flatBaseline) {
+        for(int k:ks) {
+            for(int b:parse_list<int>(batchList)) {
+                configs.push_back(BenchConfig{0, 0., k, b, 0, 0, 0});
+            }
+        }
+    }
+    for(int nLines:parse_list<int>(nLinesList)) {
+        for(double r:parse_list<double>(rList)) {
+            for(int k:ks) {
+                for(int b:parse_list<int>(batchList)) {
+                    for(int c:parse_list<int>(candidatesList)) {
+                        for(int s:parse_list<int>(stableAfterList)) {
+                            for(int p:parse_list<int>(probesList)) {
+                                configs.push_back(BenchConfig{nLines, r, k, b, c, s, p});
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    if(configs.empty() || ks.empty()) {
+        fmt::print("Nothing to sweep\n");
+        return 1;
+    }
+
+    MyTimer::pusht();
+    auto truth = exact_knn(data.view(), queries.view(), *std::max_element(ks.begin(), ks.end()));
+    fmt::print("exact top-k of {} queries over {} rows, time={}\n", queries.rows, data.rows, MyTimer::popt());
+
+    if(format == "csv") {
+        fmt::print(out, "{}", to_csv_header());
+    } else {
+        fmt::print(out, "[\n");
+    }
+    for(size_t i=0;i<configs.size();i++){
+        const BenchConfig& c = configs[i];
+        fmt::print("config {}/{}: nLines={} r={} k={} queryPerBatch={} candidates={} stable_after={} probes={}\n",
+            i+1, configs.size(), c.nLines, c.r, c.k, c.queryPerBatch, c.numCandidates, c.stableAfter, c.numProbes);
+        BenchResult res = backend == "cpu" ? run_config<CpuBucketer>(c, data, queries, truth, GPUID)
+            : run_config<GenieBucketer>(c, data, queries, truth, GPUID);
+        if(format == "csv") {
+            fmt::print(out, "{}", to_csv(res));
+        } else {
+            fmt::print(out, "  {}{}\n", to_json(res), i+1 < configs.size() ? "," : "");
+        }
+        fflush(out);
+    }
+    if(format == "json") {
+        fmt::print(out, "]\n");
+    }
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,319 @@
+#include "cpu_bucketer.h"
+#include "parallel.h"
+#include "index_file.h"
+#include "stage_stats.h"
+
+#include <algorithm>
+#include <climits>
+#include <type_traits>
+#include <cassert>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+//append i to out for every counts[i] >= thr, thr should be positive
+static void collect_ge(const uint16_t* counts, int n, uint16_t thr, std::vector<int>& out)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    //counts[i] >= thr iff counts[i] -sat (thr-1) != 0
+    const __m256i vthr = _mm256_set1_epi16(short(thr-1));
+    const __m256i zero = _mm256_setzero_si256();
+    for(;i+16<=n;i+=16){
+        __m256i v = _mm256_loadu_si256((const __m256i*)(counts+i));
+        __m256i eq = _mm256_cmpeq_epi16(_mm256_subs_epu16(v, vthr), zero);
+        unsigned mask = ~unsigned(_mm256_movemask_epi8(eq));
+        while(mask) {
+            int bit = __builtin_ctz(mask);
+            out.push_back(i + bit/2);
+            mask &= ~(3u << bit);
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i vthr = _mm_set1_epi16(short(thr-1));
+    const __m128i zero = _mm_setzero_si128();
+    for(;i+8<=n;i+=8){
+        __m128i v = _mm_loadu_si128((const __m128i*)(counts+i));
+        __m128i eq = _mm_cmpeq_epi16(_mm_subs_epu16(v, vthr), zero);
+        unsigned mask = ~unsigned(_mm_movemask_epi8(eq)) & 0xffffu;
+        while(mask) {
+            int bit = __builtin_ctz(mask);
+            out.push_back(i + bit/2);
+            mask &= ~(3u << bit);
+        }
+    }
+#endif
+    for(;i<n;i++){
+        if(counts[i] >= thr) {
+            out.push_back(i);
+        }
+    }
+}
+
+
+CpuBucketer::CpuBucketer(int topk, int queryPerBatch, int GPUID, int sigDim)
+    :topk(topk), queryPerBatch(queryPerBatch), GPUID(GPUID), sigDim(sigDim)
+{
+    //counts are uint16, up to sigDim*probeScale with multi-probe
+    assert(sigDim*probeScale < 65535);
+}
+
+
+void CpuBucketer::build(SigView sigs, const uint8_t* skip)
+{
+    assert(sigs.rows == 0 || sigs.cols == sigDim);
+    numObjects = sigs.rows;
+
+    //per-thread value range of each dimension over chunks of rows, then merged
+    const int nThreads = get_num_threads();
+    std::vector<int> mins(size_t(nThreads)*sigDim, INT_MAX), maxs(size_t(nThreads)*sigDim, INT_MIN);
+    parallel_for(0, numObjects, rowsPerChunk, [&](int tid, int beg, int end){
+        int* lo = &mins[size_t(tid)*sigDim];
+        int* hi = &maxs[size_t(tid)*sigDim];
+        for(int i=beg;i<end;i++){
+            if(skip != nullptr && skip[i]) {
+                continue;
+            }
+            const SigValue* sig = sigs.row(i);
+            for(int d=0;d<sigDim;d++){
+                lo[d] = std::min<int>(lo[d], sig[d]);
+                hi[d] = std::max<int>(hi[d], sig[d]);
+            }
+        }
+    }, nThreads);
+    minValues.assign(sigDim, 0);
+    std::vector<int> maxValues(sigDim, -1);
+    for(int d=0;d<sigDim && numObjects>0;d++){
+        minValues[d] = INT_MAX;
+        maxValues[d] = INT_MIN;
+        for(int t=0;t<nThreads;t++){
+            minValues[d] = std::min(minValues[d], mins[size_t(t)*sigDim + d]);
+            maxValues[d] = std::max(maxValues[d], maxs[size_t(t)*sigDim + d]);
+        }
+        //all rows skipped
+        if(minValues[d] > maxValues[d]) {
+            minValues[d] = 0;
+            maxValues[d] = -1;
+        }
+    }
+
+    listBase.resize(sigDim+1);
+    listBase[0] = 0;
+    for(int d=0;d<sigDim;d++){
+        listBase[d+1] = listBase[d] + (maxValues[d] - minValues[d] + 1);
+    }
+
+    //counting sort, each dimension owns a disjoint range of lists so dimensions are built in parallel
+    listOffsets.assign(listBase[sigDim]+1, 0);
+    parallel_for(0, sigDim, 1, [&](int , int dbeg, int dend){
+        for(int d=dbeg;d<dend;d++){
+            int64_t* sizes = listOffsets.data() + listBase[d] + 1;
+            for(int i=0;i<numObjects;i++){
+                if(skip == nullptr || !skip[i]) {
+                    sizes[sigs.row(i)[d] - minValues[d]]++;
+                }
+            }
+        }
+    });
+    for(int l=1;l<listOffsets.size();l++){
+        listOffsets[l] += listOffsets[l-1];
+    }
+
+    postings.resize(listOffsets.back());
+    parallel_for(0, sigDim, 1, [&](int , int dbeg, int dend){
+        for(int d=dbeg;d<dend;d++){
+            std::vector<int64_t> cursor(listOffsets.begin()+listBase[d], listOffsets.begin()+listBase[d+1]);
+            for(int i=0;i<numObjects;i++){
+                if(skip == nullptr || !skip[i]) {
+                    postings[cursor[sigs.row(i)[d] - minValues[d]]++] = i;
+                }
+            }
+        }
+    });
+}
+
+
+void CpuBucketer::query_one(const SigValue* querySig, const Probe* probes, int numProbes, Scratch& scratch, std::vector<Candidate>& ret) const
+{
+    //hist[c] is the number of objects whose count is at least c
+    std::vector<uint16_t>& counts = scratch.counts;
+    std::vector<int>& hist = scratch.hist;
+    std::vector<int>& touched = scratch.touched;
+    ret.clear();
+    //before counting, the scratch has to be left clean on every return
+    if(topk <= 0) {
+        return ;
+    }
+    int maxCount = 0;
+    //the lists of the query, -1 for a value without a list
+    auto list_of = [&](int d, int value){
+        int v = value - minValues[d];
+        return v < 0 || v >= listBase[d+1] - listBase[d] ? -1 : listBase[d] + v;
+    };
+    auto count_list = [&](int l, int weight, auto track){
+        if(l < 0) {
+            return ;
+        }
+        const int* it  = postings.data() + listOffsets[l];
+        const int* end = postings.data() + listOffsets[l+1];
+        for(;it<end;++it){
+            if(track && counts[*it] == 0) {
+                touched.push_back(*it);
+            }
+            int c = counts[*it] += weight;
+            for(int j=c-weight+1;j<=c;j++){
+                hist[j]++;
+            }
+        }
+        maxCount += (end != postings.data() + listOffsets[l]) * weight;
+    };
+    auto list_size = [&](int l){
+        return l < 0 ? 0 : listOffsets[l+1] - listOffsets[l];
+    };
+    //a query whose lists hold a large part of the objects scans all counts afterwards, otherwise it tracks
+    //the ids it touches and only looks at those, which keeps a query on a large index from costing O(#objects)
+    int64_t postingsLooked = 0;
+    for(int d=0;d<sigDim;d++){
+        postingsLooked += list_size(list_of(d, querySig[d]));
+    }
+    for(int j=0;j<numProbes;j++){
+        postingsLooked += probes[j].weight > 0 ? list_size(list_of(probes[j].dim, probes[j].value)) : 0;
+    }
+    const bool dense = postingsLooked > numObjects / 8;
+    const int weight = numProbes > 0 ? probeScale : 1;
+    auto count_all = [&](auto track){
+        StageTimer<Stage::Match> timer;
+        for(int d=0;d<sigDim;d++){
+            count_list(list_of(d, querySig[d]), weight, track);
+        }
+        for(int j=0;j<numProbes;j++){
+            if(probes[j].weight > 0) {
+                count_list(list_of(probes[j].dim, probes[j].value), probes[j].weight, track);
+            }
+        }
+    };
+    //tracking is a compile-time switch such that the dense loop is the plain one
+    if(dense) {
+        count_all(std::false_type());
+    } else {
+        count_all(std::true_type());
+    }
+    StageTimer<Stage::Extract> timer;
+    //an object has one value per dimension, so it matches at most one of the lists looked up there
+    maxCount = std::min(maxCount, sigDim*weight);
+
+    //nothing was counted
+    if(maxCount == 0 || hist[1] == 0) {
+        std::fill(hist.begin(), hist.begin()+maxCount+2, 0);
+        touched.clear();
+        return ;
+    }
+    while(hist[maxCount] == 0) {
+        --maxCount;
+    }
+
+    //the threshold is the largest count such that at least topk objects reach it
+    int thr = maxCount;
+    while(thr > 1 && hist[thr] < topk) {
+        --thr;
+    }
+
+    //selected is ascending by id either way
+    std::vector<int>& selected = scratch.selected;
+    selected.clear();
+    if(dense) {
+        collect_ge(&counts[0], numObjects, thr, selected);
+    } else {
+        for(int id:touched){
+            if(counts[id] >= thr) {
+                selected.push_back(id);
+            }
+        }
+        std::sort(selected.begin(), selected.end());
+    }
+
+    //counting sort by count descendingly, ties on the threshold are cut at topk
+    int nret = std::min(topk, hist[thr]);
+    ret.resize(nret);
+    std::vector<int> cursor(maxCount+2);
+    for(int c=thr;c<=maxCount;c++){
+        cursor[c] = hist[c+1];
+    }
+    for(int id:selected){
+        int pos = cursor[counts[id]]++;
+        if(pos < nret) {
+            ret[pos] = Candidate{id, counts[id]};
+        }
+    }
+
+    if(dense) {
+        std::fill(counts.begin(), counts.end(), 0);
+    } else {
+        for(int id:touched){
+            counts[id] = 0;
+        }
+    }
+    touched.clear();
+    std::fill(hist.begin(), hist.begin()+maxCount+2, 0);
+}
+
+
+std::vector<std::vector<Candidate> > CpuBucketer::batch_query(SigView querySigs, const ProbeList& probes)
+{
+    assert(querySigs.rows == 0 || querySigs.cols == sigDim);
+    assert(probes.empty() || probes.rows == querySigs.rows);
+    const size_t histSize = size_t(sigDim)*(probes.empty() ? 1 : probeScale) + 2;
+    std::vector<std::vector<Candidate> > ret(querySigs.size());
+
+    int nThreads = std::min<int>(get_num_threads(), querySigs.size());
+    std::vector<std::unique_ptr<Scratch> > scratches(std::max(nThreads, 1));
+    for(auto& scratch:scratches){
+        scratch = scratchPool->take();
+    }
+    parallel_for(0, querySigs.size(), 1, [&](int tid, int qbeg, int qend){
+        Scratch& scratch = *scratches[tid];
+        //a scratch is left clean by every query, so it only has to be sized
+        if(scratch.counts.size() != numObjects) {
+            scratch.counts.assign(numObjects, 0);
+        }
+        if(scratch.hist.size() < histSize) {
+            scratch.hist.assign(histSize, 0);
+        }
+        for(int i=qbeg;i<qend;i++){
+            query_one(querySigs.row(i), probes.empty() ? nullptr : probes.row(i), probes.perRow, scratch, ret[i]);
+        }
+    }, nThreads);
+    for(auto& scratch:scratches){
+        scratchPool->give(std::move(scratch));
+    }
+    return ret;
+}
+
+void CpuBucketer::save_flat(IndexWriter& w, const std::string& prefix) const
+{
+    w.add_value(prefix + "topk", topk);
+    w.add_value(prefix + "queryPerBatch", queryPerBatch);
+    w.add_value(prefix + "GPUID", GPUID);
+    w.add_value(prefix + "sigDim", sigDim);
+    w.add_value(prefix + "numObjects", numObjects);
+    w.add_array(prefix + "minValues", minValues);
+    w.add_array(prefix + "listBase", listBase);
+    w.add_array(prefix + "listOffsets", listOffsets);
+    w.add_array(prefix + "postings", postings);
+}
+
+void CpuBucketer::load_flat(const IndexReader& r, const std::string& prefix)
+{
+    topk = r.value<int>(prefix + "topk");
+    queryPerBatch = r.value<int>(prefix + "queryPerBatch");
+    GPUID = r.value<int>(prefix + "GPUID");
+    sigDim = r.value<int>(prefix + "sigDim");
+    numObjects = r.value<int>(prefix + "numObjects");
+    minValues = r.array<int>(prefix + "minValues");
+    listBase = r.array<int>(prefix + "listBase");
+    listOffsets = r.array<int64_t>(prefix + "listOffsets");
+    postings = r.array<int>(prefix + "postings");
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include <boost/serialization/vector.hpp>
+
+#include "flat_array.h"
+#include "signatures.h"
+
+//bucketer running on cpu, with the same build/batch_query contract as GenieBucketer
+//posting lists are kept flat: one list per (dimension, signature value)
+class CpuBucketer
+{
+public:
+    CpuBucketer() {};
+    //GPUID is not used, it is kept such that CpuBucketer is a drop-in of GenieBucketer
+    CpuBucketer(int topk, int queryPerBatch, int GPUID, int sigDim);
+
+    //rows i with skip[i] != 0 are left out of every list but keep their ids
+    void build(SigView sigs, const uint8_t* skip=nullptr);
+    //given sigs of queries, return the candidates set for each query with their counts, ordered by count descendingly
+    //with probes, a query's own values count probeScale and each probe its weight, see signatures.h
+    std::vector<std::vector<Candidate> > batch_query(SigView querySigs, const ProbeList& probes=ProbeList());
+    const static bool usesProbes = true;
+    //nothing to select on cpu, see GenieBucketer::select_device
+    static void select_device(int ) {}
+
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int )
+    {
+        ar & topk;
+        ar & queryPerBatch;
+        ar & GPUID;
+        ar & sigDim;
+        ar & numObjects;
+        ar & minValues;
+        ar & listBase;
+        ar & listOffsets;
+        ar & postings;
+    }
+
+    //see index_file.h, the posting lists are used in place from the mapped file
+    void save_flat(IndexWriter& w, const std::string& prefix) const;
+    void load_flat(const IndexReader& r, const std::string& prefix);
+
+    int topk;
+    int queryPerBatch;
+    int GPUID;
+    int sigDim;
+    //granularity of the row loops of build
+    const static int rowsPerChunk = 4096;
+
+    int numObjects = 0;
+    //the list of value v in dimension d is listBase[d] + v - minValues[d]
+    //listBase has sigDim+1 entries such that the value range of dimension d can be recovered
+    FlatArray<int> minValues;
+    FlatArray<int> listBase;
+    //postings[listOffsets[l], listOffsets[l+1]) are the ids in list l
+    FlatArray<int64_t> listOffsets;
+    FlatArray<int> postings;
+
+private:
+    //scratch of one worker thread, all zero between queries
+    struct Scratch
+    {
+        std::vector<uint16_t> counts;
+        std::vector<int> hist;
+        //ids whose count is not zero
+        std::vector<int> touched;
+        std::vector<int> selected;
+    };
+    //scratches kept across batch_query calls, which may run concurrently
+    struct ScratchPool
+    {
+        std::unique_ptr<Scratch> take()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if(free.empty()) {
+                return std::unique_ptr<Scratch>(new Scratch());
+            }
+            auto ret = std::move(free.back());
+            free.pop_back();
+            return ret;
+        }
+        void give(std::unique_ptr<Scratch> scratch)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            free.push_back(std::move(scratch));
+        }
+
+        std::mutex mtx;
+        std::vector<std::unique_ptr<Scratch> > free;
+    };
+    //shared by copies, a scratch of another size is resized when taken
+    std::shared_ptr<ScratchPool> scratchPool = std::make_shared<ScratchPool>();
+
+    void query_one(const SigValue* querySig, const Probe* probes, int numProbes, Scratch& scratch, std::vector<Candidate>& ret) const;
+};
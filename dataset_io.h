@@ -0,0 +1,340 @@
+#pragma once
+
+//reading/writing datasets (.dsb/.qb: n x d float32, row by row) and ground truth (.l2)
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fmt/format.h>
+
+#include "util.h"
+#include "matrix.h"
+
+//read-only memory mapping of a file, or of the bytes [offset, offset+bytes) of it
+class MappedFile
+{
+public:
+    MappedFile() {}
+    //advice is passed to madvise, e.g. MADV_WILLNEED, MADV_SEQUENTIAL, MADV_RANDOM
+    MappedFile(const char *fname, int advice=MADV_NORMAL)
+    {
+        open(fname, advice);
+    }
+    ~MappedFile()
+    {
+        close();
+    }
+    MappedFile(const MappedFile& ) = delete;
+    MappedFile& operator=(const MappedFile& ) = delete;
+    MappedFile(MappedFile&& other)
+    {
+        *this = std::move(other);
+    }
+    MappedFile& operator=(MappedFile&& other)
+    {
+        if(this != &other) {
+            close();
+            std::swap(ptr, other.ptr);
+            std::swap(len, other.len);
+            std::swap(skip, other.skip);
+        }
+        return *this;
+    }
+
+    //return 0 on success, only the bytes [offset, offset+bytes) are mapped, to the end of the file by default,
+    //data() and size() refer to them
+    int open(const char *fname, int advice=MADV_NORMAL, size_t offset=0, size_t bytes=size_t(-1))
+    {
+        close();
+        int fd = ::open(fname, O_RDONLY);
+        if(fd < 0) {
+            return 1;
+        }
+        struct stat st;
+        if(fstat(fd, &st) != 0) {
+            ::close(fd);
+            return 1;
+        }
+        size_t fileSize = st.st_size;
+        offset = std::min(offset, fileSize);
+        bytes = std::min(bytes, fileSize - offset);
+        //mmap requires a page aligned offset
+        const size_t pageSize = sysconf(_SC_PAGESIZE);
+        skip = offset % pageSize;
+        len = skip + bytes;
+        if(bytes > 0) {
+            void *p = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, offset - skip);
+            if(p == MAP_FAILED) {
+                ::close(fd);
+                len = 0;
+                skip = 0;
+                return 1;
+            }
+            ptr = static_cast<char*>(p);
+            advise(advice);
+        }
+        //the mapping stays valid after the fd is closed
+        ::close(fd);
+        return 0;
+    }
+
+    void close()
+    {
+        if(ptr != nullptr) {
+            munmap(ptr, len);
+        }
+        ptr = nullptr;
+        len = 0;
+        skip = 0;
+    }
+
+    //advice for the bytes [offset, offset+bytes) of data(), all of them by default
+    void advise(int advice, size_t offset=0, size_t bytes=size_t(-1)) const
+    {
+        if(ptr == nullptr || offset >= size()) {
+            return ;
+        }
+        //madvise requires a page aligned address
+        const size_t pageSize = sysconf(_SC_PAGESIZE);
+        offset += skip;
+        size_t beg = offset / pageSize * pageSize;
+        size_t end = std::min(len, bytes == size_t(-1) ? len : offset + bytes);
+        madvise(ptr + beg, end - beg, advice);
+    }
+
+    bool is_open() const
+    {
+        return ptr != nullptr;
+    }
+    const char* data() const
+    {
+        return ptr + skip;
+    }
+    size_t size() const
+    {
+        return len - skip;
+    }
+
+private:
+    //the mapping is [ptr, ptr+len), the mapped bytes start skip bytes into it at a page boundary
+    char *ptr = nullptr;
+    size_t len = 0;
+    size_t skip = 0;
+};
+
+// -----------------------------------------------------------------------------
+inline int map_data_binary(					// map data/query set from disk without copying
+	int   n,							// number of data/query objects
+	int   d,			 				// dimensionality
+	const char *fname,					// address of data/query set
+	MappedFile& file,					// keeps the mapping alive (return)
+	MatrixView<float>& data,				// view of the data/query objects (return)
+	int advice=MADV_WILLNEED,
+	int begin=0,						// only rows [begin, end) are mapped into data,
+	int end=-1)							// all n rows by default
+{
+    if (end < 0) {
+        end = n;
+    }
+    const size_t rowBytes = size_t(d)*sizeof(float);
+	if (file.open(fname, advice, begin*rowBytes, size_t(end - begin)*rowBytes) != 0) {
+        fmt::print("Could not open {}\n", fname);
+		return 1;
+	}
+    if (file.size() < size_t(end - begin)*rowBytes) {
+        fmt::print("{} is too small for {} x {} floats\n", fname, n, d);
+        return 1;
+    }
+    data = MatrixView<float>(reinterpret_cast<const float*>(file.data()), end - begin, d, d);
+	return 0;
+}
+
+// -----------------------------------------------------------------------------
+inline int read_data_binary(					// read data/query set from disk
+	int   n,							// number of data/query objects
+	int   d,			 				// dimensionality
+	const char *fname,					// address of data/query set
+	Matrix<float>& data,						// data/query objects (return)
+	int begin=0,						// only rows [begin, end) are read into data,
+	int end=-1)							// all n rows by default
+{
+    if (end < 0) {
+        end = n;
+    }
+	FILE *fp = fopen(fname, "rb");
+	if (!fp) {
+        fmt::print("Could not open {}\n", fname);
+		return 1;
+	}
+    if (fseeko(fp, off_t(begin)*d*sizeof(float), SEEK_SET) != 0) {
+        fmt::print("Could not seek to row {} of {}\n", begin, fname);
+        fclose(fp);
+        return 1;
+    }
+
+    //rows are read one by one since the stride of data is padded
+    data.resize(end - begin, d);
+	int i   = 0;
+	while (!feof(fp) && i < end - begin) {
+		if (fread(data.row(i), sizeof(float), d, fp) != d) {
+            break;
+        }
+		++i;
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+//binary ground truth: magic, qn, maxk, then qn*maxk records of (int32 id, float32 dist)
+const static char GT_BINARY_MAGIC[4] = {'G', 'T', 'B', '1'};
+
+// -----------------------------------------------------------------------------
+inline int read_ground_truth_binary(		// read binary ground truth results from disk
+	int qn,								// number of query objects, all of the file if negative
+	const char *fname,					// address of truth set
+	std::vector<std::vector<Result> >& R)							// ground truth results (return)
+{
+    MappedFile file(fname, MADV_SEQUENTIAL);
+    if (!file.is_open() || file.size() < 12 || memcmp(file.data(), GT_BINARY_MAGIC, 4) != 0) {
+        fmt::print("Could not open {} as binary ground truth\n", fname);
+        return 1;
+    }
+    int32_t header[2];
+    memcpy(header, file.data()+4, sizeof(header));
+    int fileqn = header[0];
+    int maxk = header[1];
+    if (qn < 0) {
+        qn = fileqn;
+    }
+    if (fileqn < 0 || maxk < 0 || fileqn < qn || file.size() < 12 + size_t(fileqn)*maxk*8) {
+        fmt::print("{} is truncated\n", fname);
+        return 1;
+    }
+
+    const char *p = file.data() + 12;
+    R.resize(qn);
+    for (int i = 0; i < qn; ++i) {
+        R[i].resize(maxk);
+        for (int j = 0; j < maxk; ++j, p += 8) {
+            memcpy(&R[i][j].id_, p, 4);
+            memcpy(&R[i][j].key_, p+4, 4);
+        }
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+inline bool is_ground_truth_binary(const char *fname)
+{
+	FILE *fp = fopen(fname, "rb");
+	if (!fp) {
+		return false;
+	}
+    char magic[4];
+    bool ret = fread(magic, 1, 4, fp) == 4 && memcmp(magic, GT_BINARY_MAGIC, 4) == 0;
+    fclose(fp);
+    return ret;
+}
+
+// -----------------------------------------------------------------------------
+inline int read_ground_truth(				// read ground truth results from disk, text or binary
+	int qn,								// number of query objects
+	const char *fname,					// address of truth set
+	std::vector<std::vector<Result> >& R)							// ground truth results (return)
+{
+    if (is_ground_truth_binary(fname)) {
+        return read_ground_truth_binary(qn, fname, R);
+    }
+
+	FILE *fp = fopen(fname, "r");
+	if (!fp) {
+        fmt::print("Could not open {}\n", fname);
+		return 1;
+	}
+
+	int tmp1 = -1;
+	int maxk = -1;
+	fscanf(fp, "%d %d\n", &tmp1, &maxk);
+//	assert(tmp1 == qn && tmp2 == MAXK);
+	assert(maxk == MAXK);
+
+    R.resize(qn);
+	for (int i = 0; i < qn; ++i) {
+        R[i].resize(maxk);
+		for (int j = 0; j < maxk; ++j) {
+			fscanf(fp, "%d %f ", &R[i][j].id_, &R[i][j].key_);
+		}
+		fscanf(fp, "\n");
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+// -----------------------------------------------------------------------------
+inline int write_ground_truth(				// write ground truth results in the text format
+	const char *fname,					// address of truth set
+	const std::vector<std::vector<Result> >& R)
+{
+	FILE *fp = fopen(fname, "w");
+	if (!fp) {
+        fmt::print("Could not open {}\n", fname);
+		return 1;
+	}
+    int maxk = R.empty() ? 0 : R[0].size();
+	bool ok = fprintf(fp, "%d %d\n", int(R.size()), maxk) >= 0;
+	for (int i = 0; ok && i < R.size(); ++i) {
+		for (int j = 0; ok && j < maxk; ++j) {
+			ok = fprintf(fp, "%d %f ", R[i][j].id_, R[i][j].key_) >= 0;
+		}
+		ok = ok && fprintf(fp, "\n") >= 0;
+	}
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok) {
+        fmt::print("Could not write {}\n", fname);
+        return 1;
+    }
+	return 0;
+}
+
+// -----------------------------------------------------------------------------
+inline int write_ground_truth_binary(		// write ground truth results in the binary format
+	const char *fname,					// address of truth set
+	const std::vector<std::vector<Result> >& R)
+{
+	FILE *fp = fopen(fname, "wb");
+	if (!fp) {
+        fmt::print("Could not open {}\n", fname);
+		return 1;
+	}
+    int32_t header[2] = {int32_t(R.size()), int32_t(R.empty() ? 0 : R[0].size())};
+    bool ok = fwrite(GT_BINARY_MAGIC, 1, 4, fp) == 4;
+    ok = ok && fwrite(header, sizeof(int32_t), 2, fp) == 2;
+
+    std::vector<char> buf(size_t(header[1])*8);
+	for (int i = 0; ok && i < R.size(); ++i) {
+        assert(R[i].size() == header[1]);
+		for (int j = 0; j < header[1]; ++j) {
+            memcpy(&buf[j*8], &R[i][j].id_, 4);
+            memcpy(&buf[j*8+4], &R[i][j].key_, 4);
+		}
+        ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size();
+	}
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok) {
+        fmt::print("Could not write {}\n", fname);
+        return 1;
+    }
+	return 0;
+}
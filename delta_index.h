@@ -0,0 +1,390 @@
+#pragma once
+
+//buckets of an index that accepts inserts and removes after build
+//
+//  main table:  the Bucketer built on the signatures of rows [0, mainRows), immutable
+//  delta:       posting lists of the rows inserted since, small and mutable
+//  tombstones:  removed ids, dropped from the candidates until a compaction leaves them out of the main table
+//
+//ids are never reused: rows the index was built on keep their position in the dataset and inserted rows
+//get the ids after them, their vectors are kept in extraObjects
+//compaction builds a new main table on the signatures of all rows not removed without blocking queries and
+//swaps it in under the write lock; it runs on a background thread once the delta reaches autoCompactRows, or by compact()
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+
+#include <fmt/format.h>
+
+#include "matrix.h"
+#include "flat_array.h"
+#include "signatures.h"
+#include "index_file.h"
+#include "stage_stats.h"
+
+//posting lists of the rows [firstId, firstId+rows), one list per (dimension, value) present
+class DeltaPostings
+{
+public:
+    void reset(int sigDim_, int firstId_)
+    {
+        sigDim = sigDim_;
+        firstId = firstId_;
+        rows = 0;
+        lists.clear();
+    }
+
+    void add(const SigValue* sig)
+    {
+        for(int d=0;d<sigDim;d++){
+            lists[key(d, sig[d])].push_back(firstId + rows);
+        }
+        rows++;
+    }
+
+    //at most topk ids matching querySig in the most dimensions with their counts, appended to out by count descendingly
+    //with probes, counted as CpuBucketer::batch_query does
+    void query(const SigValue* querySig, const Probe* probes, int numProbes, int topk, std::vector<Candidate>& out) const
+    {
+        if(rows == 0) {
+            return ;
+        }
+        thread_local std::vector<uint16_t> counts;
+        thread_local std::vector<int> touched;
+        counts.assign(rows, 0);
+        touched.clear();
+        auto count_list = [&](int d, SigValue value, int weight){
+            auto it = lists.find(key(d, value));
+            if(it == lists.end()) {
+                return ;
+            }
+            for(int id:it->second){
+                if(counts[id - firstId] == 0) {
+                    touched.push_back(id - firstId);
+                }
+                counts[id - firstId] += weight;
+            }
+        };
+        const int weight = numProbes > 0 ? probeScale : 1;
+        for(int d=0;d<sigDim;d++){
+            count_list(d, querySig[d], weight);
+        }
+        for(int j=0;j<numProbes;j++){
+            if(probes[j].weight > 0) {
+                count_list(probes[j].dim, probes[j].value, probes[j].weight);
+            }
+        }
+        auto byCount = [&](int a, int b){
+            return counts[a] > counts[b] || (counts[a] == counts[b] && a < b);
+        };
+        int n = std::min<int>(topk, touched.size());
+        std::partial_sort(touched.begin(), touched.begin()+n, touched.end(), byCount);
+        for(int i=0;i<n;i++){
+            out.push_back(Candidate{firstId + touched[i], counts[touched[i]]});
+        }
+    }
+
+    int sigDim = 0;
+    int firstId = 0;
+    int rows = 0;
+
+private:
+    static uint64_t key(int d, SigValue v)
+    {
+        return (uint64_t(d) << 32) | v;
+    }
+
+    std::unordered_map<uint64_t, std::vector<int> > lists;
+};
+
+//Bucketer :: GenieBucketer or CpuBucketer, constructed by (topk, queryPerBatch, GPUID, sigDim),
+//with build(sigs, skip) and Bucketer::select_device(GPUID)
+template<class Scalar, class Bucketer>
+class DeltaIndex
+{
+public:
+    DeltaIndex(int topk, int queryPerBatch, int GPUID, int sigDim)
+        :topk(topk), queryPerBatch(queryPerBatch), GPUID(GPUID), sigDim(sigDim),
+        main(std::make_shared<Bucketer>(topk, queryPerBatch, GPUID, sigDim))
+    {
+        delta.reset(sigDim, 0);
+    }
+    ~DeltaIndex()
+    {
+        {
+            std::lock_guard<std::mutex> lock(compactMtx);
+            stopping = true;
+        }
+        compactCond.notify_all();
+        if(compactor.joinable()) {
+            compactor.join();
+        }
+    }
+    DeltaIndex(const DeltaIndex& ) = delete;
+    DeltaIndex& operator=(const DeltaIndex& ) = delete;
+
+    //the rows the index is built on, anything inserted or removed before is dropped
+    void build(SigMatrix sigs)
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(mtx);
+        hashSigs = std::move(sigs);
+        main->build(hashSigs);
+        baseRows = mainRows = hashSigs.rows;
+        delta.reset(sigDim, mainRows);
+        removed.assign(hashSigs.rows, 0);
+        extraObjects = Matrix<Scalar>();
+    }
+
+    //queries (batch_query, extra_objects) have to hold the read lock, which blocks inserts, removes and the swap of compaction
+    std::shared_lock<std::shared_timed_mutex> read_lock() const
+    {
+        return std::shared_lock<std::shared_timed_mutex>(mtx);
+    }
+
+    //candidates of each query from the main table and the delta merged by count descendingly, removed ids are dropped
+    std::vector<std::vector<Candidate> > batch_query(SigView querySigs, const ProbeList& probes=ProbeList()) const
+    {
+        auto ret = main->batch_query(querySigs, probes);
+        StageTimer<Stage::Merge> timer(ret.size());
+        for(int i=0;i<ret.size();i++){
+            size_t numMain = ret[i].size();
+            delta.query(querySigs.row(i), probes.empty() ? nullptr : probes.row(i), probes.perRow, topk, ret[i]);
+            std::inplace_merge(ret[i].begin(), ret[i].begin()+numMain, ret[i].end(), [](const Candidate& a, const Candidate& b){
+                return a.count > b.count;
+            });
+            if(numRemoved > 0) {
+                ret[i].erase(std::remove_if(ret[i].begin(), ret[i].end(), [&](const Candidate& c){
+                    return c.id >= 0 && c.id < removed.size() && removed[c.id] == REMOVED;
+                }), ret[i].end());
+            }
+        }
+        return ret;
+    }
+
+    //vectors of the inserted rows, id baseRows+i is row i
+    MatrixView<Scalar> extra_objects() const
+    {
+        return extraObjects.view();
+    }
+
+    //return the id of the first row
+    int insert(MatrixView<Scalar> objects, SigView sigs)
+    {
+        assert(objects.rows == sigs.rows);
+        int firstId;
+        bool compactNow;
+        {
+            std::unique_lock<std::shared_timed_mutex> lock(mtx);
+            firstId = hashSigs.rows;
+            if(extraObjects.rows == 0) {
+                extraObjects.resize(0, objects.cols);
+            }
+            assert(objects.cols == extraObjects.cols);
+            int oldRows = extraObjects.rows;
+            extraObjects.resize_rows(oldRows + objects.rows);
+            for(int i=0;i<objects.rows;i++){
+                std::copy(objects.row(i), objects.row(i) + objects.cols, extraObjects.row(oldRows + i));
+            }
+            hashSigs.append(sigs);
+            removed.resize(hashSigs.rows, 0);
+            for(int i=0;i<sigs.rows;i++){
+                delta.add(sigs.row(i));
+            }
+            compactNow = autoCompactRows > 0 && delta.rows >= autoCompactRows;
+        }
+        if(compactNow) {
+            request_compaction();
+        }
+        return firstId;
+    }
+
+    //see autoCompactRows
+    void set_auto_compact(int rows)
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(mtx);
+        autoCompactRows = rows;
+    }
+
+    //unknown and already removed ids are ignored
+    void remove(const std::vector<int>& ids)
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(mtx);
+        //an aliased array becomes owned before it is written
+        removed.resize(hashSigs.rows, 0);
+        for(int id:ids){
+            if(id >= 0 && id < removed.size() && !removed[id]) {
+                removed[id] = REMOVED;
+                numRemoved++;
+            }
+        }
+    }
+
+    //build a new main table on all rows not removed and swap it in, the delta is emptied
+    //queries go on meanwhile, only inserts and removes wait for the swap
+    void compact()
+    {
+        std::lock_guard<std::mutex> compacting(compactRunMtx);
+        SigMatrix snapshot;
+        std::vector<uint8_t> skip;
+        {
+            auto lock = read_lock();
+            if(hashSigs.rows == mainRows && numRemoved == 0) {
+                return ;
+            }
+            snapshot = hashSigs;
+            skip.assign(snapshot.rows, 0);
+            std::copy(removed.begin(), removed.begin() + std::min<size_t>(removed.size(), snapshot.rows), skip.begin());
+        }
+        auto fresh = std::make_shared<Bucketer>(topk, queryPerBatch, GPUID, sigDim);
+        fresh->build(snapshot, skip.data());
+
+        //the old table is released after the lock
+        std::shared_ptr<Bucketer> old;
+        int deltaRows;
+        {
+            std::unique_lock<std::shared_timed_mutex> lock(mtx);
+            old = std::move(main);
+            main = std::move(fresh);
+            mainRows = snapshot.rows;
+            //the rows removed before the snapshot are not in any table any more,
+            //only the ones removed during the build are still filtered
+            removed.resize(hashSigs.rows, 0);
+            for(int i=0;i<snapshot.rows;i++){
+                if(skip[i]) {
+                    removed[i] = DROPPED;
+                }
+            }
+            //rows inserted during the build stay in the delta
+            rebuild_delta();
+            deltaRows = delta.rows;
+        }
+        fmt::print("compaction: main table of {} rows, {} left in the delta\n", snapshot.rows, deltaRows);
+    }
+
+    int size() const
+    {
+        auto lock = read_lock();
+        return hashSigs.rows;
+    }
+    int delta_size() const
+    {
+        auto lock = read_lock();
+        return delta.rows;
+    }
+
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int )
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(mtx);
+        ar & baseRows;
+        ar & mainRows;
+        ar & hashSigs;
+        ar & *main;
+        ar & removed;
+        ar & extraObjects;
+        if(Archive::is_loading::value){
+            rebuild_delta();
+        }
+    }
+
+    //see index_file.h
+    void save_flat(IndexWriter& w, const std::string& prefix) const
+    {
+        auto lock = read_lock();
+        w.add_value(prefix + "baseRows", baseRows);
+        w.add_value(prefix + "mainRows", mainRows);
+        hashSigs.save_flat(w, prefix + "hashSigs.");
+        save_flat_component(w, prefix + "bucketer.", *main);
+        w.add_array(prefix + "removed", removed);
+        w.add_matrix(prefix + "extraObjects", extraObjects);
+    }
+    void load_flat(const IndexReader& r, const std::string& prefix)
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(mtx);
+        baseRows = r.value<int>(prefix + "baseRows");
+        mainRows = r.value<int>(prefix + "mainRows");
+        hashSigs.load_flat(r, prefix + "hashSigs.");
+        load_flat_component(r, prefix + "bucketer.", *main);
+        removed = r.array<uint8_t>(prefix + "removed");
+        extraObjects = r.matrix<Scalar>(prefix + "extraObjects");
+        rebuild_delta();
+    }
+
+    int topk;
+    int queryPerBatch;
+    int GPUID;
+    int sigDim;
+
+private:
+    void rebuild_delta()
+    {
+        delta.reset(sigDim, mainRows);
+        for(int i=mainRows;i<hashSigs.rows;i++){
+            delta.add(hashSigs.row(i));
+        }
+        numRemoved = std::count(removed.begin(), removed.end(), REMOVED);
+    }
+
+    void request_compaction()
+    {
+        std::lock_guard<std::mutex> lock(compactMtx);
+        if(!compactor.joinable()) {
+            compactor = std::thread([this](){ compact_loop(); });
+        }
+        compactRequested = true;
+        compactCond.notify_one();
+    }
+
+    void compact_loop()
+    {
+        //the fresh table is built on the device of the index
+        Bucketer::select_device(GPUID);
+        std::unique_lock<std::mutex> lock(compactMtx);
+        for(;;){
+            compactCond.wait(lock, [&](){ return stopping || compactRequested; });
+            if(stopping) {
+                break;
+            }
+            compactRequested = false;
+            lock.unlock();
+            compact();
+            lock.lock();
+        }
+    }
+
+    //guards everything below except the compaction thread state
+    mutable std::shared_timed_mutex mtx;
+    //compact on a background thread once the delta has that many rows, 0 for only explicit compact()
+    int autoCompactRows = 100000;
+    //#rows the index is built on, later ids are rows of extraObjects
+    int baseRows = 0;
+    //#rows in the main table, later ids are in the delta
+    int mainRows = 0;
+    //signatures of all rows
+    SigMatrix hashSigs;
+    std::shared_ptr<Bucketer> main;
+    DeltaPostings delta;
+    //state of each id: 0, REMOVED while still in the main table or the delta and dropped from the candidates,
+    //DROPPED once a compaction left it out of the main table
+    FlatArray<uint8_t> removed;
+    enum : uint8_t {REMOVED = 1, DROPPED = 2};
+    //#ids in state REMOVED, the candidates are filtered only if there are any
+    int64_t numRemoved = 0;
+    Matrix<Scalar> extraObjects;
+
+    //one compaction at a time
+    std::mutex compactRunMtx;
+    std::mutex compactMtx;
+    std::condition_variable compactCond;
+    bool compactRequested = false;
+    bool stopping = false;
+    std::thread compactor;
+};
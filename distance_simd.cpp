@@ -0,0 +1,533 @@
+#include "distance_simd.h"
+#include "util.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GENIE4L2_X86
+#include <immintrin.h>
+#endif
+
+//each kernel is a template on the dimension, D = 0 means the dimension is only known at runtime
+//the common dimensions are instantiated with D fixed such that the loops are fully unrolled
+
+#define DISPATCH_DIM(kernel, dim, x, y) \
+    switch(dim) { \
+        case 128: return kernel<128>(dim, x, y); \
+        case 784: return kernel<784>(dim, x, y); \
+        case 960: return kernel<960>(dim, x, y); \
+        default:  return kernel<0>(dim, x, y); \
+    }
+
+// -----------------------------------------------------------------------------
+//scalar
+
+template<int D>
+static float l2_sqr_scalar(int dim, const float* x, const float* y)
+{
+    const int n = D > 0 ? D : dim;
+    float sum = 0.f;
+    for(int i=0;i<n;i++){
+        sum += sqr(x[i]-y[i]);
+    }
+    return sum;
+}
+
+template<int D>
+static float l1_dist_scalar(int dim, const float* x, const float* y)
+{
+    const int n = D > 0 ? D : dim;
+    float sum = 0.f;
+    for(int i=0;i<n;i++){
+        sum += std::fabs(x[i]-y[i]);
+    }
+    return sum;
+}
+
+template<int D>
+static float inner_product_scalar(int dim, const float* x, const float* y)
+{
+    const int n = D > 0 ? D : dim;
+    float sum = 0.f;
+    for(int i=0;i<n;i++){
+        sum += x[i]*y[i];
+    }
+    return sum;
+}
+
+static float l2_sqr_scalar_dispatch(int dim, const float* x, const float* y) { DISPATCH_DIM(l2_sqr_scalar, dim, x, y) }
+static float l1_dist_scalar_dispatch(int dim, const float* x, const float* y) { DISPATCH_DIM(l1_dist_scalar, dim, x, y) }
+static float inner_product_scalar_dispatch(int dim, const float* x, const float* y) { DISPATCH_DIM(inner_product_scalar, dim, x, y) }
+
+static float sq8_l2_sqr_scalar(int dim, const float* q, const float* w, const uint8_t* code)
+{
+    float sum = 0.f;
+    for(int i=0;i<dim;i++){
+        sum += w[i]*sqr(q[i]-code[i]);
+    }
+    return sum;
+}
+
+static float fp16_l2_sqr_scalar(int dim, const float* q, const uint16_t* x)
+{
+    float sum = 0.f;
+    for(int i=0;i<dim;i++){
+        sum += sqr(q[i]-half_to_float(x[i]));
+    }
+    return sum;
+}
+
+#ifdef GENIE4L2_X86
+
+// -----------------------------------------------------------------------------
+//sse, 4 floats per register, 4 accumulators
+
+__attribute__((target("sse3")))
+static inline float hsum128(__m128 s)
+{
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+template<int D>
+__attribute__((target("sse3")))
+static float l2_sqr_sse(int dim, const float* x, const float* y)
+{
+    const int n = D > 0 ? D : dim;
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps(), acc2 = _mm_setzero_ps(), acc3 = _mm_setzero_ps();
+    int i = 0;
+    for(;i+16<=n;i+=16){
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(x+i), _mm_loadu_ps(y+i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(x+i+4), _mm_loadu_ps(y+i+4));
+        __m128 d2 = _mm_sub_ps(_mm_loadu_ps(x+i+8), _mm_loadu_ps(y+i+8));
+        __m128 d3 = _mm_sub_ps(_mm_loadu_ps(x+i+12), _mm_loadu_ps(y+i+12));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+        acc2 = _mm_add_ps(acc2, _mm_mul_ps(d2, d2));
+        acc3 = _mm_add_ps(acc3, _mm_mul_ps(d3, d3));
+    }
+    for(;i+4<=n;i+=4){
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(x+i), _mm_loadu_ps(y+i));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+    }
+    float sum = hsum128(_mm_add_ps(_mm_add_ps(acc0, acc1), _mm_add_ps(acc2, acc3)));
+    for(;i<n;i++){
+        sum += sqr(x[i]-y[i]);
+    }
+    return sum;
+}
+
+template<int D>
+__attribute__((target("sse3")))
+static float l1_dist_sse(int dim, const float* x, const float* y)
+{
+    const int n = D > 0 ? D : dim;
+    const __m128 signMask = _mm_set1_ps(-0.f);
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps(), acc2 = _mm_setzero_ps(), acc3 = _mm_setzero_ps();
+    int i = 0;
+    for(;i+16<=n;i+=16){
+        acc0 = _mm_add_ps(acc0, _mm_andnot_ps(signMask, _mm_sub_ps(_mm_loadu_ps(x+i), _mm_loadu_ps(y+i))));
+        acc1 = _mm_add_ps(acc1, _mm_andnot_ps(signMask, _mm_sub_ps(_mm_loadu_ps(x+i+4), _mm_loadu_ps(y+i+4))));
+        acc2 = _mm_add_ps(acc2, _mm_andnot_ps(signMask, _mm_sub_ps(_mm_loadu_ps(x+i+8), _mm_loadu_ps(y+i+8))));
+        acc3 = _mm_add_ps(acc3, _mm_andnot_ps(signMask, _mm_sub_ps(_mm_loadu_ps(x+i+12), _mm_loadu_ps(y+i+12))));
+    }
+    for(;i+4<=n;i+=4){
+        acc0 = _mm_add_ps(acc0, _mm_andnot_ps(signMask, _mm_sub_ps(_mm_loadu_ps(x+i), _mm_loadu_ps(y+i))));
+    }
+    float sum = hsum128(_mm_add_ps(_mm_add_ps(acc0, acc1), _mm_add_ps(acc2, acc3)));
+    for(;i<n;i++){
+        sum += std::fabs(x[i]-y[i]);
+    }
+    return sum;
+}
+
+template<int D>
+__attribute__((target("sse3")))
+static float inner_product_sse(int dim, const float* x, const float* y)
+{
+    const int n = D > 0 ? D : dim;
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps(), acc2 = _mm_setzero_ps(), acc3 = _mm_setzero_ps();
+    int i = 0;
+    for(;i+16<=n;i+=16){
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x+i), _mm_loadu_ps(y+i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x+i+4), _mm_loadu_ps(y+i+4)));
+        acc2 = _mm_add_ps(acc2, _mm_mul_ps(_mm_loadu_ps(x+i+8), _mm_loadu_ps(y+i+8)));
+        acc3 = _mm_add_ps(acc3, _mm_mul_ps(_mm_loadu_ps(x+i+12), _mm_loadu_ps(y+i+12)));
+    }
+    for(;i+4<=n;i+=4){
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x+i), _mm_loadu_ps(y+i)));
+    }
+    float sum = hsum128(_mm_add_ps(_mm_add_ps(acc0, acc1), _mm_add_ps(acc2, acc3)));
+    for(;i<n;i++){
+        sum += x[i]*y[i];
+    }
+    return sum;
+}
+
+__attribute__((target("sse3")))
+static float l2_sqr_sse_dispatch(int dim, const float* x, const float* y) { DISPATCH_DIM(l2_sqr_sse, dim, x, y) }
+__attribute__((target("sse3")))
+static float l1_dist_sse_dispatch(int dim, const float* x, const float* y) { DISPATCH_DIM(l1_dist_sse, dim, x, y) }
+__attribute__((target("sse3")))
+static float inner_product_sse_dispatch(int dim, const float* x, const float* y) { DISPATCH_DIM(inner_product_sse, dim, x, y) }
+
+// -----------------------------------------------------------------------------
+//avx2 + fma, 8 floats per register, 4 accumulators
+
+__attribute__((target("avx2,fma")))
+static inline float hsum256(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+template<int D>
+__attribute__((target("avx2,fma")))
+static float l2_sqr_avx2(int dim, const float* x, const float* y)
+{
+    const int n = D > 0 ? D : dim;
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps(), acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+    int i = 0;
+    for(;i+32<=n;i+=32){
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(x+i), _mm256_loadu_ps(y+i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(x+i+8), _mm256_loadu_ps(y+i+8));
+        __m256 d2 = _mm256_sub_ps(_mm256_loadu_ps(x+i+16), _mm256_loadu_ps(y+i+16));
+        __m256 d3 = _mm256_sub_ps(_mm256_loadu_ps(x+i+24), _mm256_loadu_ps(y+i+24));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+        acc2 = _mm256_fmadd_ps(d2, d2, acc2);
+        acc3 = _mm256_fmadd_ps(d3, d3, acc3);
+    }
+    for(;i+8<=n;i+=8){
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(x+i), _mm256_loadu_ps(y+i));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+    }
+    float sum = hsum256(_mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+    for(;i<n;i++){
+        sum += sqr(x[i]-y[i]);
+    }
+    return sum;
+}
+
+template<int D>
+__attribute__((target("avx2,fma")))
+static float l1_dist_avx2(int dim, const float* x, const float* y)
+{
+    const int n = D > 0 ? D : dim;
+    const __m256 signMask = _mm256_set1_ps(-0.f);
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps(), acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+    int i = 0;
+    for(;i+32<=n;i+=32){
+        acc0 = _mm256_add_ps(acc0, _mm256_andnot_ps(signMask, _mm256_sub_ps(_mm256_loadu_ps(x+i), _mm256_loadu_ps(y+i))));
+        acc1 = _mm256_add_ps(acc1, _mm256_andnot_ps(signMask, _mm256_sub_ps(_mm256_loadu_ps(x+i+8), _mm256_loadu_ps(y+i+8))));
+        acc2 = _mm256_add_ps(acc2, _mm256_andnot_ps(signMask, _mm256_sub_ps(_mm256_loadu_ps(x+i+16), _mm256_loadu_ps(y+i+16))));
+        acc3 = _mm256_add_ps(acc3, _mm256_andnot_ps(signMask, _mm256_sub_ps(_mm256_loadu_ps(x+i+24), _mm256_loadu_ps(y+i+24))));
+    }
+    for(;i+8<=n;i+=8){
+        acc0 = _mm256_add_ps(acc0, _mm256_andnot_ps(signMask, _mm256_sub_ps(_mm256_loadu_ps(x+i), _mm256_loadu_ps(y+i))));
+    }
+    float sum = hsum256(_mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+    for(;i<n;i++){
+        sum += std::fabs(x[i]-y[i]);
+    }
+    return sum;
+}
+
+template<int D>
+__attribute__((target("avx2,fma")))
+static float inner_product_avx2(int dim, const float* x, const float* y)
+{
+    const int n = D > 0 ? D : dim;
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps(), acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+    int i = 0;
+    for(;i+32<=n;i+=32){
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x+i), _mm256_loadu_ps(y+i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x+i+8), _mm256_loadu_ps(y+i+8), acc1);
+        acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(x+i+16), _mm256_loadu_ps(y+i+16), acc2);
+        acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(x+i+24), _mm256_loadu_ps(y+i+24), acc3);
+    }
+    for(;i+8<=n;i+=8){
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x+i), _mm256_loadu_ps(y+i), acc0);
+    }
+    float sum = hsum256(_mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+    for(;i<n;i++){
+        sum += x[i]*y[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static float l2_sqr_avx2_dispatch(int dim, const float* x, const float* y) { DISPATCH_DIM(l2_sqr_avx2, dim, x, y) }
+__attribute__((target("avx2,fma")))
+static float l1_dist_avx2_dispatch(int dim, const float* x, const float* y) { DISPATCH_DIM(l1_dist_avx2, dim, x, y) }
+__attribute__((target("avx2,fma")))
+static float inner_product_avx2_dispatch(int dim, const float* x, const float* y) { DISPATCH_DIM(inner_product_avx2, dim, x, y) }
+
+//codes are widened to float in registers, 2 accumulators
+__attribute__((target("avx2,fma")))
+static float sq8_l2_sqr_avx2(int dim, const float* q, const float* w, const uint8_t* code)
+{
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for(;i+16<=dim;i+=16){
+        __m256 c0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(code+i))));
+        __m256 c1 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(code+i+8))));
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(q+i), c0);
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(q+i+8), c1);
+        acc0 = _mm256_fmadd_ps(_mm256_mul_ps(d0, d0), _mm256_loadu_ps(w+i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_mul_ps(d1, d1), _mm256_loadu_ps(w+i+8), acc1);
+    }
+    for(;i+8<=dim;i+=8){
+        __m256 c0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(code+i))));
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(q+i), c0);
+        acc0 = _mm256_fmadd_ps(_mm256_mul_ps(d0, d0), _mm256_loadu_ps(w+i), acc0);
+    }
+    float sum = hsum256(_mm256_add_ps(acc0, acc1));
+    for(;i<dim;i++){
+        sum += w[i]*sqr(q[i]-code[i]);
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static float fp16_l2_sqr_avx2(int dim, const float* q, const uint16_t* x)
+{
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for(;i+16<=dim;i+=16){
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(q+i), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(x+i))));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(q+i+8), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(x+i+8))));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    for(;i+8<=dim;i+=8){
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(q+i), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(x+i))));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+    }
+    float sum = hsum256(_mm256_add_ps(acc0, acc1));
+    for(;i<dim;i++){
+        sum += sqr(q[i]-half_to_float(x[i]));
+    }
+    return sum;
+}
+
+// -----------------------------------------------------------------------------
+//avx512, 16 floats per register, 4 accumulators, the tail is handled by masked loads
+
+__attribute__((target("avx512f")))
+static inline float hsum512(__m512 v)
+{
+    //the maskz forms avoid the undefined registers of the plain intrinsics
+    v = _mm512_add_ps(v, _mm512_maskz_shuffle_f32x4(0xffff, v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm512_add_ps(v, _mm512_maskz_shuffle_f32x4(0xffff, v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    __m128 s = _mm512_maskz_extractf32x4_ps(0xf, v, 0);
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+template<int D>
+__attribute__((target("avx512f")))
+static float l2_sqr_avx512(int dim, const float* x, const float* y)
+{
+    const int n = D > 0 ? D : dim;
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps(), acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+    int i = 0;
+    for(;i+64<=n;i+=64){
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(x+i), _mm512_loadu_ps(y+i));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(x+i+16), _mm512_loadu_ps(y+i+16));
+        __m512 d2 = _mm512_sub_ps(_mm512_loadu_ps(x+i+32), _mm512_loadu_ps(y+i+32));
+        __m512 d3 = _mm512_sub_ps(_mm512_loadu_ps(x+i+48), _mm512_loadu_ps(y+i+48));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+        acc2 = _mm512_fmadd_ps(d2, d2, acc2);
+        acc3 = _mm512_fmadd_ps(d3, d3, acc3);
+    }
+    for(;i+16<=n;i+=16){
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(x+i), _mm512_loadu_ps(y+i));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+    }
+    if(i < n) {
+        __mmask16 mask = __mmask16((1u << (n-i)) - 1);
+        __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x+i), _mm512_maskz_loadu_ps(mask, y+i));
+        acc1 = _mm512_fmadd_ps(d0, d0, acc1);
+    }
+    return hsum512(_mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3)));
+}
+
+template<int D>
+__attribute__((target("avx512f")))
+static float l1_dist_avx512(int dim, const float* x, const float* y)
+{
+    const int n = D > 0 ? D : dim;
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps(), acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+    int i = 0;
+    for(;i+64<=n;i+=64){
+        acc0 = _mm512_add_ps(acc0, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(x+i), _mm512_loadu_ps(y+i))));
+        acc1 = _mm512_add_ps(acc1, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(x+i+16), _mm512_loadu_ps(y+i+16))));
+        acc2 = _mm512_add_ps(acc2, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(x+i+32), _mm512_loadu_ps(y+i+32))));
+        acc3 = _mm512_add_ps(acc3, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(x+i+48), _mm512_loadu_ps(y+i+48))));
+    }
+    for(;i+16<=n;i+=16){
+        acc0 = _mm512_add_ps(acc0, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(x+i), _mm512_loadu_ps(y+i))));
+    }
+    if(i < n) {
+        __mmask16 mask = __mmask16((1u << (n-i)) - 1);
+        acc1 = _mm512_add_ps(acc1, _mm512_abs_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x+i), _mm512_maskz_loadu_ps(mask, y+i))));
+    }
+    return hsum512(_mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3)));
+}
+
+template<int D>
+__attribute__((target("avx512f")))
+static float inner_product_avx512(int dim, const float* x, const float* y)
+{
+    const int n = D > 0 ? D : dim;
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps(), acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+    int i = 0;
+    for(;i+64<=n;i+=64){
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x+i), _mm512_loadu_ps(y+i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(x+i+16), _mm512_loadu_ps(y+i+16), acc1);
+        acc2 = _mm512_fmadd_ps(_mm512_loadu_ps(x+i+32), _mm512_loadu_ps(y+i+32), acc2);
+        acc3 = _mm512_fmadd_ps(_mm512_loadu_ps(x+i+48), _mm512_loadu_ps(y+i+48), acc3);
+    }
+    for(;i+16<=n;i+=16){
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x+i), _mm512_loadu_ps(y+i), acc0);
+    }
+    if(i < n) {
+        __mmask16 mask = __mmask16((1u << (n-i)) - 1);
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, x+i), _mm512_maskz_loadu_ps(mask, y+i), acc1);
+    }
+    return hsum512(_mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3)));
+}
+
+__attribute__((target("avx512f")))
+static float l2_sqr_avx512_dispatch(int dim, const float* x, const float* y) { DISPATCH_DIM(l2_sqr_avx512, dim, x, y) }
+__attribute__((target("avx512f")))
+static float l1_dist_avx512_dispatch(int dim, const float* x, const float* y) { DISPATCH_DIM(l1_dist_avx512, dim, x, y) }
+__attribute__((target("avx512f")))
+static float inner_product_avx512_dispatch(int dim, const float* x, const float* y) { DISPATCH_DIM(inner_product_avx512, dim, x, y) }
+
+//maskz conversions for the same reason as in hsum512
+__attribute__((target("avx512f")))
+static float sq8_l2_sqr_avx512(int dim, const float* q, const float* w, const uint8_t* code)
+{
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for(;i+32<=dim;i+=32){
+        __m512 c0 = _mm512_maskz_cvtepi32_ps(0xffff, _mm512_maskz_cvtepu8_epi32(0xffff, _mm_loadu_si128((const __m128i*)(code+i))));
+        __m512 c1 = _mm512_maskz_cvtepi32_ps(0xffff, _mm512_maskz_cvtepu8_epi32(0xffff, _mm_loadu_si128((const __m128i*)(code+i+16))));
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(q+i), c0);
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(q+i+16), c1);
+        acc0 = _mm512_fmadd_ps(_mm512_mul_ps(d0, d0), _mm512_loadu_ps(w+i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_mul_ps(d1, d1), _mm512_loadu_ps(w+i+16), acc1);
+    }
+    for(;i+16<=dim;i+=16){
+        __m512 c0 = _mm512_maskz_cvtepi32_ps(0xffff, _mm512_maskz_cvtepu8_epi32(0xffff, _mm_loadu_si128((const __m128i*)(code+i))));
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(q+i), c0);
+        acc0 = _mm512_fmadd_ps(_mm512_mul_ps(d0, d0), _mm512_loadu_ps(w+i), acc0);
+    }
+    float sum = hsum512(_mm512_add_ps(acc0, acc1));
+    for(;i<dim;i++){
+        sum += w[i]*sqr(q[i]-code[i]);
+    }
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+static float fp16_l2_sqr_avx512(int dim, const float* q, const uint16_t* x)
+{
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for(;i+32<=dim;i+=32){
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(q+i), _mm512_maskz_cvtph_ps(0xffff, _mm256_loadu_si256((const __m256i*)(x+i))));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(q+i+16), _mm512_maskz_cvtph_ps(0xffff, _mm256_loadu_si256((const __m256i*)(x+i+16))));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+    }
+    for(;i+16<=dim;i+=16){
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(q+i), _mm512_maskz_cvtph_ps(0xffff, _mm256_loadu_si256((const __m256i*)(x+i))));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+    }
+    float sum = hsum512(_mm512_add_ps(acc0, acc1));
+    for(;i<dim;i++){
+        sum += sqr(q[i]-half_to_float(x[i]));
+    }
+    return sum;
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+
+static DistanceKernels select_distance_kernels()
+{
+    const DistanceKernels scalar = {"scalar", l2_sqr_scalar_dispatch, l1_dist_scalar_dispatch, inner_product_scalar_dispatch,
+        sq8_l2_sqr_scalar, fp16_l2_sqr_scalar};
+#ifdef GENIE4L2_X86
+    //there is no sse kernel on compressed objects, the scalar ones are used
+    const DistanceKernels sse = {"sse", l2_sqr_sse_dispatch, l1_dist_sse_dispatch, inner_product_sse_dispatch,
+        sq8_l2_sqr_scalar, fp16_l2_sqr_scalar};
+    const DistanceKernels avx2 = {"avx2", l2_sqr_avx2_dispatch, l1_dist_avx2_dispatch, inner_product_avx2_dispatch,
+        sq8_l2_sqr_avx2, fp16_l2_sqr_avx2};
+    const DistanceKernels avx512 = {"avx512", l2_sqr_avx512_dispatch, l1_dist_avx512_dispatch, inner_product_avx512_dispatch,
+        sq8_l2_sqr_avx512, fp16_l2_sqr_avx512};
+
+    //the highest level allowed by GENIE4L2_SIMD
+    const char *env = getenv("GENIE4L2_SIMD");
+    int maxLevel = 3;
+    if(env != nullptr) {
+        const char *names[] = {"scalar", "sse", "avx2", "avx512"};
+        for(int i=0;i<4;i++){
+            if(strcmp(env, names[i]) == 0) {
+                maxLevel = i;
+            }
+        }
+    }
+
+    __builtin_cpu_init();
+    if(maxLevel >= 3 && __builtin_cpu_supports("avx512f")) {
+        return avx512;
+    }
+    if(maxLevel >= 2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+        && __builtin_cpu_supports("f16c")) {
+        return avx2;
+    }
+    if(maxLevel >= 1 && __builtin_cpu_supports("sse3")) {
+        return sse;
+    }
+#endif
+    return scalar;
+}
+
+const DistanceKernels& get_distance_kernels()
+{
+    static const DistanceKernels kernels = select_distance_kernels();
+    return kernels;
+}
+
+//selected at startup rather than on the first distance evaluation
+static const DistanceKernels& initKernels = get_distance_kernels();
+
+template<>
+float calc_l2_sqr<float>(int dim, const float* x, const float* y)
+{
+    return get_distance_kernels().l2_sqr(dim, x, y);
+}
+
+template<>
+float calc_l1_dist<float>(int dim, const float* x, const float* y)
+{
+    return get_distance_kernels().l1_dist(dim, x, y);
+}
+
+template<>
+float calc_inner_product<float>(int dim, const float* x, const float* y)
+{
+    return get_distance_kernels().inner_product(dim, x, y);
+}
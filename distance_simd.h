@@ -0,0 +1,25 @@
+#pragma once
+
+//float distance kernels selected once at runtime according to the instruction sets of the cpu
+//calc_l2_sqr/calc_l1_dist/calc_inner_product<float> in util.h are routed here
+
+#include <cstdint>
+
+//the first kernels share the signature of Distf :: int -> const float * -> const float * -> float
+struct DistanceKernels
+{
+    const char *name;
+    float (*l2_sqr)(int, const float*, const float*);
+    float (*l1_dist)(int, const float*, const float*);
+    float (*inner_product)(int, const float*, const float*);
+
+    //kernels on compressed objects, see quantized_store.h
+    //sum_d w[d] * (q[d] - code[d])^2 for uint8 codes
+    float (*sq8_l2_sqr)(int, const float* q, const float* w, const uint8_t* code);
+    //sum_d (q[d] - x[d])^2 with x stored as ieee half
+    float (*fp16_l2_sqr)(int, const float* q, const uint16_t* x);
+};
+
+//kernels of the best instruction set supported (scalar, sse, avx2 or avx512)
+//GENIE4L2_SIMD could be set to one of these names to force a lower one
+const DistanceKernels& get_distance_kernels();
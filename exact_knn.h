@@ -0,0 +1,135 @@
+#pragma once
+
+//exact k nearest neighbors by l2, the ground truth of benchmarks, tuning and gt_gen
+//
+//queries and data are cut into tiles, the inner products of a tile come from one gemm_nn against the
+//transposed data block and ||q||^2 + ||x||^2 - 2<q, x> is pushed into a bounded max-heap per query.
+//the heaps keep 2k (at least k+rescoreSlack) rows, which are scored again exactly by calc_l2_sqr before the top k are taken,
+//so the rounding of the expansion does not change the result.
+//a task is a block of queries against a part of the data, the data is split as well when there are
+//fewer query blocks than threads, and the heaps of the parts are merged.
+//a data block is transposed once per block of queries, which go through gemm_nn in tiles of knnTileRows
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "matrix.h"
+#include "parallel.h"
+#include "gemm.h"
+#include "util.h"
+#include "rerank.h"
+
+const static int knnQueryBlock = 256;
+const static int knnTileRows = 64;
+const static int knnDataBlock = 1024;
+//the stride of a transposed data block, padded against the aliasing of a power of 2
+const static int knnPackedStride = knnDataBlock + 16;
+const static int rescoreSlack = 16;
+
+//the k nearest rows of data to each query as (squared l2 distance, id), nearest first
+//dataNorms are ||x||^2 of each row of data, see calc_row_norms
+template<class Scalar>
+std::vector<std::vector<std::pair<Scalar, int> > > exact_knn(MatrixView<Scalar> data, const Scalar* dataNorms, MatrixView<Scalar> queries, int k)
+{
+    using ResPair = std::pair<Scalar, int>;
+    std::vector<std::vector<ResPair> > ret(queries.rows);
+    k = std::min(k, data.rows);
+    if(k <= 0 || queries.rows == 0) {
+        return ret;
+    }
+    const int dim = data.cols;
+    const int kept = std::min(data.rows, std::max(2*k, k + rescoreSlack));
+
+    std::vector<Scalar> queryNorms(queries.rows);
+    for(int q=0;q<queries.rows;q++){
+        queryNorms[q] = calc_inner_product(dim, queries.row(q), queries.row(q));
+    }
+
+    const int numQueryBlocks = (queries.rows + knnQueryBlock - 1) / knnQueryBlock;
+    const int numDataBlocks = (data.rows + knnDataBlock - 1) / knnDataBlock;
+    const int numParts = std::max(1, std::min(numDataBlocks, get_num_threads() / numQueryBlocks));
+    //heaps[part][query], each of at most kept
+    std::vector<std::vector<std::vector<ResPair> > > heaps(numParts, std::vector<std::vector<ResPair> >(queries.rows));
+
+    parallel_for(0, numQueryBlocks*numParts, 1, [&](int , int tbeg, int tend){
+        thread_local std::vector<Scalar> tile, packed;
+        tile.resize(size_t(knnTileRows)*knnDataBlock);
+        packed.resize(size_t(dim)*knnPackedStride);
+        for(int task=tbeg;task<tend;task++){
+            const int qb = task / numParts, part = task % numParts;
+            const int qbeg = qb * knnQueryBlock, qend = std::min(qbeg + knnQueryBlock, queries.rows);
+            const int dbeg = int(int64_t(numDataBlocks)*part / numParts) * knnDataBlock;
+            const int dend = std::min(int(int64_t(numDataBlocks)*(part+1) / numParts) * knnDataBlock, data.rows);
+            for(int b=dbeg;b<dend;b+=knnDataBlock){
+                const int bend = std::min(b + knnDataBlock, dend);
+                transpose_rows(bend-b, dim, data.row(b), data.stride, packed.data(), knnPackedStride);
+                for(int q0=qbeg;q0<qend;q0+=knnTileRows){
+                    const int q1 = std::min(q0 + knnTileRows, qend);
+                    gemm_nn(q1-q0, bend-b, dim, queries.row(q0), queries.stride, packed.data(), knnPackedStride, tile.data(), knnDataBlock);
+                    for(int q=q0;q<q1;q++){
+                        std::vector<ResPair>& heap = heaps[part][q];
+                        //inner products become distances in place, then only those below the worst kept are looked at
+                        Scalar* dists = &tile[size_t(q-q0)*knnDataBlock];
+                        const Scalar* norms = &dataNorms[b];
+                        for(int i=0;i<bend-b;i++){
+                            dists[i] = queryNorms[q] + norms[i] - 2*dists[i];
+                        }
+                        for(int i=b;i<bend;i++){
+                            Scalar dist = dists[i-b];
+                            if(int(heap.size()) < kept) {
+                                heap.emplace_back(dist, i);
+                                std::push_heap(heap.begin(), heap.end());
+                            } else if(dist < heap.front().first) {
+                                std::pop_heap(heap.begin(), heap.end());
+                                heap.back() = ResPair(dist, i);
+                                std::push_heap(heap.begin(), heap.end());
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    });
+
+    parallel_for(0, queries.rows, 16, [&](int , int beg, int end){
+        std::vector<ResPair> merged;
+        for(int q=beg;q<end;q++){
+            merged.clear();
+            for(int part=0;part<numParts;part++){
+                merged.insert(merged.end(), heaps[part][q].begin(), heaps[part][q].end());
+            }
+            std::sort(merged.begin(), merged.end());
+            merged.resize(std::min<size_t>(merged.size(), kept));
+            for(ResPair& p:merged){
+                p.first = calc_l2_sqr(dim, queries.row(q), data.row(p.second));
+            }
+            std::partial_sort(merged.begin(), merged.begin()+k, merged.end());
+            ret[q].assign(merged.begin(), merged.begin()+k);
+        }
+    });
+    return ret;
+}
+template<class Scalar>
+std::vector<std::vector<std::pair<Scalar, int> > > exact_knn(MatrixView<Scalar> data, MatrixView<Scalar> queries, int k)
+{
+    return exact_knn(data, calc_row_norms(data).data(), queries, k);
+}
+
+//the fraction of the true k nearest ids found in the results, over all queries
+template<class Scalar>
+double recall_at_k(const std::vector<std::vector<std::pair<Scalar, int> > >& results,
+    const std::vector<std::vector<std::pair<Scalar, int> > >& truth, int k)
+{
+    long hits = 0, total = 0;
+    for(size_t q=0;q<truth.size() && q<results.size();q++){
+        int n = std::min<int>(k, truth[q].size());
+        for(int j=0;j<n;j++){
+            hits += std::any_of(results[q].begin(), results[q].end(), [&](const std::pair<Scalar, int>& p){
+                return p.second == truth[q][j].second;
+            });
+        }
+        total += n;
+    }
+    return total > 0 ? double(hits) / total : 0.;
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+//contiguous array that either owns a 64-byte aligned buffer or aliases read-only memory owned by someone else,
+//e.g. a section of a memory-mapped index file (see index_file.h)
+//it has the subset of the std::vector interface used by the index structures,
+//any call changing the size turns an aliased array into an owned copy first
+
+#include <memory>
+#include <cstddef>
+#include <cassert>
+#include <algorithm>
+#include <vector>
+#include <type_traits>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/array_wrapper.hpp>
+
+#include "util.h"
+
+template<class T>
+class FlatArray
+{
+public:
+    FlatArray() {}
+    explicit FlatArray(size_t n, const T& v=T())
+        :owned(n, v)
+    {
+        sync();
+    }
+    FlatArray(const std::vector<T>& v)
+        :owned(v.begin(), v.end())
+    {
+        sync();
+    }
+    FlatArray(const FlatArray& other)
+    {
+        *this = other;
+    }
+    FlatArray(FlatArray&& other)
+    {
+        *this = std::move(other);
+    }
+    FlatArray& operator=(const FlatArray& other)
+    {
+        if(this != &other) {
+            owned = other.owned;
+            keeper = other.keeper;
+            if(keeper) {
+                ptr = other.ptr;
+                len = other.len;
+            } else {
+                sync();
+            }
+        }
+        return *this;
+    }
+    FlatArray& operator=(FlatArray&& other)
+    {
+        if(this != &other) {
+            owned = std::move(other.owned);
+            keeper = std::move(other.keeper);
+            if(keeper) {
+                ptr = other.ptr;
+                len = other.len;
+            } else {
+                sync();
+            }
+            other.owned.clear();
+            other.keeper.reset();
+            other.sync();
+        }
+        return *this;
+    }
+
+    //alias n elements at data, keeper keeps the memory alive
+    static FlatArray alias(const T* data, size_t n, std::shared_ptr<const void> keeper)
+    {
+        FlatArray ret;
+        ret.ptr = const_cast<T*>(data);
+        ret.len = n;
+        ret.keeper = std::move(keeper);
+        return ret;
+    }
+    bool is_alias() const
+    {
+        return bool(keeper);
+    }
+
+    size_t size() const
+    {
+        return len;
+    }
+    bool empty() const
+    {
+        return len == 0;
+    }
+    const T* data() const
+    {
+        return ptr;
+    }
+    //an aliased array is read-only, writes are only valid on owned arrays
+    T* data()
+    {
+        return ptr;
+    }
+    const T& operator[](size_t i) const
+    {
+        assert(i < len);
+        return ptr[i];
+    }
+    T& operator[](size_t i)
+    {
+        assert(i < len);
+        return ptr[i];
+    }
+    const T& back() const
+    {
+        assert(len > 0);
+        return ptr[len-1];
+    }
+    const T* begin() const
+    {
+        return ptr;
+    }
+    const T* end() const
+    {
+        return ptr + len;
+    }
+
+    void resize(size_t n, const T& v=T())
+    {
+        own();
+        owned.resize(n, v);
+        sync();
+    }
+    void assign(size_t n, const T& v)
+    {
+        own();
+        owned.assign(n, v);
+        sync();
+    }
+    template<class It, class = typename std::enable_if<!std::is_integral<It>::value>::type>
+    void assign(It first, It last)
+    {
+        aligned_vector<T> tmp(first, last);
+        keeper.reset();
+        owned.swap(tmp);
+        sync();
+    }
+    void clear()
+    {
+        keeper.reset();
+        owned.clear();
+        sync();
+    }
+
+    template<class Archive>
+    void save(Archive & ar, const unsigned int ) const
+    {
+        size_t n = len;
+        ar & n;
+        if(n > 0) {
+            ar & boost::serialization::make_array(ptr, n);
+        }
+    }
+    template<class Archive>
+    void load(Archive & ar, const unsigned int )
+    {
+        size_t n;
+        ar & n;
+        clear();
+        resize(n);
+        if(n > 0) {
+            ar & boost::serialization::make_array(ptr, n);
+        }
+    }
+    BOOST_SERIALIZATION_SPLIT_MEMBER()
+
+private:
+    //copy aliased memory into an owned buffer
+    void own()
+    {
+        if(keeper) {
+            aligned_vector<T> tmp(ptr, ptr+len);
+            owned.swap(tmp);
+            keeper.reset();
+            sync();
+        }
+    }
+    void sync()
+    {
+        ptr = owned.empty() ? nullptr : owned.data();
+        len = owned.size();
+    }
+
+    aligned_vector<T> owned;
+    T* ptr = nullptr;
+    size_t len = 0;
+    std::shared_ptr<const void> keeper;
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+//exact search by scanning all rows, see exact_knn.h
+//
+//below some size a scan beats hashing, matching and re-ranking and it never misses a neighbor,
+//so small datasets and shards use it in place of Genie4l2 or GeniePivot, it is also the baseline of their throughput.
+//it has their build/query_vec/serialize, only the norms of the rows are kept, the rows are given to query_vec
+
+#include <vector>
+#include <cmath>
+#include <boost/serialization/vector.hpp>
+
+#include "matrix.h"
+#include "exact_knn.h"
+#include "rerank.h"
+#include "flat_array.h"
+#include "index_file.h"
+#include "stage_stats.h"
+
+template<class Scalar>
+class FlatIndex
+{
+public:
+    FlatIndex(int dataDim, int topk, int queryPerBatch)
+        :dataDim(dataDim), topk(topk), queryPerBatch(queryPerBatch)
+    {
+    }
+
+    void build(const std::vector<std::vector<Scalar> >& dataObjects)
+    {
+        build(Matrix<Scalar>::from_rows(dataObjects));
+    }
+    void build(MatrixView<Scalar> dataObjects)
+    {
+        assert(dataObjects.cols == dataDim);
+        dataNorms = calc_row_norms(dataObjects);
+    }
+
+    //F :: query-id -> id of one of its topk nearest rows -> IO
+    //unlike the other indexes the rows are needed to find them
+    template<class Scanner>
+    void query(MatrixView<Scalar> queries, MatrixView<Scalar> dataObjects, const Scanner& f)
+    {
+        auto ress = query_vec(queries, dataObjects);
+        for(int i=0;i<ress.size();i++){
+            for(const ResPair& p:ress[i]){
+                f(i, p.second);
+            }
+        }
+    }
+
+    //a batch at a time, each one scanned on all threads, see exact_knn
+    using ResPair = std::pair<Scalar, int>;
+    std::vector<std::vector<ResPair> > query_vec(
+        const std::vector<std::vector<Scalar> >& queries,
+        const std::vector<std::vector<Scalar> >& dataObjects)
+    {
+        return query_vec(Matrix<Scalar>::from_rows(queries), Matrix<Scalar>::from_rows(dataObjects));
+    }
+    //dataObjects are the rows build was given
+    std::vector<std::vector<ResPair> > query_vec(MatrixView<Scalar> queries, MatrixView<Scalar> dataObjects)
+    {
+        assert(dataObjects.rows == dataNorms.size());
+        std::vector<std::vector<ResPair> > ret(queries.rows);
+        for(int beg=0;beg<queries.rows;beg+=queryPerBatch){
+            int end = std::min(beg + queryPerBatch, queries.rows);
+            //scoring every row is the re-ranking of a scan
+            StageTimer<Stage::Rerank> timer(end - beg);
+            auto ress = exact_knn(dataObjects, dataNorms.data(), queries.slice(beg, end), topk);
+            for(int i=beg;i<end;i++){
+                ret[i] = std::move(ress[i-beg]);
+                for(ResPair& p:ret[i]){
+                    p.first = std::sqrt(std::max(p.first, Scalar(0)));
+                }
+            }
+        }
+        return ret;
+    }
+
+    //nothing to overlap, kept such that callers set it on any index
+    int pipelineDepth = 0;
+
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int )
+    {
+        ar & dataDim;
+        ar & topk;
+        ar & queryPerBatch;
+        ar & dataNorms;
+    }
+
+    //see index_file.h
+    void save_flat(IndexWriter& w, const std::string& prefix) const
+    {
+        w.add_value(prefix + "dataDim", dataDim);
+        w.add_value(prefix + "topk", topk);
+        w.add_value(prefix + "queryPerBatch", queryPerBatch);
+        w.add_array(prefix + "dataNorms", dataNorms);
+    }
+    void load_flat(const IndexReader& r, const std::string& prefix)
+    {
+        dataDim = r.value<int>(prefix + "dataDim");
+        topk = r.value<int>(prefix + "topk");
+        queryPerBatch = r.value<int>(prefix + "queryPerBatch");
+        dataNorms = r.array<Scalar>(prefix + "dataNorms");
+    }
+
+private:
+    int dataDim;
+    int topk;
+    int queryPerBatch;
+
+    //||x||^2 of each row
+    FlatArray<Scalar> dataNorms;
+};
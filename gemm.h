@@ -0,0 +1,271 @@
+#pragma once
+
+//small dense kernels: C = A * B^T with row-major A (m x k) and B (n x k)
+//used for hashing a batch of objects against all projection lines / pivots at once
+//gemm_nn takes B transposed (k x n) instead, which needs no horizontal sums and suits large tiles, e.g. exact_knn.h
+
+#include <cstddef>
+#include <algorithm>
+
+#if defined(__AVX512F__) || (defined(__AVX2__) && defined(__FMA__))
+#include <immintrin.h>
+#endif
+
+//generic version, C[i*ldc+j] = <A[i], B[j]>
+template<class Scalar>
+inline void gemm_nt(int m, int n, int k, const Scalar* A, size_t lda, const Scalar* B, size_t ldb,
+        Scalar* C, size_t ldc)
+{
+    for(int i=0;i<m;i++){
+        for(int j=0;j<n;j++){
+            double sum = 0.;
+            for(int t=0;t<k;t++){
+                sum += double(A[i*lda+t]) * B[j*ldb+t];
+            }
+            C[i*ldc+j] = sum;
+        }
+    }
+}
+
+//generic version, C[i*ldc+j] = sum_t A[i*lda+t] * Bt[t*ldbt+j]
+template<class Scalar>
+inline void gemm_nn(int m, int n, int k, const Scalar* A, size_t lda, const Scalar* Bt, size_t ldbt,
+        Scalar* C, size_t ldc)
+{
+    for(int i=0;i<m;i++){
+        std::fill(C + i*ldc, C + i*ldc + n, Scalar(0));
+        for(int t=0;t<k;t++){
+            Scalar a = A[i*lda+t];
+            for(int j=0;j<n;j++){
+                C[i*ldc+j] += a * Bt[t*ldbt+j];
+            }
+        }
+    }
+}
+
+//Bt (k x n) = B^T for B (n x k), 16 rows of B at a time so that the writes are contiguous
+template<class Scalar>
+inline void transpose_rows(int n, int k, const Scalar* B, size_t ldb, Scalar* Bt, size_t ldbt)
+{
+    for(int j0=0;j0<n;j0+=16){
+        int jend = std::min(n, j0+16);
+        for(int t=0;t<k;t++){
+            for(int j=j0;j<jend;j++){
+                Bt[t*ldbt+j] = B[j*ldb+t];
+            }
+        }
+    }
+}
+
+#if defined(__AVX512F__)
+
+inline float hsum512(__m512 v)
+{
+    v = _mm512_add_ps(v, _mm512_maskz_shuffle_f32x4(0xffff, v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm512_add_ps(v, _mm512_maskz_shuffle_f32x4(0xffff, v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    __m128 s = _mm512_maskz_extractf32x4_ps(0xf, v, 0);
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+//MR rows of A times NR rows of B, accumulated in registers over the whole k
+template<int MR, int NR>
+inline void gemm_nt_kernel(int k, const float* A, size_t lda, const float* B, size_t ldb, float* C, size_t ldc)
+{
+    __m512 acc[MR][NR];
+    for(int i=0;i<MR;i++){
+        for(int j=0;j<NR;j++){
+            acc[i][j] = _mm512_setzero_ps();
+        }
+    }
+    int t = 0;
+    for(;t+16<=k;t+=16){
+        __m512 b[NR];
+        for(int j=0;j<NR;j++){
+            b[j] = _mm512_loadu_ps(B + j*ldb + t);
+        }
+        for(int i=0;i<MR;i++){
+            __m512 a = _mm512_loadu_ps(A + i*lda + t);
+            for(int j=0;j<NR;j++){
+                acc[i][j] = _mm512_fmadd_ps(a, b[j], acc[i][j]);
+            }
+        }
+    }
+    if(t < k) {
+        __mmask16 mask = __mmask16((1u << (k-t)) - 1);
+        __m512 b[NR];
+        for(int j=0;j<NR;j++){
+            b[j] = _mm512_maskz_loadu_ps(mask, B + j*ldb + t);
+        }
+        for(int i=0;i<MR;i++){
+            __m512 a = _mm512_maskz_loadu_ps(mask, A + i*lda + t);
+            for(int j=0;j<NR;j++){
+                acc[i][j] = _mm512_fmadd_ps(a, b[j], acc[i][j]);
+            }
+        }
+    }
+    for(int i=0;i<MR;i++){
+        for(int j=0;j<NR;j++){
+            C[i*ldc+j] = hsum512(acc[i][j]);
+        }
+    }
+}
+const static int GEMM_MR = 4;
+const static int GEMM_NR = 4;
+
+//MR rows of A times 2 vectors of columns of Bt, elements of A are broadcast
+template<int MR>
+inline void gemm_nn_kernel(int k, const float* A, size_t lda, const float* Bt, size_t ldbt, float* C, size_t ldc)
+{
+    __m512 acc[MR][2];
+    for(int i=0;i<MR;i++){
+        acc[i][0] = acc[i][1] = _mm512_setzero_ps();
+    }
+    for(int t=0;t<k;t++){
+        __m512 b0 = _mm512_loadu_ps(Bt + t*ldbt);
+        __m512 b1 = _mm512_loadu_ps(Bt + t*ldbt + 16);
+        for(int i=0;i<MR;i++){
+            __m512 a = _mm512_set1_ps(A[i*lda+t]);
+            acc[i][0] = _mm512_fmadd_ps(a, b0, acc[i][0]);
+            acc[i][1] = _mm512_fmadd_ps(a, b1, acc[i][1]);
+        }
+    }
+    for(int i=0;i<MR;i++){
+        _mm512_storeu_ps(C + i*ldc, acc[i][0]);
+        _mm512_storeu_ps(C + i*ldc + 16, acc[i][1]);
+    }
+}
+const static int GEMM_NN_MR = 8;
+const static int GEMM_NN_NR = 32;
+
+#elif defined(__AVX2__) && defined(__FMA__)
+
+inline float hsum256(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+//MR rows of A times NR rows of B, accumulated in registers over the whole k
+template<int MR, int NR>
+inline void gemm_nt_kernel(int k, const float* A, size_t lda, const float* B, size_t ldb, float* C, size_t ldc)
+{
+    __m256 acc[MR][NR];
+    for(int i=0;i<MR;i++){
+        for(int j=0;j<NR;j++){
+            acc[i][j] = _mm256_setzero_ps();
+        }
+    }
+    int t = 0;
+    for(;t+8<=k;t+=8){
+        __m256 b[NR];
+        for(int j=0;j<NR;j++){
+            b[j] = _mm256_loadu_ps(B + j*ldb + t);
+        }
+        for(int i=0;i<MR;i++){
+            __m256 a = _mm256_loadu_ps(A + i*lda + t);
+            for(int j=0;j<NR;j++){
+                acc[i][j] = _mm256_fmadd_ps(a, b[j], acc[i][j]);
+            }
+        }
+    }
+    for(int i=0;i<MR;i++){
+        for(int j=0;j<NR;j++){
+            float sum = hsum256(acc[i][j]);
+            for(int tt=t;tt<k;tt++){
+                sum += A[i*lda+tt] * B[j*ldb+tt];
+            }
+            C[i*ldc+j] = sum;
+        }
+    }
+}
+const static int GEMM_MR = 4;
+const static int GEMM_NR = 2;
+
+//MR rows of A times 2 vectors of columns of Bt, elements of A are broadcast
+template<int MR>
+inline void gemm_nn_kernel(int k, const float* A, size_t lda, const float* Bt, size_t ldbt, float* C, size_t ldc)
+{
+    __m256 acc[MR][2];
+    for(int i=0;i<MR;i++){
+        acc[i][0] = acc[i][1] = _mm256_setzero_ps();
+    }
+    for(int t=0;t<k;t++){
+        __m256 b0 = _mm256_loadu_ps(Bt + t*ldbt);
+        __m256 b1 = _mm256_loadu_ps(Bt + t*ldbt + 8);
+        for(int i=0;i<MR;i++){
+            __m256 a = _mm256_broadcast_ss(A + i*lda + t);
+            acc[i][0] = _mm256_fmadd_ps(a, b0, acc[i][0]);
+            acc[i][1] = _mm256_fmadd_ps(a, b1, acc[i][1]);
+        }
+    }
+    for(int i=0;i<MR;i++){
+        _mm256_storeu_ps(C + i*ldc, acc[i][0]);
+        _mm256_storeu_ps(C + i*ldc + 8, acc[i][1]);
+    }
+}
+const static int GEMM_NN_MR = 6;
+const static int GEMM_NN_NR = 16;
+
+#endif
+
+#if defined(__AVX512F__) || (defined(__AVX2__) && defined(__FMA__))
+//rows of B are processed in blocks of about 256KB so that they stay in L2 while A is streamed
+template<>
+inline void gemm_nt<float>(int m, int n, int k, const float* A, size_t lda, const float* B, size_t ldb,
+        float* C, size_t ldc)
+{
+    const int nb = std::max<int>(GEMM_NR, (256*1024 / sizeof(float)) / std::max(k, 1) / GEMM_NR * GEMM_NR);
+    for(int jb=0;jb<n;jb+=nb){
+        int jend = std::min(n, jb+nb);
+        int i = 0;
+        for(;i+GEMM_MR<=m;i+=GEMM_MR){
+            int j = jb;
+            for(;j+GEMM_NR<=jend;j+=GEMM_NR){
+                gemm_nt_kernel<GEMM_MR, GEMM_NR>(k, A+i*lda, lda, B+j*ldb, ldb, C+i*ldc+j, ldc);
+            }
+            for(;j<jend;j++){
+                gemm_nt_kernel<GEMM_MR, 1>(k, A+i*lda, lda, B+j*ldb, ldb, C+i*ldc+j, ldc);
+            }
+        }
+        for(;i<m;i++){
+            int j = jb;
+            for(;j+GEMM_NR<=jend;j+=GEMM_NR){
+                gemm_nt_kernel<1, GEMM_NR>(k, A+i*lda, lda, B+j*ldb, ldb, C+i*ldc+j, ldc);
+            }
+            for(;j<jend;j++){
+                gemm_nt_kernel<1, 1>(k, A+i*lda, lda, B+j*ldb, ldb, C+i*ldc+j, ldc);
+            }
+        }
+    }
+}
+
+//panels of GEMM_NN_NR columns of Bt stay in L1 while all rows of A go by
+template<>
+inline void gemm_nn<float>(int m, int n, int k, const float* A, size_t lda, const float* Bt, size_t ldbt,
+        float* C, size_t ldc)
+{
+    int j = 0;
+    for(;j+GEMM_NN_NR<=n;j+=GEMM_NN_NR){
+        int i = 0;
+        for(;i+GEMM_NN_MR<=m;i+=GEMM_NN_MR){
+            gemm_nn_kernel<GEMM_NN_MR>(k, A+i*lda, lda, Bt+j, ldbt, C+i*ldc+j, ldc);
+        }
+        for(;i<m;i++){
+            gemm_nn_kernel<1>(k, A+i*lda, lda, Bt+j, ldbt, C+i*ldc+j, ldc);
+        }
+    }
+    for(int i=0;j<n && i<m;i++){
+        for(int jj=j;jj<n;jj++){
+            float sum = 0.f;
+            for(int t=0;t<k;t++){
+                sum += A[i*lda+t] * Bt[t*ldbt+jj];
+            }
+            C[i*ldc+jj] = sum;
+        }
+    }
+}
+#endif
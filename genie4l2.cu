@@ -23,9 +23,22 @@ GenieBucketer::GenieBucketer(int topk, int queryPerBatch, int GPUID, int sigDim)
 }
 
 
-void GenieBucketer::build(const std::vector<std::vector<int> >& sigs)
+void GenieBucketer::build(SigView sigs, const uint8_t* skip)
 {
-    invTable = genie::BuildTable(geniePolicy, sigs);
+    //genie takes the nested layout, it only lives during the build
+    auto rows = sig_rows(sigs);
+    //a skipped row has no values, its id is kept but never matched
+    for(int i=0;skip!=nullptr && i<rows.size();i++){
+        if(skip[i]) {
+            rows[i].clear();
+        }
+    }
+    invTable = genie::BuildTable(geniePolicy, rows);
+}
+
+void GenieBucketer::select_device(int GPUID)
+{
+    cudaSetDevice(GPUID);
 }
 
 
@@ -57,21 +70,27 @@ namespace genie {
 };
 
 
-std::vector<std::vector<int> > GenieBucketer::batch_query(const std::vector<std::vector<int> >& querySigs)
+std::vector<std::vector<Candidate> > GenieBucketer::batch_query(SigView querySigs, const ProbeList& )
 {
-    auto genieQuery = genie::BuildQuery(geniePolicy, querySigs);
-    auto genieResult = genie::Match(geniePolicy, invTable, genieQuery);
+    auto genieQuery = [&](){
+        StageTimer<Stage::QueryBuild> timer(querySigs.size());
+        return genie::BuildQuery(geniePolicy, sig_rows(querySigs));
+    }();
+    auto genieResult = [&](){
+        StageTimer<Stage::Match> timer(querySigs.size());
+        return genie::Match(geniePolicy, invTable, genieQuery);
+    }();
     
     //genieResult.first would be the idx and genieResult.second would be the count
 
-    std::vector<std::vector<int> > ret;
+    StageTimer<Stage::Extract> timer(querySigs.size());
+    std::vector<std::vector<Candidate> > ret;
     ret.resize(querySigs.size());
     for(int i=0;i<querySigs.size();i++){
+        ret[i].reserve(topk);
         for(int j=0;j<topk;j++){
             int qidx = i*topk + j;
-            // fmt::print("genieResult[{}]=({}, {})", qidx, genieResult.first[qidx][k], genieResult.second[qidx][k]);
-            // printf("genieResult[%d]=(%d, %d)\n", qidx, genieResult.first[qidx], genieResult.second[qidx]);
-            ret[i].push_back(genieResult.first[qidx]);
+            ret[i].push_back(Candidate{genieResult.first[qidx], genieResult.second[qidx]});
         }
     }
     return ret;
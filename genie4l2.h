@@ -7,6 +7,15 @@
 #include "projection.h"
 #include "pivot_hasher.h"
 #include "util.h"
+#include "cpu_bucketer.h"
+#include "matrix.h"
+#include "rerank.h"
+#include "rerank_store.h"
+#include "pipeline.h"
+#include "signatures.h"
+#include "progress.h"
+#include "delta_index.h"
+#include "stage_stats.h"
 #include <boost/serialization/vector.hpp>
 #include <boost/serialization/shared_ptr.hpp>
 #include <boost/serialization/unique_ptr.hpp>
@@ -36,9 +45,15 @@ public:
     GenieBucketer() {};
     GenieBucketer(int topk, int queryPerBatch, int GPUID, int sigDim);
 
-    void build(const std::vector<std::vector<int> >& sigs);
-    //given sigs of queries, return the candidates set for each query
-    std::vector<std::vector<int> > batch_query(const std::vector<std::vector<int> >& querySigs);
+    //rows i with skip[i] != 0 are left out of every list but keep their ids
+    void build(SigView sigs, const uint8_t* skip=nullptr);
+    //given sigs of queries, return the candidates set for each query with their counts
+    //genie matches a single value per dimension, so probes are not looked up
+    std::vector<std::vector<Candidate> > batch_query(SigView querySigs, const ProbeList& probes=ProbeList());
+    const static bool usesProbes = false;
+    //make GPUID the device of the calling thread, threads other than the one constructing the bucketer
+    //(e.g. a background compaction) call it before building or matching
+    static void select_device(int GPUID);
 
     std::shared_ptr<genie::ExecutionPolicy> get_genie_policy();
 
@@ -58,13 +73,22 @@ public:
 template<class Scalar>
 using Distf = std::function<Scalar(int, const Scalar*, const Scalar*)>;
 
+//whether f ranks objects the same way as l2 distance, such that gemm-based kernels could be used
+template<class Scalar>
+bool is_l2_distf(const Distf<Scalar>& f)
+{
+    using FPtr = Scalar(*)(int, const Scalar*, const Scalar*);
+    const FPtr* p = f.template target<FPtr>();
+    return p != nullptr && (*p == &calc_l2_dist<Scalar> || *p == &calc_l2_sqr<Scalar>);
+}
+
 template<class Scalar>
 struct DistFuncScanner
 {
     using ResPair = std::pair<Scalar, int>;
 
-    DistFuncScanner(int dim, int topk, const std::vector<std::vector<Scalar> >& queryObjects, 
-            const std::vector<std::vector<Scalar> >& dataObjects, 
+    DistFuncScanner(int dim, int topk, MatrixView<Scalar> queryObjects, 
+            MatrixView<Scalar> dataObjects, 
             Distf<Scalar> distf_=calc_l2_dist<Scalar>):
         dim(dim), topk(topk), queryObjects(queryObjects), dataObjects(dataObjects), 
         distf(std::move(distf_) )
@@ -74,11 +98,23 @@ struct DistFuncScanner
             resQue.reserve(topk);
         }
     }
+    //legacy layout, objects are copied into contiguous matrices
+    DistFuncScanner(int dim, int topk, const std::vector<std::vector<Scalar> >& queryObjects, 
+            const std::vector<std::vector<Scalar> >& dataObjects, 
+            Distf<Scalar> distf_=calc_l2_dist<Scalar>):
+        DistFuncScanner(dim, topk, MatrixView<Scalar>(), MatrixView<Scalar>(), std::move(distf_))
+    {
+        queryStore = Matrix<Scalar>::from_rows(queryObjects);
+        dataStore = Matrix<Scalar>::from_rows(dataObjects);
+        this->queryObjects = queryStore;
+        this->dataObjects = dataStore;
+        resQue.resize(queryStore.size());
+    }
 
     void push(int qid, int candidateId) {
         assert(qid < queryObjects.size() && candidateId < dataObjects.size() && qid < resQue.size());
 
-        double dist = distf(dim, &queryObjects[qid][0], &dataObjects[candidateId][0]);
+        double dist = distf(dim, queryObjects[qid], dataObjects[candidateId]);
         if(resQue[qid].size() < topk) {
             resQue[qid].emplace(dist, candidateId);
         } else {
@@ -112,72 +148,135 @@ struct DistFuncScanner
 
     int dim;
     int topk;
-    const std::vector<std::vector<Scalar> >& queryObjects;
-    const std::vector<std::vector<Scalar> >& dataObjects;
+    MatrixView<Scalar> queryObjects;
+    MatrixView<Scalar> dataObjects;
+    //only used by the legacy constructor
+    Matrix<Scalar> queryStore;
+    Matrix<Scalar> dataStore;
     //max-heap
     std::vector<std::priority_queue<ResPair> > resQue;
     Distf<Scalar> distf;
 };
 
-template<class Scalar> 
+//Bucketer could be GenieBucketer (gpu) or CpuBucketer
+template<class Scalar, class Bucketer=GenieBucketer> 
 class Genie4l2
 {
 public:
-    Genie4l2(int dataDim, int nLines, double radius, int topk, int queryPerBatch, int GPUID) 
+    //numCandidates is the #candidates the bucketer returns for each query, 0 for 3*topk+3*nLines
+    Genie4l2(int dataDim, int nLines, double radius, int topk, int queryPerBatch, int GPUID, int numCandidates=0) 
         :dataDim(dataDim), nLines(nLines), radius(radius), topk(topk), 
-        queryPerBatch(queryPerBatch), GPUID(GPUID), hasher(dataDim, nLines, radius), bucketer(3*topk+3*nLines, queryPerBatch, GPUID, nLines)
+        queryPerBatch(queryPerBatch), GPUID(GPUID), hasher(dataDim, nLines, radius), 
+        buckets(numCandidates > 0 ? numCandidates : 3*topk+3*nLines, queryPerBatch, GPUID, nLines)
     {
     }
     ~Genie4l2()
     {
     }
 
-    //take some parameters by default std::vector
     void build(const std::vector<std::vector<Scalar> >& dataObjects)
+    {
+        build(Matrix<Scalar>::from_rows(dataObjects));
+    }
+    void build(MatrixView<Scalar> dataObjects)
     {
         //project first
-        get_sigs(dataObjects, hashSigs);
-        bucketer.build(hashSigs);
+        Progress progress("hashing", dataObjects.rows);
+        SigMatrix hashSigs;
+        get_sigs(dataObjects, hashSigs, &progress);
+        progress.finish();
+        build_hashed(dataObjects, std::move(hashSigs));
+    }
+    //build with hashSigs of dataObjects computed by hasher_ elsewhere, which takes the place of the hasher,
+    //e.g. a prefix of a hasher with more lines to try several nLines on one hashing, see tuner.h
+    void build(MatrixView<Scalar> dataObjects, const RandProjHasher<Scalar, int>& hasher_, SigMatrix hashSigs)
+    {
+        assert(hasher_.K == nLines && hasher_.dim == dataDim && hashSigs.cols == nLines && hashSigs.rows == dataObjects.rows);
+        hasher = hasher_;
+        radius = hasher_.r;
+        build_hashed(dataObjects, std::move(hashSigs));
+    }
+
+    //objects are added after all existing ones, return the id of the first
+    //they are searchable right away through the delta of buckets, see delta_index.h
+    int insert(MatrixView<Scalar> objects)
+    {
+        SigMatrix sigs;
+        get_sigs(objects, sigs);
+        return buckets.insert(objects, sigs);
+    }
+    //removed ids are never returned again
+    void remove(const std::vector<int>& ids)
+    {
+        buckets.remove(ids);
+    }
+    //merge the delta into the main table now
+    void compact()
+    {
+        buckets.compact();
+    }
+    //merge on a background thread once rows objects are inserted since the last merge, 0 for only compact()
+    void set_auto_compact(int rows)
+    {
+        buckets.set_auto_compact(rows);
     }
 
     //F :: query-id -> candidate-id -> IO
     template<class Scanner>
     void query(const std::vector<std::vector<Scalar> >& queries, const Scanner& f)
     {
-        std::vector<std::vector<int> > querySigs;
-
-        get_sigs(queries, querySigs);
-        for(int i=0;i * queryPerBatch < queries.size(); i++) {
-            int start = i * queryPerBatch;
-            int end   = std::min<int>((i+1) * queryPerBatch, querySigs.size());
-            std::vector<std::vector<int> > querySigBatch(querySigs.begin() + start, querySigs.begin() + end);
-            auto candidatessBatch = bucketer.batch_query(querySigBatch);
-            assert(candidatessBatch.size() == querySigBatch.size());
-
-            printf("batch query done!!\n");
-            
+        query(Matrix<Scalar>::from_rows(queries), f);
+    }
+    template<class Scanner>
+    void query(MatrixView<Scalar> queries, const Scanner& f)
+    {
+        query_batches(queries, [&](int start, const std::vector<std::vector<Candidate> >& candidatessBatch){
             for(int i=0;i<candidatessBatch.size();i++){
-                for(int idx:candidatessBatch[i]){
-                    f(i + start, idx);
+                for(const Candidate& c:candidatessBatch[i]){
+                    f(i + start, c.id);
                 }
             }
-        }
+        });
+    }
+
+    //G :: first-query-id -> candidates of each query in the batch, with their counts -> IO
+    //hashing of the next batch, matching of the current one and g of the previous one overlap, see pipeline.h
+    template<class BatchScanner>
+    void query_batches(MatrixView<Scalar> queries, const BatchScanner& g)
+    {
+        auto lock = buckets.read_lock();
+        query_batches_locked(queries, g);
     }
 
+    //#batches waiting between two stages of query_batches, 0 runs the stages one after another
+    int pipelineDepth = 2;
+    //#lines each query also probes the neighboring bucket of, those its projection is closest to a border of,
+    //see select_probes; fewer lines reach the same recall, only CpuBucketer looks probes up,
+    //with other bucketers no probes are selected, such that the main table and the delta count on one scale
+    int numProbes = 0;
 
-    // default version, using DistFuncScanner 
+
+    // default version, re-ranking each batch on all threads
     using ResPair = std::pair<Scalar, int>;
     std::vector<std::vector<ResPair> > query_vec(
         const std::vector<std::vector<Scalar> >& queries, 
         const std::vector<std::vector<Scalar> >& dataObjects)
     {
-        DistFuncScanner<Scalar> scanner(dataDim, topk, queries, dataObjects);
-        query(queries, [&](int qid, int candidateId){
-            scanner.push(qid, candidateId);
-        });
-        return scanner.fetch_res_vec();
+        return query_vec(Matrix<Scalar>::from_rows(queries), Matrix<Scalar>::from_rows(dataObjects));
+    }
+    //dataObjects are the rows build was given, inserted rows are kept by the index
+    std::vector<std::vector<ResPair> > query_vec(MatrixView<Scalar> queries, MatrixView<Scalar> dataObjects)
+    {
+        auto lock = buckets.read_lock();
+        return rerankStore.query_l2(topk, queries, dataObjects, true, [&](const auto& g){
+            query_batches_locked(queries, g);
+        }, buckets.extra_objects());
     }
 
+    //norms and the optional compressed copy used by query_vec, see rerank_store.h
+    //e.g. rerankStore.set_quantization(QUANT_SQ8) before build
+    RerankStore<Scalar> rerankStore;
+
     template<class Archive>
     void serialize(Archive & ar, const unsigned int )
     {
@@ -188,21 +287,90 @@ public:
         ar & queryPerBatch;
         ar & GPUID;
         ar & hasher;
-        ar & hashSigs;
-        ar & bucketer;
+        ar & buckets;
+        ar & rerankStore;
+    }
+
+    //see index_file.h, a bucketer without a flat layout is stored as a boost archive section
+    void save_flat(IndexWriter& w, const std::string& prefix) const
+    {
+        w.add_value(prefix + "dataDim", dataDim);
+        w.add_value(prefix + "nLines", nLines);
+        w.add_value(prefix + "radius", radius);
+        w.add_value(prefix + "topk", topk);
+        w.add_value(prefix + "queryPerBatch", queryPerBatch);
+        w.add_value(prefix + "GPUID", GPUID);
+        hasher.save_flat(w, prefix + "hasher.");
+        buckets.save_flat(w, prefix + "buckets.");
+        rerankStore.save_flat(w, prefix + "rerank.");
+    }
+    void load_flat(const IndexReader& r, const std::string& prefix)
+    {
+        dataDim = r.value<int>(prefix + "dataDim");
+        nLines = r.value<int>(prefix + "nLines");
+        radius = r.value<double>(prefix + "radius");
+        topk = r.value<int>(prefix + "topk");
+        queryPerBatch = r.value<int>(prefix + "queryPerBatch");
+        GPUID = r.value<int>(prefix + "GPUID");
+        hasher.load_flat(r, prefix + "hasher.");
+        buckets.load_flat(r, prefix + "buckets.");
+        rerankStore.load_flat(r, prefix + "rerank.");
     }
 
 private:
-    inline void get_sigs(const std::vector<std::vector<Scalar> >& objects, std::vector<std::vector<int> >& sigs) 
-    {
-        sigs.resize(objects.size());
-        for(int i=0;i<objects.size();i++){
-            sigs[i].resize(nLines);
-            hasher.getSig(&objects[i][0], &sigs[i][0]);
-            for(int j=0;j<sigs[i].size();j++){
-                sigs[i][j] = sigs[i][j] & 0x7fff;
-            }
+    void build_hashed(MatrixView<Scalar> dataObjects, SigMatrix hashSigs)
+    {
+        run_stage("bucketing", [&](){ buckets.build(std::move(hashSigs)); });
+        run_stage("re-rank store", [&](){ rerankStore.build(dataObjects); });
+    }
+
+    //query_batches with the read lock of buckets held
+    template<class BatchScanner>
+    void query_batches_locked(MatrixView<Scalar> queries, const BatchScanner& g)
+    {
+        int numBatches = (queries.rows + queryPerBatch - 1) / queryPerBatch;
+        using SigBatch = std::pair<SigMatrix, ProbeList>;
+        run_pipeline(numBatches, pipelineDepth, [&](int i){
+            const int beg = i * queryPerBatch, end = std::min((i+1) * queryPerBatch, queries.rows);
+            StageTimer<Stage::Hash> timer(end - beg);
+            SigBatch querySigBatch;
+            get_sigs(queries.slice(beg, end), querySigBatch.first,
+                    nullptr, numProbes > 0 && Bucketer::usesProbes ? &querySigBatch.second : nullptr);
+            return querySigBatch;
+        }, [&](const SigBatch& querySigBatch){
+            auto candidatessBatch = buckets.batch_query(querySigBatch.first, querySigBatch.second);
+            assert(candidatessBatch.size() == querySigBatch.first.rows);
+            return candidatessBatch;
+        }, [&](int i, const std::vector<std::vector<Candidate> >& candidatessBatch){
+            g(i * queryPerBatch, candidatessBatch);
+        }, [&](){
+            Bucketer::select_device(GPUID);
+        });
+    }
+
+    //blocks of rows are handed out to the threads in order, hashed into a per-thread buffer and masked into sigs,
+    //thus the rows are streamed through once
+    //with probes, numProbes probes of each row are selected from the positions inside the buckets
+    inline void get_sigs(MatrixView<Scalar> objects, SigMatrix& sigs, Progress* progress=nullptr, ProbeList* probes=nullptr) 
+    {
+        sigs.resize(objects.rows, nLines);
+        if(probes) {
+            probes->resize(objects.rows, numProbes);
         }
+        parallel_for(0, objects.rows, hasher.rowsPerBlock, [&](int , int beg, int end){
+            thread_local std::vector<int> block;
+            thread_local std::vector<float> fracs;
+            block.resize(size_t(end-beg)*nLines);
+            fracs.resize(probes ? block.size() : 0);
+            hasher.getSigBlock(objects.row(beg), end-beg, block.data(), objects.stride, probes ? fracs.data() : nullptr);
+            mask_sigs(block.data(), block.size(), sigs.row(beg));
+            for(int i=0;probes && i<end-beg;i++){
+                select_probes(&block[size_t(i)*nLines], &fracs[size_t(i)*nLines], nLines, numProbes, probes->row(beg+i));
+            }
+            if(progress) {
+                progress->add(end-beg);
+            }
+        });
     }
 
     int dataDim;
@@ -213,23 +381,32 @@ private:
     int GPUID;
 
     RandProjHasher<Scalar, int> hasher;
-    std::vector<std::vector<int> > hashSigs;
-
-    GenieBucketer bucketer;
+    //main table, delta and tombstones
+    DeltaIndex<Scalar, Bucketer> buckets;
 };
 
 
 
-template<class Scalar> 
+template<class Scalar, class Bucketer=GenieBucketer> 
 class GeniePivot
 {
 public:
+    //numCandidates is the #candidates the bucketer returns for each query, 0 for 3*topk+3*nPivots
+    GeniePivot(int dataDim, int nPivots, int topk, int queryPerBatch, int GPUID, 
+            MatrixView<Scalar> dataset, 
+            Distf<Scalar> distf_=calc_l2_dist<Scalar>, int numCandidates=0)
+        :dataDim(dataDim), sigdim(sqrt(nPivots)), nPivots(nPivots), topk(topk), 
+        queryPerBatch(queryPerBatch), GPUID(GPUID), hasher(dataDim, sigdim, nPivots, dataset), 
+        buckets(numCandidates > 0 ? numCandidates : 3*topk+3*nPivots, queryPerBatch, GPUID, int(sqrt(nPivots))), 
+        distf(std::move(distf_))
+    {
+    }
     GeniePivot(int dataDim, int nPivots, int topk, int queryPerBatch, int GPUID, 
             const std::vector<std::vector<Scalar> >& dataset, 
-            Distf<Scalar> distf_=calc_l2_dist<Scalar>)
+            Distf<Scalar> distf_=calc_l2_dist<Scalar>, int numCandidates=0)
         :dataDim(dataDim), sigdim(sqrt(nPivots)), nPivots(nPivots), topk(topk), 
         queryPerBatch(queryPerBatch), GPUID(GPUID), hasher(dataDim, sigdim, nPivots, dataset), 
-        bucketer(3*topk+3*nPivots, queryPerBatch, GPUID, sqrt(nPivots)), 
+        buckets(numCandidates > 0 ? numCandidates : 3*topk+3*nPivots, queryPerBatch, GPUID, int(sqrt(nPivots))), 
         distf(std::move(distf_))
     {
     }
@@ -237,49 +414,106 @@ public:
     {
     }
 
-    //take some parameters by default std::vector
     void build(const std::vector<std::vector<Scalar> >& dataObjects)
+    {
+        build(Matrix<Scalar>::from_rows(dataObjects));
+    }
+    void build(MatrixView<Scalar> dataObjects)
     {
         //project first
-        get_sigs(dataObjects, hashSigs);
-        bucketer.build(hashSigs);
+        Progress progress("hashing", dataObjects.rows);
+        SigMatrix hashSigs;
+        get_sigs(dataObjects, hashSigs, &progress);
+        progress.finish();
+        run_stage("bucketing", [&](){ buckets.build(std::move(hashSigs)); });
+        run_stage("re-rank store", [&](){ rerankStore.build(dataObjects); });
+    }
+
+    //objects are added after all existing ones, return the id of the first
+    //they are searchable right away through the delta of buckets, see delta_index.h
+    int insert(MatrixView<Scalar> objects)
+    {
+        SigMatrix sigs;
+        get_sigs(objects, sigs);
+        return buckets.insert(objects, sigs);
+    }
+    //removed ids are never returned again
+    void remove(const std::vector<int>& ids)
+    {
+        buckets.remove(ids);
+    }
+    //merge the delta into the main table now
+    void compact()
+    {
+        buckets.compact();
+    }
+    //merge on a background thread once rows objects are inserted since the last merge, 0 for only compact()
+    void set_auto_compact(int rows)
+    {
+        buckets.set_auto_compact(rows);
     }
 
     //F :: query-id -> candidate-id -> IO
     template<class Scanner>
     void query(const std::vector<std::vector<Scalar> >& queries, const Scanner& scanner)
     {
-        std::vector<std::vector<int> > querySigs;
-
-        get_sigs(queries, querySigs);
-        for(int i=0;i * queryPerBatch < queries.size(); i++) {
-            int start = i * queryPerBatch;
-            int end   = std::min<int>((i+1) * queryPerBatch, querySigs.size());
-            std::vector<std::vector<int> > querySigBatch(querySigs.begin() + start, querySigs.begin() + end);
-            auto candidatessBatch = bucketer.batch_query(querySigBatch);
-            assert(candidatessBatch.size() == querySigBatch.size());
-
+        query(Matrix<Scalar>::from_rows(queries), scanner);
+    }
+    template<class Scanner>
+    void query(MatrixView<Scalar> queries, const Scanner& scanner)
+    {
+        query_batches(queries, [&](int start, const std::vector<std::vector<Candidate> >& candidatessBatch){
             for(int i=0;i<candidatessBatch.size();i++){
-                for(int idx:candidatessBatch[i]){
-                    scanner(i + start, idx);
+                for(const Candidate& c:candidatessBatch[i]){
+                    scanner(i + start, c.id);
                 }
             }
-        }
+        });
     }
 
-    // default version, using DistFuncScanner 
+    //G :: first-query-id -> candidates of each query in the batch, with their counts -> IO
+    //hashing of the next batch, matching of the current one and g of the previous one overlap, see pipeline.h
+    template<class BatchScanner>
+    void query_batches(MatrixView<Scalar> queries, const BatchScanner& g)
+    {
+        auto lock = buckets.read_lock();
+        query_batches_locked(queries, g);
+    }
+
+    //#batches waiting between two stages of query_batches, 0 runs the stages one after another
+    int pipelineDepth = 2;
+
+
+    // default version, re-ranking each batch on all threads
     using ResPair = std::pair<Scalar, int>;
     std::vector<std::vector<ResPair> > query_vec(
         const std::vector<std::vector<Scalar> >& queries, 
         const std::vector<std::vector<Scalar> >& dataObjects)
     {
-        DistFuncScanner<Scalar> scanner(dataDim, topk, queries, dataObjects, distf);
-        query(queries, [&](int qid, int candidateId){
-            scanner.push(qid, candidateId);
+        return query_vec(Matrix<Scalar>::from_rows(queries), Matrix<Scalar>::from_rows(dataObjects));
+    }
+    //dataObjects are the rows build was given, inserted rows are kept by the index
+    std::vector<std::vector<ResPair> > query_vec(MatrixView<Scalar> queries, MatrixView<Scalar> dataObjects)
+    {
+        auto lock = buckets.read_lock();
+        if(is_l2_distf(distf)) {
+            bool takeSqrt = *distf.template target<DistfPtr<Scalar> >() == &calc_l2_dist<Scalar>;
+            return rerankStore.query_l2(topk, queries, dataObjects, takeSqrt, [&](const auto& g){
+                query_batches_locked(queries, g);
+            }, buckets.extra_objects());
+        }
+        auto reranker = make_reranker(topk, queries, append_rows(DistfScorer<Scalar, Distf<Scalar> >(dataDim, dataObjects, distf), 
+                dataObjects.rows, buckets.extra_objects(), distf, false), 0, rerankStore.budget);
+        query_batches_locked(queries, [&](int start, const std::vector<std::vector<Candidate> >& candidatessBatch){
+            reranker.push_batch(start, candidatessBatch);
         });
-        return scanner.fetch_res_vec();
+        return reranker.fetch_res_vec();
     }
 
+    //norms and the optional compressed copy used by query_vec, see rerank_store.h
+    //e.g. rerankStore.set_quantization(QUANT_SQ8) before build
+    RerankStore<Scalar> rerankStore;
+
     template<class Archive>
     void serialize(Archive & ar, const unsigned int )
     {
@@ -290,21 +524,80 @@ public:
         ar & queryPerBatch;
         ar & GPUID;
         ar & hasher;
-        ar & hashSigs;
-        ar & bucketer;
+        ar & buckets;
+        ar & rerankStore;
+    }
+
+    //see index_file.h, distf is not stored and comes from the constructor
+    void save_flat(IndexWriter& w, const std::string& prefix) const
+    {
+        w.add_value(prefix + "dataDim", dataDim);
+        w.add_value(prefix + "sigdim", sigdim);
+        w.add_value(prefix + "nPivots", nPivots);
+        w.add_value(prefix + "topk", topk);
+        w.add_value(prefix + "queryPerBatch", queryPerBatch);
+        w.add_value(prefix + "GPUID", GPUID);
+        hasher.save_flat(w, prefix + "hasher.");
+        buckets.save_flat(w, prefix + "buckets.");
+        rerankStore.save_flat(w, prefix + "rerank.");
+    }
+    void load_flat(const IndexReader& r, const std::string& prefix)
+    {
+        dataDim = r.value<int>(prefix + "dataDim");
+        sigdim = r.value<int>(prefix + "sigdim");
+        nPivots = r.value<int>(prefix + "nPivots");
+        topk = r.value<int>(prefix + "topk");
+        queryPerBatch = r.value<int>(prefix + "queryPerBatch");
+        GPUID = r.value<int>(prefix + "GPUID");
+        hasher.load_flat(r, prefix + "hasher.");
+        buckets.load_flat(r, prefix + "buckets.");
+        rerankStore.load_flat(r, prefix + "rerank.");
     }
 
 private:
-    inline void get_sigs(const std::vector<std::vector<Scalar> >& objects, std::vector<std::vector<int> >& sigs) 
-    {
-        sigs.resize(objects.size());
-        for(int i=0;i<objects.size();i++){
-            sigs[i].resize(sigdim);
-            hasher.getSig(&objects[i][0], &sigs[i][0], distf);
-            for(int j=0;j<sigs[i].size();j++){
-                sigs[i][j] = sigs[i][j] & 0x7fff;
+    //query_batches with the read lock of buckets held
+    template<class BatchScanner>
+    void query_batches_locked(MatrixView<Scalar> queries, const BatchScanner& g)
+    {
+        int numBatches = (queries.rows + queryPerBatch - 1) / queryPerBatch;
+        run_pipeline(numBatches, pipelineDepth, [&](int i){
+            const int beg = i * queryPerBatch, end = std::min((i+1) * queryPerBatch, queries.rows);
+            StageTimer<Stage::Hash> timer(end - beg);
+            SigMatrix querySigBatch;
+            get_sigs(queries.slice(beg, end), querySigBatch);
+            return querySigBatch;
+        }, [&](const SigMatrix& querySigBatch){
+            auto candidatessBatch = buckets.batch_query(querySigBatch);
+            assert(candidatessBatch.size() == querySigBatch.rows);
+            return candidatessBatch;
+        }, [&](int i, const std::vector<std::vector<Candidate> >& candidatessBatch){
+            g(i * queryPerBatch, candidatessBatch);
+        }, [&](){
+            Bucketer::select_device(GPUID);
+        });
+    }
+
+    //see Genie4l2::get_sigs
+    inline void get_sigs(MatrixView<Scalar> objects, SigMatrix& sigs, Progress* progress=nullptr) 
+    {
+        sigs.resize(objects.rows, sigdim);
+        const bool l2 = is_l2_distf(distf);
+        parallel_for(0, objects.rows, hasher.rowsPerBlock, [&](int , int beg, int end){
+            thread_local std::vector<int> block;
+            block.resize(size_t(end-beg)*sigdim);
+            if(l2) {
+                //blocks of rows are compared with all pivots as one matrix multiply
+                hasher.getSigBlock(objects.row(beg), end-beg, block.data(), objects.stride);
+            } else {
+                for(int i=beg;i<end;i++){
+                    hasher.getSig(objects[i], &block[size_t(i-beg)*sigdim], distf);
+                }
             }
-        }
+            mask_sigs(block.data(), block.size(), sigs.row(beg));
+            if(progress) {
+                progress->add(end-beg);
+            }
+        });
     }
 
     int dataDim;
@@ -315,8 +608,7 @@ private:
     int GPUID;
 
     PivotHasher<Scalar, int> hasher;
-    std::vector<std::vector<int> > hashSigs;
-
-    GenieBucketer bucketer;
+    //main table, delta and tombstones
+    DeltaIndex<Scalar, Bucketer> buckets;
     Distf<Scalar> distf;
 };
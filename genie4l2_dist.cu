@@ -7,85 +7,79 @@ int DistGenieBucketer::get_num_gpus()
     return devCount;
 }
 
-DistGenieBucketer::DistGenieBucketer(int topk, int queryPerBatch, int sigDim)
-    :topk(topk), queryPerBatch(queryPerBatch), sigDim(sigDim)
+DistGenieBucketer::DistGenieBucketer(int topk, int queryPerBatch, int sigDim, int numShards)
+    :topk(topk), queryPerBatch(queryPerBatch), sigDim(sigDim), numShards(numShards > 0 ? numShards : get_num_gpus())
 {
-    numGPUs = get_num_gpus();
+    make_shards();
+}
 
-    bucketers.reserve(numGPUs);
-    for(int i=0;i<numGPUs;i++){
-        bucketers.emplace_back(topk, queryPerBatch, i, sigDim);
+void DistGenieBucketer::make_shards()
+{
+    int numGPUs = std::max(get_num_gpus(), 1);
+    bucketers.clear();
+    bucketers.reserve(numShards);
+    for(int i=0;i<numShards;i++){
+        bucketers.emplace_back(topk, queryPerBatch, i % numGPUs, sigDim);
     }
+    //each worker stays on the device of its shard
+    executor = std::make_shared<ShardExecutor>(numShards, [numGPUs](int shard){
+        cudaSetDevice(shard % numGPUs);
+    });
 }
 
 
-void DistGenieBucketer::build(const std::vector<std::vector<std::vector<int> > >& sigs)
+void DistGenieBucketer::build(SigView sigs)
 {
-    assert(sigs.size()==numGPUs);
-
-    //let each buckets build its own inv_table and so on.
-    std::vector<std::thread> pools;
-    // pools.clear();
-    pools.reserve(numGPUs);
-
-    std::vector<std::vector<std::vector<int> > > sigsForThreads;
-    sigsForThreads.resize(numGPUs);
-
-    //calc extents
-    extents.resize(sigs.size()+1);
-    extents[0] = 0;
-    for(int i=0;i<sigs.size();i++){
-        extents[i+1] = sigs[i].size();
-    }
-    //require c++17
-    // std::exclusive_scan(extents.begin(), extents.end());
-    for(int i=1;i<extents.size();i++) {
-        extents[i] += extents[i-1];
+    //calc extents, shard i owns objects [extents[i], extents[i+1])
+    extents.resize(numShards+1);
+    for(int i=0;i<=numShards;i++){
+        extents[i] = int((int64_t(sigs.rows)*i + numShards-1) / numShards);
     }
 
     for(int i=0;i<extents.size();i++){
         printf("extents[%d]=%d\n", i, extents[i]);
     }
 
-    //build each bucketer
-    for(int threadid=0;threadid<numGPUs;threadid++){
-        pools.emplace_back([&sigs, threadid, this](){
-            cudaSetDevice(threadid);
-            bucketers[threadid].build(sigs[threadid]);
-        });
-    }
-    for(int threadid=0;threadid<numGPUs;threadid++){
-        pools[threadid].join();
-    }
+    //let each buckets build its own inv_table and so on, on the worker of the shard such that
+    //its host memory is on the numa node of the worker
+    executor->run([&](int shard){
+        bucketers[shard].build(sigs.slice(extents[shard], extents[shard+1]));
+    });
 }
 
-std::vector<std::vector<int> > DistGenieBucketer::batch_query(const std::vector<std::vector<int> >& querySigs)
+std::vector<std::vector<Candidate> > DistGenieBucketer::batch_query(SigView querySigs)
 {
-    std::vector<std::thread> pools;
-    // pools.clear();
-    pools.reserve(numGPUs);
-
-    std::vector<std::vector<std::vector<int> > > candidates(numGPUs);
+    std::vector<std::vector<std::vector<Candidate> > > candidates(numShards);
 
     //query each bucketer
-    for(int threadid=0;threadid<numGPUs;threadid++){
-        pools.emplace_back([&candidates, &querySigs, threadid, this](){
-            // cudaSetDevice(threadid);
-            auto ret = bucketers[threadid].batch_query(querySigs);
-            candidates[threadid] = std::move(ret);
-        });
-    }
-    for(int threadid=0;threadid<numGPUs;threadid++){
-        pools[threadid].join();
-    }
+    executor->run([&](int shard){
+        candidates[shard] = bucketers[shard].batch_query(querySigs);
+    });
 
-    std::vector<std::vector<int> > ret(querySigs.size());
-    for(int i=0;i<ret.size();i++){
-        for(int threadid=0;threadid<numGPUs;threadid++){
-            for(int candidateFromBucketer:candidates[threadid][i]) {
-                ret[i].push_back(candidateFromBucketer + extents[threadid]);
+    //merge into one list per query, the topk with the largest counts over all shards
+    StageTimer<Stage::Merge> timer(querySigs.size());
+    std::vector<std::vector<Candidate> > ret(querySigs.size());
+    //on the shard workers, each merges a contiguous slice of the queries
+    int numQueries = ret.size();
+    executor->run([&](int shard){
+        int beg = int(int64_t(numQueries)*shard / numShards);
+        int end = int(int64_t(numQueries)*(shard+1) / numShards);
+        std::vector<Candidate> merged;
+        for(int i=beg;i<end;i++){
+            merged.clear();
+            for(int shard=0;shard<numShards;shard++){
+                for(const Candidate& c:candidates[shard][i]){
+                    if(c.id >= 0) {
+                        merged.push_back(Candidate{c.id + extents[shard], c.count});
+                    }
+                }
             }
+            int n = std::min<int>(topk, merged.size());
+            std::partial_sort(merged.begin(), merged.begin()+n, merged.end(), [](const Candidate& a, const Candidate& b){
+                return a.count > b.count || (a.count == b.count && a.id < b.id);
+            });
+            ret[i].assign(merged.begin(), merged.begin()+n);
         }
-    }
+    });
     return ret;
 }
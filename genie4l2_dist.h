@@ -1,58 +1,50 @@
 #pragma once
 
 #include "genie4l2.h"
+#include "shard_executor.h"
 #include <thread>
 #include <numeric>
 
 //bucketer using distgenie
+//objects are split into numShards contiguous shards, shard i runs on gpu i % #gpus and is driven by
+//a persistent worker pinned to a numa node, see shard_executor.h
 class DistGenieBucketer
 {
 public:
     DistGenieBucketer() {};
-    DistGenieBucketer(int topk, int queryPerBatch, int sigDim);
+    //numShards 0 for one shard per gpu
+    DistGenieBucketer(int topk, int queryPerBatch, int sigDim, int numShards=0);
 
-    //not implemented
-    // void build(const std::vector<std::vector<int> >& sigs);
-    void build(const std::vector<std::vector<std::vector<int> > >& sigss);
-    //given sigs of queries, return the candidates set for each query
-    std::vector<std::vector<int> > batch_query(const std::vector<std::vector<int> >& querySigs);
+    //objects are split into numShards contiguous ranges of (almost) equal size, each shard is built by its worker
+    void build(SigView sigs);
+    //given sigs of queries, return the candidates set for each query with their counts:
+    //the topk with the largest counts over all shards, ordered by count descendingly
+    std::vector<std::vector<Candidate> > batch_query(SigView querySigs);
 
     std::shared_ptr<genie::ExecutionPolicy> get_genie_policy();
 
-    //split sigs into n partitions uniformly. WILL CONSUME sigs
-    std::vector<std::vector<std::vector<int> > > split_sigs(std::vector<std::vector<int> >&& sigs, int m) {
-        std::vector<std::vector<std::vector<int> > > ret(m);
-        int n = sigs.size();
-        for(int i=0;i<m;i++){
-            int idxbeg = (n*i+m-1)/m;
-            int idxend = (n*(i+1)+m-1)/m;
-            ret[i].reserve(idxend-idxbeg);
-            for(int j=idxbeg;j<idxend;j++){
-                ret[i].push_back(std::move(sigs[j]));
-            }
-        }
-        return ret;
-    }
-
     template<class Archive>
     void serialize(Archive & ar, const unsigned int )
     {
         ar & topk;
         ar & queryPerBatch;
         ar & sigDim;
-        ar & numGPUs;
+        ar & numShards;
         ar & extents;
 
-        
         if(Archive::is_loading::value){
-            bucketers.clear();
-            bucketers.reserve(numGPUs);
-            for(int i=0;i<numGPUs;i++){
-                bucketers.emplace_back(topk, queryPerBatch, i, sigDim);
-                ar & bucketers[i];
+            make_shards();
+            //each shard is read on its worker such that its tables land on the numa node of the worker,
+            //one shard at a time as the archive is read in order
+            for(int i=0;i<numShards;i++) {
+                executor->run([&](int shard){
+                    if(shard == i) {
+                        ar & bucketers[i];
+                    }
+                });
             }
-        } else{
-            for(int i=0;i<numGPUs;i++) {
+        } else {
+            for(int i=0;i<numShards;i++) {
                 ar & bucketers[i];
             }
         }
@@ -64,72 +56,106 @@ public:
     int queryPerBatch;
     int sigDim;
 
-    int numGPUs;
+    int numShards;
+    //shard i owns objects [extents[i], extents[i+1])
     std::vector<int> extents;
     std::vector<GenieBucketer> bucketers;
 
-    // std::vector<std::thread> pools;
+private:
+    //bucketers and workers of numShards shards
+    void make_shards();
+
+    std::shared_ptr<ShardExecutor> executor;
 };
 
 template<class Scalar> 
 class DistGenie4l2
 {
 public:
-    DistGenie4l2(int dataDim, int nLines, double radius, int topk, int queryPerBatch) 
+    //numShards 0 for one shard per gpu, see DistGenieBucketer
+    DistGenie4l2(int dataDim, int nLines, double radius, int topk, int queryPerBatch, int numShards=0) 
         :dataDim(dataDim), nLines(nLines), radius(radius), topk(topk), 
-        queryPerBatch(queryPerBatch), hasher(dataDim, nLines, radius), bucketer(topk+30, queryPerBatch, nLines)
+        queryPerBatch(queryPerBatch), hasher(dataDim, nLines, radius), bucketer(topk+30, queryPerBatch, nLines, numShards)
     {
     }
     ~DistGenie4l2()
     {
     }
 
-    //take some parameters by default std::vector
     void build(const std::vector<std::vector<Scalar> >& dataObjects)
+    {
+        build(Matrix<Scalar>::from_rows(dataObjects));
+    }
+    void build(MatrixView<Scalar> dataObjects)
     {
         //project first
-        std::vector<std::vector<int> > hashSigsTmp;
-        get_sigs(dataObjects, hashSigsTmp);
-        hashSigss = std::move(bucketer.split_sigs(std::move(hashSigsTmp), bucketer.get_num_gpus()) );
-        bucketer.build(hashSigss);
+        Progress progress("hashing", dataObjects.rows);
+        get_sigs(dataObjects, hashSigs, &progress);
+        progress.finish();
+        run_stage("bucketing", [&](){ bucketer.build(hashSigs); });
+        run_stage("re-rank store", [&](){ rerankStore.build(dataObjects); });
     }
 
     //F :: query-id -> candidate-id -> IO
     template<class Scanner>
     void query(const std::vector<std::vector<Scalar> >& queries, const Scanner& f)
     {
-        std::vector<std::vector<int> > querySigs;
-
-        get_sigs(queries, querySigs);
-        for(int i=0;i * queryPerBatch < queries.size(); i++) {
-            int start = i * queryPerBatch;
-            int end   = std::min<int>((i+1) * queryPerBatch, querySigs.size());
-            std::vector<std::vector<int> > querySigBatch(querySigs.begin() + start, querySigs.begin() + end);
-            auto candidatessBatch = bucketer.batch_query(querySigBatch);
-            assert(candidatessBatch.size() == querySigBatch.size());
-            
+        query(Matrix<Scalar>::from_rows(queries), f);
+    }
+    template<class Scanner>
+    void query(MatrixView<Scalar> queries, const Scanner& f)
+    {
+        query_batches(queries, [&](int start, const std::vector<std::vector<Candidate> >& candidatessBatch){
             for(int i=0;i<candidatessBatch.size();i++){
-                for(int idx:candidatessBatch[i]){
-                    f(i + start, idx);
+                for(const Candidate& c:candidatessBatch[i]){
+                    f(i + start, c.id);
                 }
             }
-        }
+        });
     }
 
+    //G :: first-query-id -> candidates of each query in the batch, with their counts -> IO
+    //hashing of the next batch, matching of the current one and g of the previous one overlap, see pipeline.h
+    template<class BatchScanner>
+    void query_batches(MatrixView<Scalar> queries, const BatchScanner& g)
+    {
+        int numBatches = (queries.rows + queryPerBatch - 1) / queryPerBatch;
+        run_pipeline(numBatches, pipelineDepth, [&](int i){
+            SigMatrix querySigBatch;
+            get_sigs(queries.slice(i * queryPerBatch, std::min((i+1) * queryPerBatch, queries.rows)), querySigBatch);
+            return querySigBatch;
+        }, [&](const SigMatrix& querySigBatch){
+            auto candidatessBatch = bucketer.batch_query(querySigBatch);
+            assert(candidatessBatch.size() == querySigBatch.rows);
+            return candidatessBatch;
+        }, [&](int i, const std::vector<std::vector<Candidate> >& candidatessBatch){
+            g(i * queryPerBatch, candidatessBatch);
+        });
+    }
 
-    // default version, using DistFuncScanner 
+    //#batches waiting between two stages of query_batches, 0 runs the stages one after another
+    int pipelineDepth = 2;
+
+
+    // default version, re-ranking each batch on all threads
     using ResPair = std::pair<Scalar, int>;
     std::vector<std::vector<ResPair> > query_vec(
         const std::vector<std::vector<Scalar> >& queries, 
         const std::vector<std::vector<Scalar> >& dataObjects)
     {
-        DistFuncScanner<Scalar> scanner(dataDim, topk, queries, dataObjects);
-        query(queries, [&](int qid, int candidateId){
-            scanner.push(qid, candidateId);
+        return query_vec(Matrix<Scalar>::from_rows(queries), Matrix<Scalar>::from_rows(dataObjects));
+    }
+    std::vector<std::vector<ResPair> > query_vec(MatrixView<Scalar> queries, MatrixView<Scalar> dataObjects)
+    {
+        return rerankStore.query_l2(topk, queries, dataObjects, true, [&](const auto& g){
+            query_batches(queries, g);
         });
-        return scanner.fetch_res_vec();
     }
 
+    //norms and the optional compressed copy used by query_vec, see rerank_store.h
+    //e.g. rerankStore.set_quantization(QUANT_SQ8) before build
+    RerankStore<Scalar> rerankStore;
+
     template<class Archive>
     void serialize(Archive & ar, const unsigned int )
     {
@@ -139,21 +165,52 @@ public:
         ar & topk;
         ar & queryPerBatch;
         ar & hasher;
-        ar & hashSigss;
+        ar & hashSigs;
         ar & bucketer;
+        ar & rerankStore;
+    }
+
+    //see index_file.h, the gpu bucketers are stored as a boost archive section
+    void save_flat(IndexWriter& w, const std::string& prefix) const
+    {
+        w.add_value(prefix + "dataDim", dataDim);
+        w.add_value(prefix + "nLines", nLines);
+        w.add_value(prefix + "radius", radius);
+        w.add_value(prefix + "topk", topk);
+        w.add_value(prefix + "queryPerBatch", queryPerBatch);
+        hasher.save_flat(w, prefix + "hasher.");
+        hashSigs.save_flat(w, prefix + "hashSigs.");
+        save_flat_component(w, prefix + "bucketer.", bucketer);
+        rerankStore.save_flat(w, prefix + "rerank.");
+    }
+    void load_flat(const IndexReader& r, const std::string& prefix)
+    {
+        dataDim = r.value<int>(prefix + "dataDim");
+        nLines = r.value<int>(prefix + "nLines");
+        radius = r.value<double>(prefix + "radius");
+        topk = r.value<int>(prefix + "topk");
+        queryPerBatch = r.value<int>(prefix + "queryPerBatch");
+        hasher.load_flat(r, prefix + "hasher.");
+        hashSigs.load_flat(r, prefix + "hashSigs.");
+        load_flat_component(r, prefix + "bucketer.", bucketer);
+        rerankStore.load_flat(r, prefix + "rerank.");
     }
 
 private:
-    inline void get_sigs(const std::vector<std::vector<Scalar> >& objects, std::vector<std::vector<int> >& sigs) 
+    //blocks of rows are handed out to the threads in order, hashed into a per-thread buffer and masked into sigs,
+    //thus the rows are streamed through once
+    inline void get_sigs(MatrixView<Scalar> objects, SigMatrix& sigs, Progress* progress=nullptr) 
     {
-        sigs.resize(objects.size());
-        for(int i=0;i<objects.size();i++){
-            sigs[i].resize(nLines);
-            hasher.getSig(&objects[i][0], &sigs[i][0]);
-            for(int j=0;j<sigs[i].size();j++){
-                sigs[i][j] = sigs[i][j] & 0x7fff;
+        sigs.resize(objects.rows, nLines);
+        parallel_for(0, objects.rows, hasher.rowsPerBlock, [&](int , int beg, int end){
+            thread_local std::vector<int> block;
+            block.resize(size_t(end-beg)*nLines);
+            hasher.getSigBlock(objects.row(beg), end-beg, block.data(), objects.stride);
+            mask_sigs(block.data(), block.size(), sigs.row(beg));
+            if(progress) {
+                progress->add(end-beg);
             }
-        }
+        });
     }
 
     int dataDim;
@@ -164,7 +221,7 @@ private:
 
     RandProjHasher<Scalar, int> hasher;
     // std::vector<std::vector<int> > hashSigs;
-    std::vector<std::vector<std::vector<int> > > hashSigss;
+    SigMatrix hashSigs;
 
     DistGenieBucketer bucketer;
 };
\ No newline at end of file
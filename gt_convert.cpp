@@ -0,0 +1,64 @@
+#include <boost/program_options.hpp>
+#include <iostream>
+#include <string>
+#include "dataset_io.h"
+
+#include <fmt/format.h>
+
+using namespace std;
+using namespace boost::program_options;
+
+//convert ground truth between the text (.l2) and the binary format
+int main(int argc, char **argv)
+{
+    string inputFilename, outputFilename;
+
+    options_description desc("Allowed options");
+    desc.add_options()
+        ("help,h", "produce help message")
+        ("input_filename,i", value(&inputFilename)->required(), "ground truth to convert, text or binary")
+        ("output_filename,o", value(&outputFilename)->required(), "converted ground truth, binary if the input is text and vice versa")
+    ;
+
+    variables_map vm;
+    try {
+        store(parse_command_line(argc, argv, desc), vm);
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 1;
+        }
+        notify(vm);
+    } catch (const boost::program_options::error & e) {
+        std::cout << e.what() << std::endl << desc << std::endl;
+        return 1;
+    }
+
+    std::vector<std::vector<Result> > results;
+    if (is_ground_truth_binary(inputFilename.c_str())) {
+        //the header is checked and read by read_ground_truth_binary
+        if (read_ground_truth_binary(-1, inputFilename.c_str(), results) == 1) {
+            return 1;
+        }
+        fmt::print("read {} binary results, writing text\n", results.size());
+        return write_ground_truth(outputFilename.c_str(), results);
+    }
+
+    FILE *fp = fopen(inputFilename.c_str(), "r");
+    if (!fp) {
+        fmt::print("Could not open {}\n", inputFilename);
+        return 1;
+    }
+    int qn = -1, maxk = -1;
+    if (fscanf(fp, "%d %d", &qn, &maxk) != 2) {
+        fmt::print("{} is not a ground truth file\n", inputFilename);
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+
+    if (read_ground_truth(qn, inputFilename.c_str(), results) == 1) {
+        return 1;
+    }
+    fmt::print("read {} text results, writing binary\n", results.size());
+    return write_ground_truth_binary(outputFilename.c_str(), results);
+}
@@ -0,0 +1,80 @@
+#include <boost/program_options.hpp>
+#include <iostream>
+#include <string>
+#include <cmath>
+#include "dataset_io.h"
+#include "exact_knn.h"
+#include "util.h"
+
+#include <fmt/format.h>
+
+using namespace std;
+using namespace boost::program_options;
+
+//exact top-k neighbors by l2 of each query, written as ground truth in the text (.l2) or the binary format
+int main(int argc, char **argv)
+{
+    int n, qn, d, K;
+    bool binary;
+    string datasetFilename, queryFilename, outputFilename;
+
+    options_description desc("Allowed options");
+    desc.add_options()
+        ("help,h", "produce help message")
+        ("n,n", value(&n)->required(), "the number of data points")
+        ("d,d", value(&d)->required(), "the dimension of data")
+        ("qn,q", value(&qn)->required(), "the number of query points")
+        ("k,k", value(&K)->default_value(MAXK), "#neighbors of each query, read_ground_truth expects MAXK in text files")
+        ("dataset_filename,D", value(&datasetFilename)->required(), "path to dataset filename")
+        ("queryset_filename,Q", value(&queryFilename)->required(), "path to query filename")
+        ("output_filename,o", value(&outputFilename)->required(), "path of the ground truth to write")
+        ("binary", bool_switch(&binary), "write the binary format instead of text")
+    ;
+
+    variables_map vm;
+    try {
+        store(parse_command_line(argc, argv, desc), vm);
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 1;
+        }
+        notify(vm);
+    } catch (const boost::program_options::error & e) {
+        std::cout << e.what() << std::endl << desc << std::endl;
+        return 1;
+    }
+
+    MappedFile dataFile;
+    MatrixView<float> data;
+    Matrix<float> queries;
+    if (map_data_binary(n, d, datasetFilename.c_str(), dataFile, data, MADV_SEQUENTIAL) == 1) {
+        fmt::print("Reading dataset error!\n");
+        return 1;
+    }
+    if (read_data_binary(qn, d, queryFilename.c_str(), queries) == 1) {
+        fmt::print("Reading query set error!\n");
+        return 1;
+    }
+    if (K > data.rows) {
+        fmt::print("k={} is more than the {} rows of the dataset\n", K, data.rows);
+        return 1;
+    }
+
+    MyTimer::pusht();
+    auto knn = exact_knn(data, queries.view(), K);
+    fmt::print("exact top-{} of {} queries over {} rows, time={}\n", K, queries.rows, data.rows, MyTimer::popt());
+
+    //the files hold l2 distances, not squared
+    std::vector<std::vector<Result> > results(knn.size());
+    for (int i = 0; i < knn.size(); ++i) {
+        results[i].resize(knn[i].size());
+        for (int j = 0; j < knn[i].size(); ++j) {
+            results[i][j].id_ = knn[i][j].second;
+            results[i][j].key_ = std::sqrt(std::max(knn[i][j].first, 0.f));
+        }
+    }
+    if (binary) {
+        return write_ground_truth_binary(outputFilename.c_str(), results);
+    }
+    return write_ground_truth(outputFilename.c_str(), results);
+}
@@ -0,0 +1,409 @@
+#pragma once
+
+//flat index file: a header, a table of named sections, then the sections, each 64-byte aligned
+//
+//  header (64 bytes):  char magic[8] "G4L2IDX", uint32 version, uint32 #sections, uint64 checksum of the table,
+//                      uint64 file size, zero padding
+//  table:              #sections entries of 64 bytes: char name[40], uint64 offset, uint64 bytes, uint64 checksum
+//  sections:           raw arrays in host byte order
+//
+//loading maps the file and lets arrays (FlatArray, Matrix) alias their sections, nothing is copied or parsed
+//the checksums of the sections are only verified on request since that reads the whole file
+//classes with a flat layout implement
+//  void save_flat(IndexWriter& w, const std::string& prefix) const
+//  void load_flat(const IndexReader& r, const std::string& prefix)
+//everything else is stored as a boost binary archive in a single section
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <typeinfo>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+#include <boost/archive/binary_iarchive.hpp>
+#include <boost/archive/binary_oarchive.hpp>
+#include <fmt/format.h>
+
+#include "matrix.h"
+#include "flat_array.h"
+#include "dataset_io.h"
+
+const static char INDEX_FILE_MAGIC[8] = {'G', '4', 'L', '2', 'I', 'D', 'X', '\0'};
+const static uint32_t INDEX_FILE_VERSION = 1;
+
+struct IndexFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t numSections;
+    uint64_t tableChecksum;
+    uint64_t fileBytes;
+    char padding[32];
+};
+
+struct IndexSectionEntry
+{
+    char name[40];
+    uint64_t offset;
+    uint64_t bytes;
+    uint64_t checksum;
+};
+
+static_assert(sizeof(IndexFileHeader) == 64 && sizeof(IndexSectionEntry) == 64, "index file entries should be 64 bytes");
+
+//64-bit checksum of a byte range, 8 bytes per step
+inline uint64_t checksum64(const void *data, size_t bytes)
+{
+    const uint64_t k = 0x9e3779b97f4a7c15ull;
+    const char *p = static_cast<const char*>(data);
+    uint64_t h = bytes * k;
+    size_t i = 0;
+    for(;i+8<=bytes;i+=8){
+        uint64_t w;
+        memcpy(&w, p+i, 8);
+        h = (h ^ w) * k;
+        h ^= h >> 29;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, p+i, bytes-i);
+    h = (h ^ tail) * k;
+    return h ^ (h >> 32);
+}
+
+class IndexWriter
+{
+public:
+    //data must stay valid until write()
+    void add(const std::string& name, const void *data, size_t bytes)
+    {
+        if(name.size() >= sizeof(IndexSectionEntry::name)) {
+            throw std::runtime_error("index section name too long: " + name);
+        }
+        for(auto& s:sections){
+            if(s.name == name) {
+                throw std::runtime_error("duplicated index section " + name);
+            }
+        }
+        sections.push_back(Section{name, static_cast<const char*>(data), bytes});
+    }
+    //a copy of bytes is kept by the writer
+    void add_blob(const std::string& name, std::string bytes)
+    {
+        blobs.push_back(std::move(bytes));
+        add(name, blobs.back().data(), blobs.back().size());
+    }
+    template<class T>
+    void add_value(const std::string& name, const T& v)
+    {
+        add_blob(name, std::string(reinterpret_cast<const char*>(&v), sizeof(T)));
+    }
+    template<class T>
+    void add_array(const std::string& name, const FlatArray<T>& a)
+    {
+        add(name, a.data(), a.size()*sizeof(T));
+    }
+    template<class T>
+    void add_array(const std::string& name, const std::vector<T>& a)
+    {
+        add(name, a.data(), a.size()*sizeof(T));
+    }
+    template<class Scalar>
+    void add_matrix(const std::string& name, const Matrix<Scalar>& m)
+    {
+        int64_t shape[3] = {m.rows, m.cols, int64_t(m.stride)};
+        add_blob(name + ".shape", std::string(reinterpret_cast<const char*>(shape), sizeof(shape)));
+        add_array(name, m.storage);
+    }
+    //any boost-serializable object
+    template<class T>
+    void add_archive(const std::string& name, const T& obj)
+    {
+        std::ostringstream os;
+        {
+            boost::archive::binary_oarchive oa(os);
+            oa & obj;
+        }
+        add_blob(name, os.str());
+    }
+
+    //return 0 on success
+    int write(const char *fname) const
+    {
+        std::vector<IndexSectionEntry> table(sections.size());
+        uint64_t offset = align(sizeof(IndexFileHeader) + table.size()*sizeof(IndexSectionEntry));
+        for(int i=0;i<sections.size();i++){
+            memset(&table[i], 0, sizeof(IndexSectionEntry));
+            strncpy(table[i].name, sections[i].name.c_str(), sizeof(table[i].name)-1);
+            table[i].offset = offset;
+            table[i].bytes = sections[i].bytes;
+            table[i].checksum = checksum64(sections[i].data, sections[i].bytes);
+            offset = align(offset + sections[i].bytes);
+        }
+
+        IndexFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic));
+        header.version = INDEX_FILE_VERSION;
+        header.numSections = table.size();
+        header.tableChecksum = checksum64(table.data(), table.size()*sizeof(IndexSectionEntry));
+        header.fileBytes = offset;
+
+        FILE *fp = fopen(fname, "wb");
+        if(!fp) {
+            fmt::print("Could not open {}\n", fname);
+            return 1;
+        }
+        bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+        ok = ok && fwrite(table.data(), sizeof(IndexSectionEntry), table.size(), fp) == table.size();
+        uint64_t pos = sizeof(header) + table.size()*sizeof(IndexSectionEntry);
+        const char zeros[64] = {0};
+        for(int i=0;i<sections.size() && ok;i++){
+            ok = fwrite(zeros, 1, table[i].offset - pos, fp) == table[i].offset - pos;
+            ok = ok && fwrite(sections[i].data, 1, sections[i].bytes, fp) == sections[i].bytes;
+            pos = table[i].offset + sections[i].bytes;
+        }
+        ok = ok && fwrite(zeros, 1, header.fileBytes - pos, fp) == header.fileBytes - pos;
+        ok = (fclose(fp) == 0) && ok;
+        if(!ok) {
+            fmt::print("Could not write {}\n", fname);
+            return 1;
+        }
+        return 0;
+    }
+
+    const static uint64_t alignment = 64;
+
+private:
+    struct Section
+    {
+        std::string name;
+        const char *data;
+        size_t bytes;
+    };
+
+    static uint64_t align(uint64_t x)
+    {
+        return (x + alignment-1) / alignment * alignment;
+    }
+
+    std::vector<Section> sections;
+    //deque such that the strings never move
+    std::deque<std::string> blobs;
+};
+
+//missing or malformed sections throw std::runtime_error
+class IndexReader
+{
+public:
+    //return 0 on success
+    int open(const char *fname, bool verify=false)
+    {
+        file = std::make_shared<MappedFile>();
+        if(file->open(fname, MADV_NORMAL) != 0 || file->size() < sizeof(IndexFileHeader)) {
+            fmt::print("Could not open {}\n", fname);
+            return 1;
+        }
+        IndexFileHeader header;
+        memcpy(&header, file->data(), sizeof(header));
+        if(memcmp(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic)) != 0) {
+            fmt::print("{} is not an index file\n", fname);
+            return 1;
+        }
+        if(header.version != INDEX_FILE_VERSION) {
+            fmt::print("{} has version {}, {} is expected\n", fname, header.version, INDEX_FILE_VERSION);
+            return 1;
+        }
+        const size_t tableBytes = size_t(header.numSections)*sizeof(IndexSectionEntry);
+        if(header.fileBytes != file->size() || sizeof(header) + tableBytes > file->size()) {
+            fmt::print("{} is truncated\n", fname);
+            return 1;
+        }
+        const char *tableData = file->data() + sizeof(header);
+        if(checksum64(tableData, tableBytes) != header.tableChecksum) {
+            fmt::print("{} has a corrupted section table\n", fname);
+            return 1;
+        }
+        table.resize(header.numSections);
+        memcpy(table.data(), tableData, tableBytes);
+        for(auto& e:table){
+            e.name[sizeof(e.name)-1] = '\0';
+            if(e.offset % IndexWriter::alignment != 0 || e.offset > file->size() || e.bytes > file->size() - e.offset) {
+                fmt::print("{}: section {} is out of the file\n", fname, e.name);
+                return 1;
+            }
+            if(verify && checksum64(file->data() + e.offset, e.bytes) != e.checksum) {
+                fmt::print("{}: section {} is corrupted\n", fname, e.name);
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    bool has(const std::string& name) const
+    {
+        return find(name) != nullptr;
+    }
+
+    std::string blob(const std::string& name) const
+    {
+        const IndexSectionEntry& e = get(name);
+        return std::string(file->data() + e.offset, e.bytes);
+    }
+    template<class T>
+    T value(const std::string& name) const
+    {
+        const IndexSectionEntry& e = get(name);
+        if(e.bytes != sizeof(T)) {
+            throw std::runtime_error("index section " + name + " has a wrong size");
+        }
+        T v;
+        memcpy(&v, file->data() + e.offset, sizeof(T));
+        return v;
+    }
+    //aliases the mapped section
+    template<class T>
+    FlatArray<T> array(const std::string& name) const
+    {
+        const IndexSectionEntry& e = get(name);
+        if(e.bytes % sizeof(T) != 0) {
+            throw std::runtime_error("index section " + name + " has a wrong size");
+        }
+        return FlatArray<T>::alias(reinterpret_cast<const T*>(file->data() + e.offset), e.bytes / sizeof(T), file);
+    }
+    template<class Scalar>
+    Matrix<Scalar> matrix(const std::string& name) const
+    {
+        int64_t shape[3];
+        std::string s = blob(name + ".shape");
+        if(s.size() != sizeof(shape)) {
+            throw std::runtime_error("index section " + name + ".shape has a wrong size");
+        }
+        memcpy(shape, s.data(), sizeof(shape));
+        Matrix<Scalar> m;
+        m.rows = shape[0];
+        m.cols = shape[1];
+        m.stride = shape[2];
+        m.storage = array<Scalar>(name);
+        if(m.storage.size() != size_t(m.rows)*m.stride) {
+            throw std::runtime_error("index section " + name + " does not match its shape");
+        }
+        return m;
+    }
+    template<class T>
+    void archive(const std::string& name, T& obj) const
+    {
+        const IndexSectionEntry& e = get(name);
+        std::istringstream is(std::string(file->data() + e.offset, e.bytes));
+        boost::archive::binary_iarchive ia(is);
+        ia & obj;
+    }
+
+private:
+    const IndexSectionEntry* find(const std::string& name) const
+    {
+        for(auto& e:table){
+            if(name == e.name) {
+                return &e;
+            }
+        }
+        return nullptr;
+    }
+    const IndexSectionEntry& get(const std::string& name) const
+    {
+        const IndexSectionEntry* e = find(name);
+        if(e == nullptr) {
+            throw std::runtime_error("index section " + name + " is missing");
+        }
+        return *e;
+    }
+
+    std::shared_ptr<MappedFile> file;
+    std::vector<IndexSectionEntry> table;
+};
+
+//components with save_flat/load_flat are laid out flat, the others go through a boost archive
+template<class T>
+auto save_flat_component(IndexWriter& w, const std::string& prefix, const T& obj, int) -> decltype(obj.save_flat(w, prefix))
+{
+    obj.save_flat(w, prefix);
+}
+template<class T>
+void save_flat_component(IndexWriter& w, const std::string& prefix, const T& obj, long)
+{
+    w.add_archive(prefix + "archive", obj);
+}
+template<class T>
+void save_flat_component(IndexWriter& w, const std::string& prefix, const T& obj)
+{
+    save_flat_component(w, prefix, obj, 0);
+}
+
+template<class T>
+auto load_flat_component(const IndexReader& r, const std::string& prefix, T& obj, int) -> decltype(obj.load_flat(r, prefix))
+{
+    obj.load_flat(r, prefix);
+}
+template<class T>
+void load_flat_component(const IndexReader& r, const std::string& prefix, T& obj, long)
+{
+    r.archive(prefix + "archive", obj);
+}
+template<class T>
+void load_flat_component(const IndexReader& r, const std::string& prefix, T& obj)
+{
+    load_flat_component(r, prefix, obj, 0);
+}
+
+inline bool is_index_file(const char *fname)
+{
+    FILE *fp = fopen(fname, "rb");
+    if(!fp) {
+        return false;
+    }
+    char magic[8];
+    bool ret = fread(magic, 1, 8, fp) == 8 && memcmp(magic, INDEX_FILE_MAGIC, 8) == 0;
+    fclose(fp);
+    return ret;
+}
+
+//return 0 on success
+template<class Index>
+int save_index_file(const char *fname, const Index& index)
+{
+    try {
+        IndexWriter w;
+        w.add_blob("index.type", typeid(Index).name());
+        save_flat_component(w, "index.", index);
+        return w.write(fname);
+    } catch(const std::exception& e) {
+        fmt::print("Could not save {}: {}\n", fname, e.what());
+        return 1;
+    }
+}
+
+//the arrays of index alias the mapped file, which stays mapped as long as any of them lives
+//verify checks the checksum of every section, which reads the whole file
+template<class Index>
+int load_index_file(const char *fname, Index& index, bool verify=false)
+{
+    IndexReader r;
+    if(r.open(fname, verify) != 0) {
+        return 1;
+    }
+    try {
+        if(r.blob("index.type") != typeid(Index).name()) {
+            fmt::print("{} holds another type of index\n", fname);
+            return 1;
+        }
+        load_flat_component(r, "index.", index);
+    } catch(const std::exception& e) {
+        fmt::print("Could not load {}: {}\n", fname, e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -4,8 +4,17 @@
 #include "projection.h"
 #include "genie4l2.h"
 #include "genie4l2_dist.h"
+#include "flat_index.h"
 #include "util.h"
+#include "matrix.h"
+#include "dataset_io.h"
+#include "distance_simd.h"
+#include "query_server.h"
+#include "index_file.h"
+#include "mpi_search.h"
+#include "stage_stats.h"
 #include <fstream>
+#include <csignal>
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/archive/binary_oarchive.hpp>
 
@@ -14,70 +23,210 @@
 using namespace std;
 using namespace boost::program_options;
 
-// -----------------------------------------------------------------------------
-int read_data_binary(						// read data/query set from disk
-	int   n,							// number of data/query objects
-	int   d,			 				// dimensionality
-	const char *fname,					// address of data/query set
-	std::vector<std::vector<float> >& data)						// data/query objects (return)
+//how indexes are read and written, see index_file.h
+struct IndexFileOptions
 {
-	FILE *fp = fopen(fname, "rb");
-	if (!fp) {
-        fmt::print("Could not open {}\n", fname);
-		return 1;
-	}
+    //format of a newly built index: the flat mmap-able file, otherwise a boost archive
+    bool flat = true;
+    //check the checksums of all sections when a flat index is loaded
+    bool verify = false;
+    //if not empty, the loaded or built index is also written there as a flat file
+    string exportFilename;
+};
+
+//load the index from indexFilename if it exists, otherwise build it and save it there
+//both the flat format and boost archives are recognized when loading
+template<class Index>
+int load_or_build_index(Index& index, const string& indexFilename, MatrixView<float> data, const IndexFileOptions& opts)
+{
+    if(is_index_file(indexFilename.c_str())) {
+        MyTimer::pusht();
+        if(load_index_file(indexFilename.c_str(), index, opts.verify) != 0) {
+            return 1;
+        }
+        fmt::print("mapped index {}, time={}\n", indexFilename, MyTimer::popt());
+    } else {
+        std::ifstream fs(indexFilename, ios_base::binary);
+        if(fs.is_open()) {
+            boost::archive::binary_iarchive ia(fs);
+            // boost::archive::text_iarchive ia(fs);
+            ia & index;
+        } else {
+            index.build(data);
+            if(opts.flat) {
+                if(save_index_file(indexFilename.c_str(), index) != 0) {
+                    return 1;
+                }
+            } else {
+                std::ofstream ofs(indexFilename, ios_base::binary);
+                boost::archive::binary_oarchive oa(ofs);
+                // boost::archive::text_oarchive oa(ofs);
+                oa & index;
+            }
+        }
+    }
 
-    data.resize(n);
-	int i   = 0;
-	int tmp = -1;
-	while (!feof(fp) && i < n) {
-        data[i].resize(d);
-		fread(&data[i][0], sizeof(float), d, fp);
-		++i;
-	}
-//	assert(feof(fp) && i == n);
-	fclose(fp);
+    if(!opts.exportFilename.empty()) {
+        if(save_index_file(opts.exportFilename.c_str(), index) != 0) {
+            return 1;
+        }
+        fmt::print("exported index to {}\n", opts.exportFilename);
+    }
+    return 0;
+}
+
+//recall of the distances of each query against the ground truth
+inline void report_recall(const std::vector<std::vector<std::pair<float, int> > >& ress_pair, 
+    const std::vector<std::vector<Result> >& results, 
+    int qn, int K)
+{
+    std::vector<std::vector<double> > ress(qn);
+    ress.resize(ress_pair.size());
+    for(int i=0;i<ress_pair.size();i++){
+        ress[i].resize(ress_pair[i].size());
+        for(int j=0;j<ress_pair[i].size();j++){
+            ress[i][j] = ress_pair[i][j].first;
+        }
+    }
+    // index.query(queries, feu, scanner);
 
-	return 0;
+    double avg_recall = 0.;
+    for(int i=0;i<ress.size();i++){
+        // printf("ress[i].size()=%d\n", ress[i].size());
+        std::vector<double> gti;
+        for(int j=0;j<K;j++){
+            gti.push_back(results[i][j].key_);
+        }
+        std::sort(ress[i].begin(), ress[i].end());
+        std::sort(gti.begin(), gti.end());
+
+        // fmt::print("res={}, {}, gt={}, {}\n", ress[i][K/2], ress[i][K-1], gti[K/2], gti[K-1]);
+
+        avg_recall += calc_recall(ress[i], gti);
+    }
+    avg_recall /= qn;
+
+    fmt::print("avg-recall = {}\n", avg_recall);
 }
 
-// -----------------------------------------------------------------------------
-int read_ground_truth(				// read ground truth results from disk
-	int qn,								// number of query objects
-	const char *fname,					// address of truth set
-	std::vector<std::vector<Result> >& R)							// ground truth results (return)
+//build or load the index, answer the queries and report the recall
+template<class Index>
+int run_index(Index& index, const string& indexFilename, const IndexFileOptions& indexOpts, 
+    MatrixView<float> data, 
+    MatrixView<float> queries, 
+    const std::vector<std::vector<Result> >& results, 
+    int qn, int K)
 {
-	FILE *fp = fopen(fname, "r");
-	if (!fp) {
-        fmt::print("Could not open {}\n", fname);
-		return 1;
-	}
+    if(load_or_build_index(index, indexFilename, data, indexOpts) != 0) {
+        return 1;
+    }
+    
+    MyTimer::pusht();
+    auto ress_pair = index.query_vec(queries, data);
+    double t = MyTimer::popt();
+    
+    fmt::print("query_vec finished, ress_pair.size()={}, time={}\n", ress_pair.size(), t);
+    fmt::print("{}", stage_snapshot().to_table());
+    report_recall(ress_pair, results, qn, K);
 
-	int tmp1 = -1;
-	int maxk = -1;
-	fscanf(fp, "%d %d\n", &tmp1, &maxk);
-//	assert(tmp1 == qn && tmp2 == MAXK);
-	assert(maxk == MAXK);
-
-    R.resize(qn);
-	for (int i = 0; i < qn; ++i) {
-        R[i].resize(maxk);
-		for (int j = 0; j < maxk; ++j) {
-			fscanf(fp, "%d %f ", &R[i][j].id_, &R[i][j].key_);
-		}
-		fscanf(fp, "\n");
-	}
-	fclose(fp);
+    return 0;
+}
 
-	return 0;
+//each rank builds or loads the index of its part of the dataset, the root broadcasts the queries
+//and reports the recall of the merged results, see mpi_search.h
+template<class Index>
+int run_mpi_index(Index& index, const string& indexFilename, const IndexFileOptions& indexOpts, 
+    const MpiPartition& part,
+    MatrixView<float> localData, 
+    MatrixView<float> queries, 
+    const std::vector<std::vector<Result> >& results, 
+    int qn, int K, int queryPerBatch)
+{
+    fmt::print("rank {}/{}: rows [{}, {})\n", part.rank, part.size, part.begin, part.end);
+    IndexFileOptions shardOpts = indexOpts;
+    if(!shardOpts.exportFilename.empty()) {
+        shardOpts.exportFilename = mpi_shard_filename(shardOpts.exportFilename, part);
+    }
+    //every rank has to go on, or none
+    int failed = load_or_build_index(index, mpi_shard_filename(indexFilename, part), localData, shardOpts) != 0;
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if(failed) {
+        return 1;
+    }
+
+    MyTimer::pusht();
+    auto ress_pair = mpi_query_vec(index, queries, localData, part.begin, K, queryPerBatch);
+    double t = MyTimer::popt();
+    if(part.rank != 0) {
+        return 0;
+    }
+
+    fmt::print("mpi query_vec finished on {} ranks, ress_pair.size()={}, time={}\n", part.size, ress_pair.size(), t);
+    //the stages of the root only
+    fmt::print("{}", stage_snapshot().to_table());
+    report_recall(ress_pair, results, qn, K);
+
+    return 0;
+}
+
+//build or load the index, then answer queries from a unix domain socket, or from stdin if socketPath is empty
+//replyFd is where replies to stdin go
+//with statsInterval > 0, the stages recorded so far are written to stderr as json every statsInterval seconds
+template<class Index>
+int serve_index(Index& index, const string& indexFilename, const IndexFileOptions& indexOpts, MatrixView<float> data, 
+    int maxBatch, double maxDelayMs, int maxPending, const string& socketPath, int replyFd, double statsInterval)
+{
+    if(load_or_build_index(index, indexFilename, data, indexOpts) != 0) {
+        return 1;
+    }
+    //a micro-batch is a single batch, there is nothing to overlap
+    index.pipelineDepth = 0;
+    //a client going away must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    std::mutex statsMtx;
+    std::condition_variable statsCv;
+    bool done = false;
+    std::thread statsThread;
+    if(statsInterval > 0) {
+        statsThread = std::thread([&](){
+            std::unique_lock<std::mutex> lock(statsMtx);
+            while(!statsCv.wait_for(lock, std::chrono::duration<double>(statsInterval), [&](){ return done; })) {
+                fmt::print(stderr, "stages {}\n", stage_snapshot().to_json());
+            }
+        });
+    }
+
+    QueryServer<Index> server(index, data, maxBatch, maxDelayMs, maxPending);
+    fmt::print("serving, micro-batches of at most {} queries or {} ms\n", maxBatch, maxDelayMs);
+    int ret = 0;
+    if(!socketPath.empty()) {
+        ret = server.serve_unix_socket(socketPath);
+    } else {
+        server.serve_stream(0, replyFd);
+    }
+
+    if(statsThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(statsMtx);
+            done = true;
+        }
+        statsCv.notify_all();
+        statsThread.join();
+    }
+    return ret;
 }
 
 
 int main(int argc, char **argv)
 {
-    int n, qn, d, nLines, K, queryPerBatch, GPUID;
+    int n, qn, d, nLines, K, queryPerBatch, GPUID, refineFactor, pqSubspaces, pipelineDepth, flatBelow, maxPending;
 	string datasetFilename, queryFilename, weightFilename, groundtruthFilename, outputFilename, indexFilename;
-    double r;
+    string backend, quant, socketPath, indexFormat;
+    bool copyData, serve, useMpi;
+    IndexFileOptions indexOpts;
+    CandidateBudget budget;
+    double r, maxDelayMs, statsInterval;
 
 	// srand(time(NULL));
 	srand(666);
@@ -89,22 +238,42 @@ int main(int argc, char **argv)
 
 		("n,n", value(&n)->required(), "the number of data points")
 		("d,d", value(&d)->required(), "the dimension of data")
-		("qn,q", value(&qn)->required(), "the number of query points")
+		("qn,q", value(&qn)->default_value(0), "the number of query points")
 
         ("nLines,L", value(&nLines)->required(), "#projection lines")
         ("r,r", value(&r)->required(), "projection radius")
         ("k,k", value(&K)->required(), "k for top-k")
 
         ("queryPerBatch,b", value(&queryPerBatch)->required(), "#query per batch")
+        ("pipeline_depth", value(&pipelineDepth)->default_value(2), "#batches buffered between hashing, matching and re-ranking, 0 for no overlap")
 
         ("GPUID", value(&GPUID)->default_value(0), "GPUID used for genie")
+        ("backend", value(&backend)->default_value("genie"), "bucketer backend: genie (gpu) or cpu")
+        ("flat_below", value(&flatBelow)->default_value(0), "search exactly by a scan (FlatIndex) when the dataset, or the part of a rank with --mpi, has fewer rows, 0 for never")
+        ("quant", value(&quant)->default_value("none"), "compressed copy for re-ranking: none, sq8, fp16 or pq")
+        ("refine_factor", value(&refineFactor)->default_value(4), "with --quant, the best refine_factor*k are re-scored exactly, 0 for no re-scoring")
+        ("pq_m", value(&pqSubspaces)->default_value(16), "with --quant pq, #subspaces (bytes per object)")
+        ("min_count_ratio", value(&budget.minCountRatio)->default_value(0.f), "re-rank only candidates whose count is at least this fraction of the best count of the query")
+        ("stable_after", value(&budget.stableAfter)->default_value(0), "stop re-ranking a query once this many candidates in a row did not enter its top-k, 0 for never")
 
 
         ("dataset_filename,D", value(&datasetFilename)->required(), "path to dataset filename")
-		("queryset_filename,Q", value(&queryFilename)->required(), "path to query filename")
-		("ground_truth_filename,G", value(&groundtruthFilename)->required(), "path to ground truth filename")
+		("queryset_filename,Q", value(&queryFilename)->default_value(""), "path to query filename, required without --serve")
+		("ground_truth_filename,G", value(&groundtruthFilename)->default_value(""), "path to ground truth filename, required without --serve")
 		("output_filename,O", value(&outputFilename)->default_value("output.txt"), "output folder path (with / at the end) or output filename")
         ("index_filename,I", value(&indexFilename)->default_value("index.dat"), "built index")
+        ("index_format", value(&indexFormat)->default_value("flat"), "format of a newly built index: flat (mmap-able, see index_file.h) or boost; both are recognized when loading")
+        ("verify_index", bool_switch(&indexOpts.verify), "check the checksums of all sections when loading a flat index")
+        ("export_index", value(&indexOpts.exportFilename)->default_value(""), "also write the loaded or built index to this file in the flat format, e.g. to convert a boost archive")
+        ("copy_data", bool_switch(&copyData), "read dataset and queries into memory instead of mmap-ing them")
+
+        ("serve", bool_switch(&serve), "keep the index loaded and answer queries from stdin or --socket, see query_server.h")
+        ("socket", value(&socketPath)->default_value(""), "with --serve, path of the unix domain socket to listen on, stdin/stdout if empty")
+        ("max_delay_ms", value(&maxDelayMs)->default_value(5.), "with --serve, longest wait of a query for its micro-batch to fill up")
+        ("max_pending", value(&maxPending)->default_value(0), "with --serve, most queries waiting for a micro-batch before clients are no longer read, 0 for 16 micro-batches")
+        ("stats_interval", value(&statsInterval)->default_value(0.), "with --serve, seconds between writing the time of each query stage to stderr, 0 for never")
+
+        ("mpi", bool_switch(&useMpi), "run under mpirun: each rank indexes its part of the dataset in index_filename.<rank>-of-<size>, see mpi_search.h")
     ;
 
     variables_map vm;
@@ -127,25 +296,65 @@ int main(int argc, char **argv)
     }
 
 
+    if(!serve && (qn <= 0 || queryFilename == "" || groundtruthFilename == "")) {
+        std::cout << desc << std::endl;
+        fmt::print("--qn, --queryset_filename and --ground_truth_filename are required without --serve\n");
+        return 1;
+    }
+    if(serve && useMpi) {
+        fmt::print("--serve and --mpi can not be combined\n");
+        return 1;
+    }
+    std::unique_ptr<MpiSession> mpiSession;
+    if(useMpi) {
+        mpiSession.reset(new MpiSession(&argc, &argv));
+    }
+    //replies to stdin go to the real stdout, everything else printed goes to stderr
+    int replyFd = 1;
+    if(serve && socketPath.empty()) {
+        fflush(stdout);
+        replyFd = dup(1);
+        dup2(2, 1);
+    }
+
+
 	// -------------------------------------------------------------------------
 	//  read whatever needed
 	// -------------------------------------------------------------------------
-	std::vector<std::vector<float> > data, queries;
+	//by default dataset and queries are mmap-ed and used in place
+	MappedFile dataFile, queryFile;
+	Matrix<float> dataStore, queryStore;
+	MatrixView<float> data, queries;
     std::vector<std::vector<Result> > results;
 
+    //the rows this process indexes, all of them without --mpi,
+    //with --mpi only they are mapped or read such that a rank never touches the parts of the others
+    MpiPartition part{0, 1, 0, n};
+    if(useMpi) {
+        part = mpi_partition(n);
+    }
+
 	if(datasetFilename!=""){
-        if (read_data_binary(n, d, datasetFilename.c_str(), data) == 1) {
+        int err = copyData ? read_data_binary(n, d, datasetFilename.c_str(), dataStore, part.begin, part.end) : 
+            map_data_binary(n, d, datasetFilename.c_str(), dataFile, data, MADV_WILLNEED, part.begin, part.end);
+        if (err == 1) {
             fmt::print("Reading dataset error!\n");
             return 1;
         }
     }
 
     if(queryFilename!=""){
-        if (read_data_binary(qn, d, queryFilename.c_str(), queries) == 1) {
+        int err = copyData ? read_data_binary(qn, d, queryFilename.c_str(), queryStore) : 
+            map_data_binary(qn, d, queryFilename.c_str(), queryFile, queries, MADV_SEQUENTIAL);
+        if (err == 1) {
             fmt::print("Reading query set error!\n");
             return 1;
         }
     }
+    if(copyData) {
+        data = dataStore;
+        queries = queryStore;
+    }
 
 	if(groundtruthFilename!=""){
 		if (read_ground_truth(qn, groundtruthFilename.c_str(), results) == 1) {
@@ -154,63 +363,63 @@ int main(int argc, char **argv)
 		}
 	}
     fmt::print("finishing reading data, query and ground truth!\n");
+    fmt::print("distance kernels: {}\n", get_distance_kernels().name);
 
-
-    // DistGenie4l2<float> index(d, nLines, r, K, queryPerBatch);
-    // Genie4l2<float> index(d, nLines, r, K, queryPerBatch, GPUID);
-    GeniePivot<float> index(d, nLines, K, queryPerBatch, GPUID, data);
-    std::fstream fs(indexFilename, ios_base::out | ios_base::in);
-
-    if(fs.is_open()) {
-        boost::archive::binary_iarchive ia(fs);
-        // boost::archive::text_iarchive ia(fs);
-        ia & index;
-    } else{
-        index.build(data);
+    if(indexFormat != "flat" && indexFormat != "boost") {
+        fmt::print("Unknown index format {}\n", indexFormat);
+        return 1;
     }
-    
-    
-    std::vector<std::vector<double> > ress(qn);
-    
-    MyTimer::pusht();
-    auto ress_pair = index.query_vec(queries, data);
-    double t = MyTimer::popt();
-    
-    fmt::print("query_vec finished, ress_pair.size()={}, time={}\n", ress_pair.size(), t);
-    ress.resize(ress_pair.size());
-    for(int i=0;i<ress_pair.size();i++){
-        ress[i].resize(ress_pair[i].size());
-        for(int j=0;j<ress_pair[i].size();j++){
-            ress[i][j] = ress_pair[i][j].first;
-        }
+    indexOpts.flat = indexFormat == "flat";
+
+    QuantType quantType = QUANT_NONE;
+    if(quant == "sq8") {
+        quantType = QUANT_SQ8;
+    } else if(quant == "fp16") {
+        quantType = QUANT_FP16;
+    } else if(quant == "pq") {
+        quantType = QUANT_PQ;
+    } else if(quant != "none") {
+        fmt::print("Unknown quantization {}\n", quant);
+        return 1;
     }
-    // index.query(queries, feu, scanner);
 
-    double avg_recall = 0.;
-    for(int i=0;i<ress.size();i++){
-        // printf("ress[i].size()=%d\n", ress[i].size());
-        std::vector<double> gti;
-        for(int j=0;j<K;j++){
-            gti.push_back(results[i][j].key_);
-        }
-        std::sort(ress[i].begin(), ress[i].end());
-        std::sort(gti.begin(), gti.end());
 
-        // fmt::print("res={}, {}, gt={}, {}\n", ress[i][K/2], ress[i][K-1], gti[K/2], gti[K-1]);
+    //data holds rows [part.begin, part.end) only
+    MatrixView<float> localData = data;
 
-        avg_recall += calc_recall(ress[i], gti);
+    auto run_any = [&](auto& index){
+        index.pipelineDepth = pipelineDepth;
+        if(serve) {
+            return serve_index(index, indexFilename, indexOpts, data, queryPerBatch, maxDelayMs, maxPending, socketPath, replyFd, statsInterval);
+        }
+        if(useMpi) {
+            return run_mpi_index(index, indexFilename, indexOpts, part, localData, queries, results, qn, K, queryPerBatch);
+        }
+        return run_index(index, indexFilename, indexOpts, data, queries, results, qn, K);
+    };
+    auto run = [&](auto& index){
+        index.rerankStore.set_quantization(quantType, refineFactor);
+        index.rerankStore.pqSubspaces = pqSubspaces;
+        index.rerankStore.budget = budget;
+        return run_any(index);
+    };
+
+    //a scan is faster and exact on few rows, see flat_index.h
+    if(localData.rows < flatBelow) {
+        fmt::print("{} rows are fewer than --flat_below, searching by a scan\n", localData.rows);
+        FlatIndex<float> index(d, K, queryPerBatch);
+        return run_any(index);
     }
-    avg_recall /= qn;
 
-    fmt::print("avg-recall = {}\n", avg_recall);
-
-
-    if(!fs.is_open()) {
-        fs.open(indexFilename, ios_base::out);
-        boost::archive::binary_oarchive oa(fs);
-        // boost::archive::text_oarchive oa(fs);
-        oa & index;
+    // DistGenie4l2<float> index(d, nLines, r, K, queryPerBatch);
+    // Genie4l2<float> index(d, nLines, r, K, queryPerBatch, GPUID);
+    if(backend == "genie") {
+        GeniePivot<float> index(d, nLines, K, queryPerBatch, GPUID, localData);
+        return run(index);
+    } else if(backend == "cpu") {
+        GeniePivot<float, CpuBucketer> index(d, nLines, K, queryPerBatch, GPUID, localData);
+        return run(index);
     }
-
-    return 0;
-}
\ No newline at end of file
+    fmt::print("Unknown backend {}\n", backend);
+    return 1;
+}
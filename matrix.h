@@ -0,0 +1,143 @@
+#pragma once
+
+//dense row-major matrices for datasets, queries, pivots and so on
+//rows are 64-byte aligned: the stride is padded to a multiple of 64 bytes
+//the storage of a Matrix could also alias a memory-mapped index file, see flat_array.h
+
+#include <vector>
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <boost/serialization/vector.hpp>
+
+#include "util.h"
+#include "flat_array.h"
+
+//read-only view of a row-major matrix, does not own the memory
+template<class Scalar>
+struct MatrixView
+{
+    MatrixView() {}
+    MatrixView(const Scalar* data, int rows, int cols, size_t stride=0)
+        :data(data), rows(rows), cols(cols), stride(stride==0 ? cols : stride)
+    {
+    }
+
+    const Scalar* row(int i) const
+    {
+        assert(i >= 0 && i < rows);
+        return data + size_t(i)*stride;
+    }
+    const Scalar* operator[](int i) const
+    {
+        return row(i);
+    }
+
+    //rows [beg, end)
+    MatrixView slice(int beg, int end) const
+    {
+        assert(0 <= beg && beg <= end && end <= rows);
+        return MatrixView(data + size_t(beg)*stride, end-beg, cols, stride);
+    }
+
+    size_t size() const
+    {
+        return rows;
+    }
+
+    const Scalar* data = nullptr;
+    int rows = 0;
+    int cols = 0;
+    size_t stride = 0;
+};
+
+//owning matrix with 64-byte aligned rows
+template<class Scalar>
+struct Matrix
+{
+    Matrix() {}
+    Matrix(int rows, int cols)
+    {
+        resize(rows, cols);
+    }
+
+    //copy from the legacy std::vector<std::vector<Scalar> > layout
+    static Matrix from_rows(const std::vector<std::vector<Scalar> >& objects)
+    {
+        Matrix ret(objects.size(), objects.empty() ? 0 : objects[0].size());
+        for(int i=0;i<ret.rows;i++){
+            assert(objects[i].size() == ret.cols);
+            std::copy(objects[i].begin(), objects[i].end(), ret.row(i));
+        }
+        return ret;
+    }
+
+    static size_t padded_stride(int cols)
+    {
+        const size_t elemsPerLine = std::max<size_t>(1, 64 / sizeof(Scalar));
+        return (size_t(cols) + elemsPerLine-1) / elemsPerLine * elemsPerLine;
+    }
+
+    //content is not kept, padding is zero
+    void resize(int rows_, int cols_)
+    {
+        rows = rows_;
+        cols = cols_;
+        stride = padded_stride(cols);
+        storage.assign(size_t(rows)*stride, Scalar(0));
+    }
+
+    //change #rows and keep the content of the first min(rows, newRows) rows
+    void resize_rows(int newRows)
+    {
+        storage.resize(size_t(newRows)*stride, Scalar(0));
+        rows = newRows;
+    }
+
+    Scalar* row(int i)
+    {
+        assert(i >= 0 && i < rows);
+        return storage.data() + size_t(i)*stride;
+    }
+    const Scalar* row(int i) const
+    {
+        assert(i >= 0 && i < rows);
+        return storage.data() + size_t(i)*stride;
+    }
+    Scalar* operator[](int i)
+    {
+        return row(i);
+    }
+    const Scalar* operator[](int i) const
+    {
+        return row(i);
+    }
+
+    size_t size() const
+    {
+        return rows;
+    }
+
+    MatrixView<Scalar> view() const
+    {
+        return MatrixView<Scalar>(storage.data(), rows, cols, stride);
+    }
+    operator MatrixView<Scalar>() const
+    {
+        return view();
+    }
+
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int )
+    {
+        ar & rows;
+        ar & cols;
+        ar & stride;
+        ar & storage;
+    }
+
+    int rows = 0;
+    int cols = 0;
+    size_t stride = 0;
+    FlatArray<Scalar> storage;
+};
@@ -0,0 +1,189 @@
+#pragma once
+
+//search over ranks of MPI, each rank owns a contiguous part of the dataset and its own index on it
+//
+//  build:  rank r indexes rows [begin, end) of mpi_partition, ids of its index are local to the part
+//  query:  the root broadcasts the queries batch by batch, every rank answers a batch with its own index,
+//          the per-rank top-k lists of (distance, global id) are gathered and merged on the root
+//the broadcast of the next batch and the gather of the previous one are non-blocking and overlap the
+//search of the current batch
+//
+//e.g. mpirun -np 4 genie_nn --mpi ... runs 4 ranks on one machine, each rank still uses all threads of
+//the machine unless GENIE4L2_NUM_THREADS is set
+
+#include <vector>
+#include <string>
+#include <limits>
+#include <algorithm>
+#include <utility>
+#include <cstdint>
+
+#include <mpi.h>
+#include <fmt/format.h>
+
+#include "matrix.h"
+#include "parallel.h"
+#include "stage_stats.h"
+
+template<class Scalar>
+MPI_Datatype mpi_type();
+template<>
+inline MPI_Datatype mpi_type<float>()
+{
+    return MPI_FLOAT;
+}
+template<>
+inline MPI_Datatype mpi_type<double>()
+{
+    return MPI_DOUBLE;
+}
+
+//the part of n rows owned by a rank
+struct MpiPartition
+{
+    int rank;
+    int size;
+    int begin;
+    int end;
+};
+
+inline MpiPartition mpi_partition(int n, MPI_Comm comm=MPI_COMM_WORLD)
+{
+    MpiPartition p;
+    MPI_Comm_rank(comm, &p.rank);
+    MPI_Comm_size(comm, &p.size);
+    p.begin = int(int64_t(n)*p.rank / p.size);
+    p.end = int(int64_t(n)*(p.rank+1) / p.size);
+    return p;
+}
+
+//the index file of a rank's part
+inline std::string mpi_shard_filename(const std::string& fname, const MpiPartition& p)
+{
+    return fmt::format("{}.{}-of-{}", fname, p.rank, p.size);
+}
+
+//Index :: anything with query_vec(MatrixView<Scalar> queries, MatrixView<Scalar> data) -> top-k (distance, id) of each query
+//queries are only read on root, localData are the rows of the rank's part, which start at globalOffset
+//return the merged top-k of each query on root, nothing on the other ranks
+template<class Scalar, class Index>
+std::vector<std::vector<std::pair<Scalar, int> > > mpi_query_vec(Index& index, MatrixView<Scalar> queries,
+    MatrixView<Scalar> localData, int globalOffset, int topk, int queryPerBatch, int root=0, MPI_Comm comm=MPI_COMM_WORLD)
+{
+    using ResPair = std::pair<Scalar, int>;
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    int shape[2] = {queries.rows, queries.cols};
+    MPI_Bcast(shape, 2, MPI_INT, root, comm);
+    const int numQueries = shape[0], dim = shape[1];
+    const int numBatches = (numQueries + queryPerBatch - 1) / queryPerBatch;
+    auto batch_rows = [&](int b){
+        return std::min((b+1) * queryPerBatch, numQueries) - b * queryPerBatch;
+    };
+
+    //double buffers: queries of a batch, and the (distance, global id) top-k sent and gathered, padded with id -1
+    Matrix<Scalar> batchQueries[2];
+    MPI_Request bcastReq[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+    std::vector<Scalar> sendDists[2], recvDists[2];
+    std::vector<int> sendIds[2], recvIds[2];
+    MPI_Request gatherReq[2][2] = {{MPI_REQUEST_NULL, MPI_REQUEST_NULL}, {MPI_REQUEST_NULL, MPI_REQUEST_NULL}};
+
+    auto post_bcast = [&](int b){
+        Matrix<Scalar>& buf = batchQueries[b%2];
+        buf.resize(batch_rows(b), dim);
+        if(rank == root) {
+            for(int i=0;i<buf.rows;i++){
+                std::copy(queries.row(b*queryPerBatch + i), queries.row(b*queryPerBatch + i) + dim, buf.row(i));
+            }
+        }
+        MPI_Ibcast(buf.row(0), int(buf.rows*buf.stride), mpi_type<Scalar>(), root, comm, &bcastReq[b%2]);
+    };
+
+    std::vector<std::vector<ResPair> > ret(rank == root ? numQueries : 0);
+    //merge the gathered lists of batch b on root
+    auto merge = [&](int b){
+        MPI_Waitall(2, gatherReq[b%2], MPI_STATUSES_IGNORE);
+        if(rank != root) {
+            return ;
+        }
+        const int rows = batch_rows(b);
+        StageTimer<Stage::Merge> timer(rows);
+        const std::vector<Scalar>& dists = recvDists[b%2];
+        const std::vector<int>& ids = recvIds[b%2];
+        parallel_for(0, rows, 16, [&](int , int beg, int end){
+            for(int i=beg;i<end;i++){
+                std::vector<ResPair>& res = ret[b*queryPerBatch + i];
+                for(int r=0;r<size;r++){
+                    size_t off = (size_t(r)*rows + i) * topk;
+                    for(int j=0;j<topk && ids[off+j] >= 0;j++){
+                        res.emplace_back(dists[off+j], ids[off+j]);
+                    }
+                }
+                int n = std::min<int>(topk, res.size());
+                std::partial_sort(res.begin(), res.begin()+n, res.end());
+                res.resize(n);
+            }
+        });
+    };
+
+    if(numBatches > 0) {
+        post_bcast(0);
+    }
+    for(int b=0;b<numBatches;b++){
+        MPI_Wait(&bcastReq[b%2], MPI_STATUS_IGNORE);
+        if(b+1 < numBatches) {
+            //the buffer of batch b+1 was last used by batch b-1, which is searched already
+            post_bcast(b+1);
+        }
+        auto local = index.query_vec(batchQueries[b%2].view(), localData);
+
+        //the gather of batch b-2 used the same buffers
+        MPI_Waitall(2, gatherReq[b%2], MPI_STATUSES_IGNORE);
+        const int rows = batch_rows(b);
+        std::vector<Scalar>& sd = sendDists[b%2];
+        std::vector<int>& si = sendIds[b%2];
+        sd.assign(size_t(rows)*topk, std::numeric_limits<Scalar>::max());
+        si.assign(size_t(rows)*topk, -1);
+        for(int i=0;i<rows;i++){
+            for(int j=0;j<std::min<int>(topk, local[i].size());j++){
+                sd[size_t(i)*topk + j] = local[i][j].first;
+                si[size_t(i)*topk + j] = local[i][j].second + globalOffset;
+            }
+        }
+        if(rank == root) {
+            recvDists[b%2].resize(size_t(size)*rows*topk);
+            recvIds[b%2].resize(size_t(size)*rows*topk);
+        }
+        MPI_Igather(sd.data(), rows*topk, mpi_type<Scalar>(), recvDists[b%2].data(), rows*topk, mpi_type<Scalar>(),
+            root, comm, &gatherReq[b%2][0]);
+        MPI_Igather(si.data(), rows*topk, MPI_INT, recvIds[b%2].data(), rows*topk, MPI_INT,
+            root, comm, &gatherReq[b%2][1]);
+
+        if(b > 0) {
+            merge(b-1);
+        }
+    }
+    if(numBatches > 0) {
+        merge(numBatches-1);
+    }
+    return ret;
+}
+
+//MPI is initialized for the lifetime of the object, only the thread constructing it makes MPI calls
+class MpiSession
+{
+public:
+    MpiSession(int* argc, char*** argv)
+    {
+        int provided;
+        MPI_Init_thread(argc, argv, MPI_THREAD_FUNNELED, &provided);
+    }
+    ~MpiSession()
+    {
+        MPI_Finalize();
+    }
+    MpiSession(const MpiSession& ) = delete;
+    MpiSession& operator=(const MpiSession& ) = delete;
+};
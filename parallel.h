@@ -0,0 +1,91 @@
+#pragma once
+
+//small helpers for multi-threading with std::thread
+
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+
+//caps get_num_threads() on the calling thread while alive, such that stages running side by side
+//share the cores instead of each starting a pool of all of them, see pipeline.h
+class ThreadLimit
+{
+public:
+    explicit ThreadLimit(int n)
+        :saved(limit())
+    {
+        limit() = std::max(1, n);
+    }
+    ~ThreadLimit()
+    {
+        limit() = saved;
+    }
+    ThreadLimit(const ThreadLimit& ) = delete;
+    ThreadLimit& operator=(const ThreadLimit& ) = delete;
+
+    //0 for no limit
+    static int& limit()
+    {
+        thread_local int n = 0;
+        return n;
+    }
+
+private:
+    int saved;
+};
+
+//number of worker threads, can be overridden by GENIE4L2_NUM_THREADS, and lowered on a thread by ThreadLimit
+inline int get_num_threads()
+{
+    static const int nThreads = [](){
+        const char *env = getenv("GENIE4L2_NUM_THREADS");
+        if(env != nullptr && atoi(env) > 0) {
+            return atoi(env);
+        }
+        return std::max<int>(1, std::thread::hardware_concurrency());
+    }();
+    const int limit = ThreadLimit::limit();
+    return limit > 0 ? std::min(nThreads, limit) : nThreads;
+}
+
+//split [begin, end) into chunks of size chunk and hand them out to threads dynamically
+//f :: thread-id -> chunk-begin -> chunk-end -> IO
+template<class F>
+void parallel_for(int begin, int end, int chunk, const F& f, int nThreads=get_num_threads())
+{
+    if(end <= begin) {
+        return ;
+    }
+    chunk = std::max(chunk, 1);
+    int nChunks = (end - begin + chunk - 1) / chunk;
+    nThreads = std::max(1, std::min(nThreads, nChunks));
+    if(nThreads == 1) {
+        for(int b=begin;b<end;b+=chunk){
+            f(0, b, std::min(b+chunk, end));
+        }
+        return ;
+    }
+
+    std::atomic<int> next(begin);
+    auto worker = [&](int tid){
+        for(;;){
+            int b = next.fetch_add(chunk);
+            if(b >= end) {
+                break;
+            }
+            f(tid, b, std::min(b+chunk, end));
+        }
+    };
+
+    std::vector<std::thread> pools;
+    pools.reserve(nThreads-1);
+    for(int tid=1;tid<nThreads;tid++){
+        pools.emplace_back(worker, tid);
+    }
+    worker(0);
+    for(auto& t:pools){
+        t.join();
+    }
+}
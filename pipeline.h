@@ -0,0 +1,154 @@
+#pragma once
+
+//batches of queries flow through hash -> match -> re-rank on separate threads,
+//connected by bounded queues such that the stages of consecutive batches overlap
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <utility>
+#include <exception>
+#include <algorithm>
+#include <functional>
+
+#include "parallel.h"
+
+//blocking fifo with a fixed capacity
+template<class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity)
+        :capacity(std::max<size_t>(1, capacity))
+    {
+    }
+
+    //blocks while the queue is full, false if the queue is closed
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        notFull.wait(lock, [&](){ return closed || items.size() < capacity; });
+        if(closed) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    //blocks while the queue is empty, false once it is closed and drained
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        notEmpty.wait(lock, [&](){ return closed || !items.empty(); });
+        if(items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    //no more push, the items left could still be popped
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed = false;
+    std::deque<T> items;
+    std::mutex mtx;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+};
+
+//hash :: batch-id -> Sigs
+//match :: Sigs& -> Candidates
+//consume :: batch-id -> Candidates& -> IO, called on the calling thread in the order of batches
+//hash and match run on their own threads with at most depth batches waiting between two stages,
+//depth 0 runs the three stages of each batch one after another on the calling thread
+//matchInit runs on the thread that matches before its first batch, e.g. to select the device of the index
+//while overlapping, hash and consume get half of the threads each for their parallel_for
+//the first exception thrown by a stage stops the others and is rethrown
+template<class Hash, class Match, class Consume>
+void run_pipeline(int numBatches, int depth, const Hash& hash, const Match& match, const Consume& consume,
+        const std::function<void()>& matchInit=nullptr)
+{
+    using Sigs = decltype(hash(0));
+    using Candidates = decltype(match(std::declval<Sigs&>()));
+
+    if(depth <= 0) {
+        if(matchInit && numBatches > 0) {
+            matchInit();
+        }
+        for(int i=0;i<numBatches;i++){
+            Sigs sigs = hash(i);
+            Candidates candidates = match(sigs);
+            consume(i, candidates);
+        }
+        return ;
+    }
+
+    BoundedQueue<std::pair<int, Sigs> > sigQueue(depth);
+    BoundedQueue<std::pair<int, Candidates> > candidateQueue(depth);
+    std::exception_ptr errors[3];
+    const int stageThreads = std::max(1, get_num_threads() / 2);
+
+    std::thread hashThread([&](){
+        ThreadLimit limit(stageThreads);
+        try {
+            for(int i=0;i<numBatches;i++){
+                if(!sigQueue.push(std::make_pair(i, hash(i)))) {
+                    break;
+                }
+            }
+        } catch(...) {
+            errors[0] = std::current_exception();
+        }
+        sigQueue.close();
+    });
+    std::thread matchThread([&](){
+        try {
+            if(matchInit) {
+                matchInit();
+            }
+            std::pair<int, Sigs> item;
+            while(sigQueue.pop(item)){
+                if(!candidateQueue.push(std::make_pair(item.first, match(item.second)))) {
+                    break;
+                }
+            }
+        } catch(...) {
+            errors[1] = std::current_exception();
+        }
+        //closing the input as well stops hashing if this stage ends early
+        sigQueue.close();
+        candidateQueue.close();
+    });
+
+    try {
+        ThreadLimit limit(stageThreads);
+        std::pair<int, Candidates> item;
+        while(candidateQueue.pop(item)){
+            consume(item.first, item.second);
+        }
+    } catch(...) {
+        errors[2] = std::current_exception();
+    }
+    candidateQueue.close();
+
+    hashThread.join();
+    matchThread.join();
+    for(auto& e:errors){
+        if(e) {
+            std::rethrow_exception(e);
+        }
+    }
+}
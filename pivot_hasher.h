@@ -7,6 +7,12 @@
 #include <random>
 #include <algorithm>
 
+#include "gemm.h"
+#include "parallel.h"
+#include "util.h"
+#include "matrix.h"
+#include "index_file.h"
+
 //hasher using pivot-based method
 //data-dependent method
 template<class Scalar, class SigType>
@@ -14,21 +20,15 @@ class PivotHasher
 {
 public:
     //d: dim; sigdim: sigdim, nPivots: #pivots
-    PivotHasher(int d, int sigdim, int nPivots, const std::vector<std::vector<Scalar> > & dataset)      //dim of data object, #hasher, radius 
+    PivotHasher(int d, int sigdim, int nPivots, MatrixView<Scalar> dataset)      //dim of data object, #hasher, radius 
         :dim(d), sigdim(sigdim), nPivots(nPivots)
     {
-        assert(d > 0 && sigdim> 0 && nPivots >= sigdim);
-
-        std::uniform_int_distribution<> uniform(0, dataset.size()-1);
-        std::random_device rd;
-        std::default_random_engine rng(rd());
-
-
-        pivots.reserve(nPivots);
-        for(int i=0;i<nPivots;i++){
-            int r = uniform(rng);
-            pivots.push_back(dataset[r]);
-        }
+        init_pivots(dataset, dataset.rows);
+    }
+    PivotHasher(int d, int sigdim, int nPivots, const std::vector<std::vector<Scalar> > & dataset)
+        :dim(d), sigdim(sigdim), nPivots(nPivots)
+    {
+        init_pivots(dataset, dataset.size());
     }
     ~PivotHasher() {}
 
@@ -44,37 +44,54 @@ public:
     template<class F>
     void getSig(const Scalar *data, SigType* ret, const F& f) const
     {
-        std::vector<double> dists(nPivots);
+        Scratch& scratch = get_scratch();
         for(int i=0;i<nPivots;i++){
-            dists[i] = f(dim, data, &pivots[i][0]);
+            scratch.dists[i] = f(dim, data, get_pivot(i));
         }
-        std::vector<int> orders(nPivots);
-        for(int i=0;i<nPivots;i++){
-            orders[i] = i;
+        select_sig(&scratch.dists[0], scratch, ret);
+    }
+
+    //hash n objects stored row by row with a stride of ldx w.r.t. squared l2 distance, out is n x sigdim
+    //the distances of a block of rows to all pivots are computed at once as ||x||^2 + ||p||^2 - 2 x.p,
+    //||x||^2 is the same for all pivots of one row thus it is dropped
+    void getSigBatch(const Scalar *rows, int n, SigType* out, size_t ldx=0) const
+    {
+        if(ldx == 0) {
+            ldx = dim;
         }
-        std::partial_sort(orders.begin(), orders.begin()+sigdim, orders.end(), [&](int a, int b){
-            return dists[a] < dists[b];
+        parallel_for(0, n, rowsPerBlock, [&](int , int beg, int end){
+            getSigBlock(rows + beg*ldx, end-beg, out + size_t(beg)*sigdim, ldx);
         });
-        std::copy(orders.begin(), orders.begin()+sigdim, ret);
-        // for(int i=0;i<sigdim;i++){
-        //     printf("%d, %f\n", orders[i], dists[orders[i]]);
-        // }
-
-        // for(int i=0;;i++){
-        //     int start = i*sigdim;
-        //     int end = std::min((i+1)*sigdim, nPivots);
-        //     std::sort(orders.begin()+start, orders.begin()+end, [&](int a, int b){
-        //         return dists[a] < dists[b];
-        //     });
-
-        //     if(end==nPivots){
-        //         break;
-        //     }
-        // }
-
-        // std::copy(orders.begin(), orders.end(), ret);
     }
 
+    //single-threaded version of getSigBatch
+    void getSigBlock(const Scalar *rows, int n, SigType* out, size_t ldx=0) const
+    {
+        if(ldx == 0) {
+            ldx = dim;
+        }
+        Scratch& scratch = get_scratch();
+        std::vector<Scalar>& dots = scratch.dots;
+        dots.resize(size_t(rowsPerBlock)*nPivots);
+        for(int beg=0;beg<n;beg+=rowsPerBlock){
+            int m = std::min(rowsPerBlock, n-beg);
+            gemm_nt(m, nPivots, dim, rows + beg*ldx, ldx, pivots.row(0), pivots.stride, &dots[0], nPivots);
+            for(int i=0;i<m;i++){
+                for(int j=0;j<nPivots;j++){
+                    scratch.dists[j] = double(pivotNorms[j]) - 2.*dots[size_t(i)*nPivots + j];
+                }
+                select_sig(&scratch.dists[0], scratch, out + size_t(beg+i)*sigdim);
+            }
+        }
+    }
+
+    const Scalar* get_pivot(int i) const
+    {
+        return pivots.row(i);
+    }
+
+    const static int rowsPerBlock = 64;
+
     template<class Archive>
     void serialize(Archive & ar, const unsigned int )
     {
@@ -82,10 +99,89 @@ public:
         ar & sigdim;
         ar & nPivots;
         ar & pivots;
+        if(Archive::is_loading::value){
+            init_pivot_norms();
+        }
+    }
+
+    //see index_file.h
+    void save_flat(IndexWriter& w, const std::string& prefix) const
+    {
+        w.add_value(prefix + "dim", dim);
+        w.add_value(prefix + "sigdim", sigdim);
+        w.add_value(prefix + "nPivots", nPivots);
+        w.add_matrix(prefix + "pivots", pivots);
+        w.add_array(prefix + "pivotNorms", pivotNorms);
+    }
+    void load_flat(const IndexReader& r, const std::string& prefix)
+    {
+        dim = r.value<int>(prefix + "dim");
+        sigdim = r.value<int>(prefix + "sigdim");
+        nPivots = r.value<int>(prefix + "nPivots");
+        pivots = r.matrix<Scalar>(prefix + "pivots");
+        pivotNorms = r.array<Scalar>(prefix + "pivotNorms");
     }
 
 
 protected:
+    //per-thread buffers reused across calls
+    struct Scratch
+    {
+        std::vector<double> dists;
+        std::vector<int> orders;
+        std::vector<Scalar> dots;
+    };
+
+    Scratch& get_scratch() const
+    {
+        thread_local Scratch scratch;
+        if(scratch.dists.size() < nPivots) {
+            scratch.dists.resize(nPivots);
+            scratch.orders.resize(nPivots);
+        }
+        return scratch;
+    }
+
+    //ids of the sigdim closest pivots
+    void select_sig(const double *dists, Scratch& scratch, SigType* ret) const
+    {
+        std::vector<int>& orders = scratch.orders;
+        for(int i=0;i<nPivots;i++){
+            orders[i] = i;
+        }
+        std::partial_sort(orders.begin(), orders.begin()+sigdim, orders.begin()+nPivots, [&](int a, int b){
+            return dists[a] < dists[b];
+        });
+        std::copy(orders.begin(), orders.begin()+sigdim, ret);
+    }
+
+    //Rows could be MatrixView or the legacy std::vector<std::vector<Scalar> >
+    template<class Rows>
+    void init_pivots(const Rows& dataset, int n)
+    {
+        assert(dim > 0 && sigdim> 0 && nPivots >= sigdim && n > 0);
+
+        std::uniform_int_distribution<> uniform(0, n-1);
+        std::random_device rd;
+        std::default_random_engine rng(rd());
+
+        pivots.resize(nPivots, dim);
+        for(int i=0;i<nPivots;i++){
+            int r = uniform(rng);
+            std::copy(&dataset[r][0], &dataset[r][0]+dim, pivots.row(i));
+        }
+        init_pivot_norms();
+    }
+
+    void init_pivot_norms()
+    {
+        pivotNorms.resize(nPivots);
+        for(int i=0;i<nPivots;i++){
+            pivotNorms[i] = calc_inner_product(dim, get_pivot(i), get_pivot(i));
+        }
+    }
+
     int dim, sigdim, nPivots;
-    std::vector<std::vector<Scalar> > pivots;
+    Matrix<Scalar> pivots;
+    FlatArray<Scalar> pivotNorms;
 };
\ No newline at end of file
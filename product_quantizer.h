@@ -0,0 +1,322 @@
+#pragma once
+
+//product quantization: the dimensions are split into M subspaces, each quantized by its own 256 centroids
+//an object is stored as M bytes and scored against a query by M table lookups (asymmetric distance, adc)
+
+#include <vector>
+#include <random>
+#include <cstdint>
+#include <algorithm>
+#include <boost/serialization/vector.hpp>
+
+#include "matrix.h"
+#include "parallel.h"
+#include "gemm.h"
+#include "util.h"
+#include "rerank.h"
+#include "index_file.h"
+
+template<class Scalar>
+class ProductQuantizer
+{
+public:
+    const static int numCentroids = 256;
+    const static int rowsPerBlock = 64;
+
+    ProductQuantizer() {}
+
+    //k-means of each subspace on at most trainRows sampled objects, then all objects are encoded
+    void build(MatrixView<Scalar> objects, int M_, int nIters=10, int trainRows=32768, unsigned seed=666)
+    {
+        dim = objects.cols;
+        rows = objects.rows;
+        M = std::max(1, std::min(M_, dim));
+        //subspace m is [subOffsets[m], subOffsets[m+1]), sizes differ by at most 1
+        subOffsets.resize(M+1);
+        for(int m=0;m<=M;m++){
+            subOffsets[m] = int(int64_t(dim)*m/M);
+        }
+        centroids.assign(size_t(numCentroids)*dim, 0.f);
+        codes.clear();
+        if(rows == 0) {
+            return ;
+        }
+
+        std::mt19937 rng(seed);
+        std::vector<int> ids(rows);
+        for(int i=0;i<rows;i++){
+            ids[i] = i;
+        }
+        std::shuffle(ids.begin(), ids.end(), rng);
+        ids.resize(std::min(rows, trainRows));
+        Matrix<float> train(ids.size(), dim);
+        for(int i=0;i<train.rows;i++){
+            std::copy(objects.row(ids[i]), objects.row(ids[i])+dim, train.row(i));
+        }
+        for(int m=0;m<M;m++){
+            train_subspace(train, m, nIters, rng);
+        }
+
+        encode_all(objects);
+    }
+
+    bool enabled() const
+    {
+        return M > 0 && !codes.empty();
+    }
+    int size() const
+    {
+        return enabled() ? rows : 0;
+    }
+
+    //lut[m*numCentroids + k] = squared l2 between subvector m of the query and centroid k of subspace m
+    void compute_lut(const Scalar* query, float* lut) const
+    {
+        thread_local std::vector<float> q;
+        q.assign(query, query+dim);
+        for(int m=0;m<M;m++){
+            const int ds = subOffsets[m+1] - subOffsets[m];
+            const float* C = get_centroids(m);
+            for(int k=0;k<numCentroids;k++){
+                lut[m*numCentroids + k] = calc_l2_sqr(ds, &q[subOffsets[m]], C + k*ds);
+            }
+        }
+    }
+
+    //approximate squared l2 between the query of lut and object id
+    float adc(const float* lut, int id) const
+    {
+        const uint8_t* c = code(id);
+        float s0 = 0.f, s1 = 0.f, s2 = 0.f, s3 = 0.f;
+        int m = 0;
+        for(;m+4<=M;m+=4){
+            s0 += lut[(m  )*numCentroids + c[m  ]];
+            s1 += lut[(m+1)*numCentroids + c[m+1]];
+            s2 += lut[(m+2)*numCentroids + c[m+2]];
+            s3 += lut[(m+3)*numCentroids + c[m+3]];
+        }
+        for(;m<M;m++){
+            s0 += lut[m*numCentroids + c[m]];
+        }
+        return (s0 + s1) + (s2 + s3);
+    }
+
+    const uint8_t* code(int id) const
+    {
+        return &codes[size_t(id)*M];
+    }
+    size_t lut_size() const
+    {
+        return size_t(M)*numCentroids;
+    }
+
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int )
+    {
+        ar & dim;
+        ar & rows;
+        ar & M;
+        ar & subOffsets;
+        ar & centroids;
+        ar & codes;
+    }
+
+    //see index_file.h
+    void save_flat(IndexWriter& w, const std::string& prefix) const
+    {
+        w.add_value(prefix + "dim", dim);
+        w.add_value(prefix + "rows", rows);
+        w.add_value(prefix + "M", M);
+        w.add_array(prefix + "subOffsets", subOffsets);
+        w.add_array(prefix + "centroids", centroids);
+        w.add_array(prefix + "codes", codes);
+    }
+    void load_flat(const IndexReader& r, const std::string& prefix)
+    {
+        dim = r.value<int>(prefix + "dim");
+        rows = r.value<int>(prefix + "rows");
+        M = r.value<int>(prefix + "M");
+        subOffsets = r.array<int>(prefix + "subOffsets");
+        centroids = r.array<float>(prefix + "centroids");
+        codes = r.array<uint8_t>(prefix + "codes");
+    }
+
+    int dim = 0;
+    int rows = 0;
+    int M = 0;
+
+private:
+    //centroids of subspace m, numCentroids x (its #dims), row-major
+    const float* get_centroids(int m) const
+    {
+        return &centroids[size_t(numCentroids)*subOffsets[m]];
+    }
+    float* get_centroids(int m)
+    {
+        return &centroids[size_t(numCentroids)*subOffsets[m]];
+    }
+
+    std::vector<float> get_centroid_norms(int m) const
+    {
+        const int ds = subOffsets[m+1] - subOffsets[m];
+        const float* C = get_centroids(m);
+        std::vector<float> norms(numCentroids);
+        for(int k=0;k<numCentroids;k++){
+            norms[k] = calc_inner_product(ds, C + k*ds, C + k*ds);
+        }
+        return norms;
+    }
+
+    //nearest centroid of subspace m for n rows, by ||c||^2 - 2 x.c
+    void assign_block(const float* x, size_t ldx, int n, int m, const std::vector<float>& cnorms,
+            int* out, size_t outStride, std::vector<float>& dots) const
+    {
+        const int ds = subOffsets[m+1] - subOffsets[m];
+        dots.resize(size_t(n)*numCentroids);
+        gemm_nt(n, numCentroids, ds, x + subOffsets[m], ldx, get_centroids(m), ds, &dots[0], numCentroids);
+        for(int i=0;i<n;i++){
+            const float* d = &dots[size_t(i)*numCentroids];
+            int best = 0;
+            float bestDist = cnorms[0] - 2*d[0];
+            for(int k=1;k<numCentroids;k++){
+                float dist = cnorms[k] - 2*d[k];
+                if(dist < bestDist) {
+                    bestDist = dist;
+                    best = k;
+                }
+            }
+            out[i*outStride] = best;
+        }
+    }
+
+    void train_subspace(const Matrix<float>& train, int m, int nIters, std::mt19937& rng)
+    {
+        const int ds = subOffsets[m+1] - subOffsets[m];
+        const int off = subOffsets[m];
+        float* C = get_centroids(m);
+
+        //random distinct training rows as the initial centroids, repeated if there are too few
+        std::vector<int> init(train.rows);
+        for(int i=0;i<train.rows;i++){
+            init[i] = i;
+        }
+        std::shuffle(init.begin(), init.end(), rng);
+        for(int k=0;k<numCentroids;k++){
+            std::copy(train.row(init[k % train.rows]) + off, train.row(init[k % train.rows]) + off + ds, C + k*ds);
+        }
+
+        std::vector<int> assign(train.rows);
+        std::vector<double> sums(size_t(numCentroids)*ds);
+        std::vector<int> counts(numCentroids);
+        for(int iter=0;iter<nIters;iter++){
+            auto cnorms = get_centroid_norms(m);
+            parallel_for(0, train.rows, rowsPerBlock, [&](int , int beg, int end){
+                thread_local std::vector<float> dots;
+                assign_block(train.row(beg), train.stride, end-beg, m, cnorms, &assign[beg], 1, dots);
+            });
+
+            std::fill(sums.begin(), sums.end(), 0.);
+            std::fill(counts.begin(), counts.end(), 0);
+            for(int i=0;i<train.rows;i++){
+                const float* x = train.row(i) + off;
+                double* s = &sums[size_t(assign[i])*ds];
+                for(int j=0;j<ds;j++){
+                    s[j] += x[j];
+                }
+                counts[assign[i]]++;
+            }
+            for(int k=0;k<numCentroids;k++){
+                if(counts[k] == 0) {
+                    //empty cluster restarts from a random training row
+                    const float* x = train.row(rng() % train.rows) + off;
+                    std::copy(x, x+ds, C + k*ds);
+                    continue;
+                }
+                for(int j=0;j<ds;j++){
+                    C[k*ds + j] = float(sums[size_t(k)*ds + j] / counts[k]);
+                }
+            }
+        }
+    }
+
+    void encode_all(MatrixView<Scalar> objects)
+    {
+        codes.assign(size_t(rows)*M, 0);
+        std::vector<std::vector<float> > cnorms(M);
+        for(int m=0;m<M;m++){
+            cnorms[m] = get_centroid_norms(m);
+        }
+        parallel_for(0, rows, rowsPerBlock, [&](int , int beg, int end){
+            thread_local std::vector<float> block, dots;
+            thread_local std::vector<int> nearest;
+            const int n = end - beg;
+            block.resize(size_t(n)*dim);
+            for(int i=0;i<n;i++){
+                std::copy(objects.row(beg+i), objects.row(beg+i)+dim, &block[size_t(i)*dim]);
+            }
+            nearest.resize(size_t(n)*M);
+            for(int m=0;m<M;m++){
+                assign_block(&block[0], dim, n, m, cnorms[m], &nearest[m], M, dots);
+            }
+            for(size_t i=0;i<nearest.size();i++){
+                codes[size_t(beg)*M + i] = uint8_t(nearest[i]);
+            }
+        });
+    }
+
+    FlatArray<int> subOffsets;
+    //numCentroids x dim floats in total, see get_centroids
+    FlatArray<float> centroids;
+    //M bytes per object
+    FlatArray<uint8_t> codes;
+};
+
+//ranks candidates by table lookups of a ProductQuantizer
+//with refine the final candidates are re-scored with the full rows, otherwise the adc distances are reported
+template<class Scalar>
+struct PQScorer
+{
+    struct Context
+    {
+        const Scalar* query;
+        const float* lut;
+    };
+
+    PQScorer(const ProductQuantizer<Scalar>& pq, MatrixView<Scalar> dataObjects, bool refine=true, bool takeSqrt=true)
+        :pq(&pq), dataObjects(dataObjects), refine(refine), takeSqrt(takeSqrt)
+    {
+    }
+
+    //the lut lives in a per-thread buffer, valid until the next call on the same thread
+    Context query_context(const Scalar* query) const
+    {
+        thread_local std::vector<float> lut;
+        lut.resize(pq->lut_size());
+        pq->compute_lut(query, lut.data());
+        return Context{query, lut.data()};
+    }
+    Scalar score(const Context& ctx, int id) const
+    {
+        return pq->adc(ctx.lut, id);
+    }
+    Scalar finalize(const Context& ctx, int id, Scalar score) const
+    {
+        if(refine) {
+            score = calc_l2_sqr(dataObjects.cols, ctx.query, dataObjects.row(id));
+        }
+        return takeSqrt ? std::sqrt(score) : score;
+    }
+    void prefetch(int id) const
+    {
+        prefetch_bytes(pq->code(id), pq->M);
+    }
+    int size() const
+    {
+        return refine ? std::min(pq->size(), dataObjects.rows) : pq->size();
+    }
+
+    const ProductQuantizer<Scalar>* pq;
+    MatrixView<Scalar> dataObjects;
+    bool refine;
+    bool takeSqrt;
+};
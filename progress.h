@@ -0,0 +1,81 @@
+#pragma once
+
+//progress of a long loop shared by worker threads: rows done, rows/sec and eta,
+//printed at most once per interval by whichever thread crosses it
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+#include <fmt/format.h>
+
+class Progress
+{
+public:
+    Progress(const std::string& name, int64_t total, double intervalSec=5.)
+        :name(name), total(total), interval(to_ticks(intervalSec)), start(Clock::now()), nextReport(interval)
+    {
+    }
+    Progress(const Progress& ) = delete;
+    Progress& operator=(const Progress& ) = delete;
+
+    //thread-safe
+    void add(int64_t rows)
+    {
+        int64_t cur = done.fetch_add(rows) + rows;
+        int64_t now = elapsed_ticks();
+        int64_t next = nextReport.load();
+        if(now < next || !nextReport.compare_exchange_strong(next, now + interval)) {
+            return ;
+        }
+        double sec = to_seconds(now);
+        double rate = cur / std::max(sec, 1e-9);
+        fmt::print("{}: {}/{} rows, {:.0f} rows/s, eta {:.0f}s\n", name, cur, total, rate,
+                rate > 0 ? (total - cur) / rate : 0.);
+    }
+
+    //summary line, return the seconds since construction
+    double finish() const
+    {
+        double sec = to_seconds(elapsed_ticks());
+        fmt::print("{}: {} rows in {:.2f}s, {:.0f} rows/s\n", name, done.load(), sec, done.load() / std::max(sec, 1e-9));
+        return sec;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static int64_t to_ticks(double sec)
+    {
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(sec)).count();
+    }
+    static double to_seconds(int64_t ticks)
+    {
+        return std::chrono::duration<double>(Clock::duration(ticks)).count();
+    }
+    int64_t elapsed_ticks() const
+    {
+        return (Clock::now() - start).count();
+    }
+
+    std::string name;
+    int64_t total;
+    int64_t interval;
+    Clock::time_point start;
+    std::atomic<int64_t> done{0};
+    //in ticks since start
+    std::atomic<int64_t> nextReport;
+};
+
+//run f and print how long it took, return the seconds
+template<class F>
+double run_stage(const std::string& name, const F& f)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    f();
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    fmt::print("{}: done in {:.2f}s\n", name, sec);
+    return sec;
+}
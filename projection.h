@@ -5,6 +5,12 @@
 #include <vector>
 #include <cassert>
 #include <random>
+#include <cmath>
+
+#include "gemm.h"
+#include "parallel.h"
+#include "flat_array.h"
+#include "index_file.h"
 
 //Simple Random Projection
 template<class Scalar, class SigType>
@@ -55,6 +61,53 @@ public:
         }
     }
 
+    //hash n objects stored row by row with a stride of ldx, out is n x sigdim
+    //projections of a block of rows are computed as one matrix multiply against all lines
+    void getSigBatch(const Scalar *rows, int n, SigType* out, size_t ldx=0) const
+    {
+        if(ldx == 0) {
+            ldx = dim;
+        }
+        parallel_for(0, n, rowsPerBlock, [&](int , int beg, int end){
+            getSigBlock(rows + beg*ldx, end-beg, out + size_t(beg)*sigdim, ldx);
+        });
+    }
+
+    //single-threaded version of getSigBatch
+    //with fracs (n x sigdim), also the position of each projection inside its bucket, in [0, 1), see select_probes
+    void getSigBlock(const Scalar *rows, int n, SigType* out, size_t ldx=0, float* fracs=nullptr) const
+    {
+        if(ldx == 0) {
+            ldx = dim;
+        }
+        std::vector<Scalar> projections(size_t(rowsPerBlock)*K);
+        for(int beg=0;beg<n;beg+=rowsPerBlock){
+            int m = std::min(rowsPerBlock, n-beg);
+            gemm_nt(m, K, dim, rows + beg*ldx, ldx, &p[0], dim, &projections[0], K);
+            for(int i=0;i<m;i++){
+                for(int k=0;k<K;k++){
+                    double projection = double(projections[i*K+k]) + b[k];
+                    double bucket = floor(projection/r);
+                    out[size_t(beg+i)*sigdim + k] = SigType(bucket);
+                    if(fracs) {
+                        fracs[size_t(beg+i)*sigdim + k] = float(projection/r - bucket);
+                    }
+                }
+            }
+        }
+    }
+
+    //the hasher of the first k lines, the signatures under it are the first k columns of those under this one
+    RandProjHasher prefix(int k) const
+    {
+        assert(k > 0 && k <= K);
+        RandProjHasher ret(*this);
+        ret.K = ret.sigdim = k;
+        ret.p = std::vector<Scalar>(p.data(), p.data() + size_t(k)*dim);
+        ret.b = std::vector<Scalar>(b.data(), b.data() + k);
+        return ret;
+    }
+
     template<class Archive>
     void serialize(Archive & ar, const unsigned int )
     {
@@ -66,10 +119,31 @@ public:
         ar & b;
     }
 
+    //see index_file.h
+    void save_flat(IndexWriter& w, const std::string& prefix) const
+    {
+        w.add_value(prefix + "dim", dim);
+        w.add_value(prefix + "K", K);
+        w.add_value(prefix + "r", r);
+        w.add_value(prefix + "sigdim", sigdim);
+        w.add_array(prefix + "p", p);
+        w.add_array(prefix + "b", b);
+    }
+    void load_flat(const IndexReader& rd, const std::string& prefix)
+    {
+        dim = rd.value<int>(prefix + "dim");
+        K = rd.value<int>(prefix + "K");
+        r = rd.value<double>(prefix + "r");
+        sigdim = rd.value<int>(prefix + "sigdim");
+        p = rd.array<Scalar>(prefix + "p");
+        b = rd.array<Scalar>(prefix + "b");
+    }
+
     int dim, K;
     double r;
     int sigdim;
+    const static int rowsPerBlock = 64;
 protected:
-    std::vector<Scalar> p;
-    std::vector<Scalar> b;
+    FlatArray<Scalar> p;
+    FlatArray<Scalar> b;
 };
\ No newline at end of file
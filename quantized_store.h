@@ -0,0 +1,258 @@
+#pragma once
+
+//compressed copy of the dataset for re-ranking
+//sq8: each dimension is quantized to 256 levels between its min and max, 1 byte per value
+//fp16: ieee half, 2 bytes per value
+//candidates are ranked by approximate squared l2 on the codes, the best ones are then refined with the full rows
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <boost/serialization/vector.hpp>
+
+#include "matrix.h"
+#include "parallel.h"
+#include "util.h"
+#include "distance_simd.h"
+#include "rerank.h"
+#include "index_file.h"
+
+enum QuantType
+{
+    QUANT_NONE = 0,
+    QUANT_SQ8 = 1,
+    QUANT_FP16 = 2,
+    //product quantization, see product_quantizer.h
+    QUANT_PQ = 3,
+};
+
+template<class Scalar>
+class QuantizedStore
+{
+public:
+    QuantizedStore() {}
+
+    //QUANT_PQ is not handled here and leaves the store empty
+    void build(MatrixView<Scalar> objects, QuantType type_)
+    {
+        type = type_ == QUANT_PQ ? QUANT_NONE : type_;
+        dim = objects.cols;
+        rows = objects.rows;
+        vmin.clear();
+        scale.clear();
+        weights.clear();
+        sq8Codes = Matrix<uint8_t>();
+        fp16Codes = Matrix<uint16_t>();
+        if(type == QUANT_SQ8) {
+            build_sq8(objects);
+        } else if(type == QUANT_FP16) {
+            build_fp16(objects);
+        }
+    }
+
+    bool enabled() const
+    {
+        return type != QUANT_NONE;
+    }
+    int size() const
+    {
+        return enabled() ? rows : 0;
+    }
+
+    //the query in the coordinates of the codes, out has dim floats
+    void prepare_query(const Scalar* query, float* out) const
+    {
+        if(type == QUANT_SQ8) {
+            for(int i=0;i<dim;i++){
+                out[i] = (float(query[i]) - vmin[i]) / scale[i];
+            }
+        } else {
+            for(int i=0;i<dim;i++){
+                out[i] = float(query[i]);
+            }
+        }
+    }
+
+    //approximate squared l2 between a prepared query and object id
+    float approx_l2_sqr(const float* preparedQuery, int id) const
+    {
+        const DistanceKernels& kernels = get_distance_kernels();
+        if(type == QUANT_SQ8) {
+            return kernels.sq8_l2_sqr(dim, preparedQuery, weights.data(), sq8Codes.row(id));
+        }
+        return kernels.fp16_l2_sqr(dim, preparedQuery, fp16Codes.row(id));
+    }
+
+    const void* code(int id) const
+    {
+        return type == QUANT_SQ8 ? (const void*)sq8Codes.row(id) : (const void*)fp16Codes.row(id);
+    }
+    size_t code_bytes() const
+    {
+        return type == QUANT_SQ8 ? dim : dim*sizeof(uint16_t);
+    }
+
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int )
+    {
+        ar & type;
+        ar & dim;
+        ar & rows;
+        ar & vmin;
+        ar & scale;
+        ar & weights;
+        ar & sq8Codes;
+        ar & fp16Codes;
+    }
+
+    //see index_file.h
+    void save_flat(IndexWriter& w, const std::string& prefix) const
+    {
+        w.add_value(prefix + "type", int(type));
+        w.add_value(prefix + "dim", dim);
+        w.add_value(prefix + "rows", rows);
+        w.add_array(prefix + "vmin", vmin);
+        w.add_array(prefix + "scale", scale);
+        w.add_array(prefix + "weights", weights);
+        w.add_matrix(prefix + "sq8Codes", sq8Codes);
+        w.add_matrix(prefix + "fp16Codes", fp16Codes);
+    }
+    void load_flat(const IndexReader& r, const std::string& prefix)
+    {
+        type = QuantType(r.value<int>(prefix + "type"));
+        dim = r.value<int>(prefix + "dim");
+        rows = r.value<int>(prefix + "rows");
+        vmin = r.array<float>(prefix + "vmin");
+        scale = r.array<float>(prefix + "scale");
+        weights = r.array<float>(prefix + "weights");
+        sq8Codes = r.matrix<uint8_t>(prefix + "sq8Codes");
+        fp16Codes = r.matrix<uint16_t>(prefix + "fp16Codes");
+    }
+
+    QuantType type = QUANT_NONE;
+    int dim = 0;
+    int rows = 0;
+
+private:
+    void build_sq8(MatrixView<Scalar> objects)
+    {
+        //per-thread range of each dimension, then merged
+        const int nThreads = get_num_threads();
+        std::vector<float> mins(size_t(nThreads)*dim, INFINITY), maxs(size_t(nThreads)*dim, -INFINITY);
+        parallel_for(0, rows, 1024, [&](int tid, int beg, int end){
+            float* lo = &mins[size_t(tid)*dim];
+            float* hi = &maxs[size_t(tid)*dim];
+            for(int i=beg;i<end;i++){
+                const Scalar* x = objects.row(i);
+                for(int j=0;j<dim;j++){
+                    lo[j] = std::min<float>(lo[j], x[j]);
+                    hi[j] = std::max<float>(hi[j], x[j]);
+                }
+            }
+        }, nThreads);
+
+        vmin.assign(dim, 0.f);
+        scale.assign(dim, 1.f);
+        weights.assign(dim, 1.f);
+        for(int j=0;j<dim;j++){
+            float lo = INFINITY, hi = -INFINITY;
+            for(int t=0;t<nThreads;t++){
+                lo = std::min(lo, mins[size_t(t)*dim + j]);
+                hi = std::max(hi, maxs[size_t(t)*dim + j]);
+            }
+            if(lo > hi) {
+                //no object at all
+                continue;
+            }
+            vmin[j] = lo;
+            //a constant dimension keeps scale 1, all of its codes are 0
+            scale[j] = hi > lo ? (hi - lo) / 255.f : 1.f;
+            weights[j] = scale[j]*scale[j];
+        }
+
+        sq8Codes.resize(rows, dim);
+        parallel_for(0, rows, 1024, [&](int , int beg, int end){
+            for(int i=beg;i<end;i++){
+                const Scalar* x = objects.row(i);
+                uint8_t* c = sq8Codes.row(i);
+                for(int j=0;j<dim;j++){
+                    float v = std::round((float(x[j]) - vmin[j]) / scale[j]);
+                    c[j] = uint8_t(std::min(255.f, std::max(0.f, v)));
+                }
+            }
+        });
+    }
+
+    void build_fp16(MatrixView<Scalar> objects)
+    {
+        fp16Codes.resize(rows, dim);
+        parallel_for(0, rows, 1024, [&](int , int beg, int end){
+            for(int i=beg;i<end;i++){
+                const Scalar* x = objects.row(i);
+                uint16_t* c = fp16Codes.row(i);
+                for(int j=0;j<dim;j++){
+                    c[j] = float_to_half(float(x[j]));
+                }
+            }
+        });
+    }
+
+    //sq8: x[j] ~ vmin[j] + code[j]*scale[j], weights[j] = scale[j]^2
+    FlatArray<float> vmin;
+    FlatArray<float> scale;
+    FlatArray<float> weights;
+    Matrix<uint8_t> sq8Codes;
+    Matrix<uint16_t> fp16Codes;
+};
+
+//ranks candidates by the approximate distances of a QuantizedStore,
+//with refine the final candidates are re-scored with the full rows so that the reported distances are exact
+//used with a ReRanker keeping refineFactor*topk candidates and reporting topk
+template<class Scalar>
+struct QuantScorer
+{
+    struct Context
+    {
+        const Scalar* query;
+        const float* prepared;
+    };
+
+    QuantScorer(const QuantizedStore<Scalar>& store, MatrixView<Scalar> dataObjects, bool refine=true, bool takeSqrt=true)
+        :store(&store), dataObjects(dataObjects), refine(refine), takeSqrt(takeSqrt)
+    {
+    }
+
+    //the prepared query lives in a per-thread buffer, valid until the next call on the same thread
+    Context query_context(const Scalar* query) const
+    {
+        thread_local std::vector<float> prepared;
+        prepared.resize(store->dim);
+        store->prepare_query(query, prepared.data());
+        return Context{query, prepared.data()};
+    }
+    Scalar score(const Context& ctx, int id) const
+    {
+        return store->approx_l2_sqr(ctx.prepared, id);
+    }
+    Scalar finalize(const Context& ctx, int id, Scalar score) const
+    {
+        if(refine) {
+            score = calc_l2_sqr(dataObjects.cols, ctx.query, dataObjects.row(id));
+        }
+        return takeSqrt ? std::sqrt(score) : score;
+    }
+    void prefetch(int id) const
+    {
+        prefetch_bytes(store->code(id), store->code_bytes());
+    }
+    int size() const
+    {
+        return refine ? std::min(store->size(), dataObjects.rows) : store->size();
+    }
+
+    const QuantizedStore<Scalar>* store;
+    MatrixView<Scalar> dataObjects;
+    bool refine;
+    bool takeSqrt;
+};
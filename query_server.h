@@ -0,0 +1,342 @@
+#pragma once
+
+//long-running query server: the index is loaded once and queries arrive over a stream
+//(stdin/stdout or connections of a unix domain socket)
+//
+//framing, all fields little-endian 32-bit:
+//  request: int32 tag, int32 dim, float32[dim] query
+//  reply:   int32 tag, int32 count, count x (int32 id, float32 dist), sorted by dist
+//  tag is chosen by the client and echoed back; count is -1 if dim does not match the index or the search failed
+//replies are written per query as soon as its micro-batch is answered, not necessarily in request order
+//
+//queries of all streams are collected into micro-batches, a micro-batch is answered as soon as
+//it has maxBatch queries or its oldest query has waited maxDelayMs, whichever comes first
+//at most maxPending queries wait, a stream is not read further until there is room, which pushes back on its client
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <exception>
+#include <atomic>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <fmt/format.h>
+
+#include "matrix.h"
+
+//return false on eof or error
+inline bool read_full(int fd, void *buf, size_t bytes)
+{
+    char *p = static_cast<char*>(buf);
+    while(bytes > 0) {
+        ssize_t r = ::read(fd, p, bytes);
+        if(r < 0 && errno == EINTR) {
+            continue;
+        }
+        if(r <= 0) {
+            return false;
+        }
+        p += r;
+        bytes -= r;
+    }
+    return true;
+}
+
+inline bool write_full(int fd, const void *buf, size_t bytes)
+{
+    const char *p = static_cast<const char*>(buf);
+    while(bytes > 0) {
+        ssize_t r = ::write(fd, p, bytes);
+        if(r < 0 && errno == EINTR) {
+            continue;
+        }
+        if(r <= 0) {
+            return false;
+        }
+        p += r;
+        bytes -= r;
+    }
+    return true;
+}
+
+//Index :: query_vec(MatrixView<float> queries, MatrixView<float> dataObjects) -> top-k (dist, id) of each query
+template<class Index>
+class QueryServer
+{
+public:
+    //maxPending 0 for 16 batches
+    QueryServer(Index& index, MatrixView<float> dataObjects, int maxBatch, double maxDelayMs, int maxPending=0)
+        :index(index), dataObjects(dataObjects), maxBatch(std::max(1, maxBatch)),
+        maxDelay(std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(maxDelayMs))),
+        maxPending(maxPending > 0 ? maxPending : 16*this->maxBatch)
+    {
+        batcher = std::thread([this](){ batch_loop(); });
+    }
+    ~QueryServer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        arrived.notify_all();
+        drained.notify_all();
+        batcher.join();
+    }
+    QueryServer(const QueryServer& ) = delete;
+    QueryServer& operator=(const QueryServer& ) = delete;
+
+    //serve one stream until its input ends and all of its replies are written
+    //the fds are not closed
+    void serve_stream(int inFd, int outFd)
+    {
+        auto conn = std::make_shared<Connection>(inFd, outFd, false);
+        read_loop(conn);
+        std::unique_lock<std::mutex> lock(mtx);
+        idle.wait(lock, [&](){ return conn->inFlight == 0; });
+    }
+
+    //accept connections on a unix domain socket until an error, each connection is read by its own thread
+    //the readers are stopped and joined before returning, such that none outlives the server
+    //return 1 on error
+    int serve_unix_socket(const std::string& path)
+    {
+        int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if(listenFd < 0 || path.size() >= sizeof(addr.sun_path)) {
+            fmt::print("Could not create socket {}\n", path);
+            return 1;
+        }
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+        unlink(path.c_str());
+        if(bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listenFd, 64) != 0) {
+            fmt::print("Could not listen on {}\n", path);
+            ::close(listenFd);
+            return 1;
+        }
+        fmt::print("listening on {}\n", path);
+
+        struct Reader
+        {
+            std::thread thread;
+            std::shared_ptr<Connection> conn;
+        };
+        std::vector<Reader> readers;
+        for(;;){
+            int fd = accept(listenFd, nullptr, nullptr);
+            if(fd < 0) {
+                if(errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                fmt::print("accept failed on {}\n", path);
+                break;
+            }
+            //readers of closed connections are joined as new ones come
+            readers.erase(std::remove_if(readers.begin(), readers.end(), [](Reader& r){
+                if(!r.conn->readerDone) {
+                    return false;
+                }
+                r.thread.join();
+                return true;
+            }), readers.end());
+            //the fd is closed when the reader and all pending replies are done with it
+            auto conn = std::make_shared<Connection>(fd, fd, true);
+            readers.push_back(Reader{std::thread([this, conn](){
+                read_loop(conn);
+                conn->readerDone = true;
+            }), conn});
+        }
+        ::close(listenFd);
+        //a reader blocked in read returns on the shutdown, one waiting for room in pending once the batcher makes some
+        for(auto& r:readers){
+            ::shutdown(r.conn->inFd, SHUT_RD);
+        }
+        for(auto& r:readers){
+            r.thread.join();
+        }
+        return 1;
+    }
+
+    //largest #dims accepted in a request
+    const static int maxDim = 1 << 20;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Connection
+    {
+        Connection(int inFd, int outFd, bool owned)
+            :inFd(inFd), outFd(outFd), owned(owned)
+        {
+        }
+        ~Connection()
+        {
+            if(owned) {
+                ::close(inFd);
+                if(outFd != inFd) {
+                    ::close(outFd);
+                }
+            }
+        }
+
+        //serialized writes of whole replies
+        bool send(const std::vector<char>& frame)
+        {
+            std::lock_guard<std::mutex> lock(writeMtx);
+            if(broken) {
+                return false;
+            }
+            broken = !write_full(outFd, frame.data(), frame.size());
+            return !broken;
+        }
+
+        int inFd;
+        int outFd;
+        bool owned;
+        std::mutex writeMtx;
+        bool broken = false;
+        //#queries read but not replied yet, guarded by QueryServer::mtx
+        int inFlight = 0;
+        std::atomic<bool> readerDone{false};
+    };
+
+    struct Pending
+    {
+        std::shared_ptr<Connection> conn;
+        int32_t tag;
+        Clock::time_point arrival;
+        std::vector<float> query;
+    };
+
+    void read_loop(const std::shared_ptr<Connection>& conn)
+    {
+        const int dim = dataObjects.cols;
+        for(;;){
+            int32_t header[2];
+            if(!read_full(conn->inFd, header, sizeof(header))) {
+                break;
+            }
+            int32_t tag = header[0];
+            int32_t qdim = header[1];
+            if(qdim < 0 || qdim > maxDim) {
+                //the stream cannot be re-synchronized
+                fmt::print("bad request dim {}, closing the connection\n", qdim);
+                break;
+            }
+            std::vector<float> query(qdim);
+            if(!read_full(conn->inFd, query.data(), query.size()*sizeof(float))) {
+                break;
+            }
+            if(qdim != dim) {
+                int32_t reply[2] = {tag, -1};
+                conn->send(std::vector<char>(reinterpret_cast<char*>(reply), reinterpret_cast<char*>(reply)+sizeof(reply)));
+                continue;
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                drained.wait(lock, [&](){ return stopping || pending.size() < maxPending; });
+                conn->inFlight++;
+                pending.push_back(Pending{conn, tag, Clock::now(), std::move(query)});
+            }
+            arrived.notify_one();
+        }
+    }
+
+    void batch_loop()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        for(;;){
+            arrived.wait(lock, [&](){ return stopping || !pending.empty(); });
+            if(pending.empty()) {
+                //stopping
+                break;
+            }
+            //flush on a full batch or on the deadline of the oldest query
+            Clock::time_point deadline = pending.front().arrival + maxDelay;
+            arrived.wait_until(lock, deadline, [&](){ return stopping || pending.size() >= maxBatch; });
+
+            std::vector<Pending> batch;
+            while(!pending.empty() && batch.size() < maxBatch){
+                batch.push_back(std::move(pending.front()));
+                pending.pop_front();
+            }
+            lock.unlock();
+            drained.notify_all();
+            answer(batch);
+            lock.lock();
+            for(auto& p:batch){
+                p.conn->inFlight--;
+            }
+            batch.clear();
+            idle.notify_all();
+        }
+    }
+
+    void answer(std::vector<Pending>& batch)
+    {
+        const int dim = dataObjects.cols;
+        Matrix<float> queries(batch.size(), dim);
+        for(int i=0;i<batch.size();i++){
+            std::copy(batch[i].query.begin(), batch[i].query.end(), queries.row(i));
+        }
+        //a failed batch is answered with count -1 such that the server and the other batches go on
+        std::vector<std::vector<std::pair<float, int> > > ress;
+        try {
+            ress = index.query_vec(queries.view(), dataObjects);
+        } catch(const std::exception& e) {
+            fmt::print("answering a batch of {} queries failed: {}\n", batch.size(), e.what());
+        } catch(...) {
+            fmt::print("answering a batch of {} queries failed\n", batch.size());
+        }
+        if(ress.size() != batch.size()) {
+            for(auto& p:batch){
+                int32_t reply[2] = {p.tag, -1};
+                p.conn->send(std::vector<char>(reinterpret_cast<char*>(reply), reinterpret_cast<char*>(reply)+sizeof(reply)));
+            }
+            return ;
+        }
+
+        std::vector<char> frame;
+        for(int i=0;i<batch.size();i++){
+            int32_t header[2] = {batch[i].tag, int32_t(ress[i].size())};
+            frame.resize(sizeof(header) + ress[i].size()*8);
+            memcpy(&frame[0], header, sizeof(header));
+            for(int j=0;j<ress[i].size();j++){
+                int32_t id = ress[i][j].second;
+                float dist = ress[i][j].first;
+                memcpy(&frame[sizeof(header) + j*8], &id, 4);
+                memcpy(&frame[sizeof(header) + j*8 + 4], &dist, 4);
+            }
+            batch[i].conn->send(frame);
+        }
+    }
+
+    Index& index;
+    MatrixView<float> dataObjects;
+    size_t maxBatch;
+    Clock::duration maxDelay;
+    size_t maxPending;
+
+    std::mutex mtx;
+    std::condition_variable arrived;
+    //pending has room again
+    std::condition_variable drained;
+    std::condition_variable idle;
+    std::deque<Pending> pending;
+    bool stopping = false;
+    std::thread batcher;
+};
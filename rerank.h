@@ -0,0 +1,350 @@
+#pragma once
+
+//re-rank candidates of a whole batch of queries
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <atomic>
+#include <cstdint>
+
+#include "matrix.h"
+#include "parallel.h"
+#include "util.h"
+#include "signatures.h"
+#include "stage_stats.h"
+
+template<class Scalar>
+using DistfPtr = Scalar(*)(int, const Scalar*, const Scalar*);
+
+inline void prefetch_bytes(const void *ptr, size_t bytes)
+{
+#ifdef __GNUC__
+    const char* p = static_cast<const char*>(ptr);
+    for(size_t off=0;off<bytes;off+=64){
+        __builtin_prefetch(p + off, 0, 0);
+    }
+#endif
+}
+
+//a Scorer tells ReRanker how to score candidates:
+//  Context query_context(const Scalar* query) const    -- per-query state
+//  Scalar score(const Context& ctx, int id) const      -- smaller is better
+//  Scalar finalize(const Context& ctx, int id, Scalar score) const  -- the distance reported for the final top-k
+//  void prefetch(int id) const
+//  int size() const                                    -- #objects, larger ids are dropped
+
+//distance given by a distance function, DistF :: int -> const Scalar * -> const Scalar * -> their distance
+template<class Scalar, class DistF=DistfPtr<Scalar> >
+struct DistfScorer
+{
+    using Context = const Scalar*;
+
+    DistfScorer(int dim, MatrixView<Scalar> dataObjects, DistF distf)
+        :dim(dim), dataObjects(dataObjects), distf(std::move(distf))
+    {
+    }
+
+    Context query_context(const Scalar* query) const
+    {
+        return query;
+    }
+    Scalar score(const Context& query, int id) const
+    {
+        return distf(dim, query, dataObjects.row(id));
+    }
+    Scalar finalize(const Context& , int , Scalar score) const
+    {
+        return score;
+    }
+    void prefetch(int id) const
+    {
+        prefetch_bytes(dataObjects.row(id), dim*sizeof(Scalar));
+    }
+    int size() const
+    {
+        return dataObjects.rows;
+    }
+
+    int dim;
+    MatrixView<Scalar> dataObjects;
+    DistF distf;
+};
+
+//l2 distance ranked by squared distances without sqrt
+//with dataNorms (||x||^2 of each row) candidates are ranked by ||q||^2 + ||x||^2 - 2 q.x,
+//the final top-k are re-scored as plain squared l2 so that the reported distances are exact
+//sqrt is only taken for the final top-k, and only if takeSqrt
+template<class Scalar>
+struct L2Scorer
+{
+    struct Context
+    {
+        const Scalar* query;
+        Scalar norm;
+    };
+
+    L2Scorer(int dim, MatrixView<Scalar> dataObjects, const Scalar* dataNorms=nullptr, bool takeSqrt=true)
+        :dim(dim), dataObjects(dataObjects), dataNorms(dataNorms), takeSqrt(takeSqrt)
+    {
+    }
+
+    Context query_context(const Scalar* query) const
+    {
+        return Context{query, dataNorms == nullptr ? Scalar(0) : calc_inner_product(dim, query, query)};
+    }
+    Scalar score(const Context& ctx, int id) const
+    {
+        if(dataNorms == nullptr) {
+            return calc_l2_sqr(dim, ctx.query, dataObjects.row(id));
+        }
+        return ctx.norm + dataNorms[id] - 2*calc_inner_product(dim, ctx.query, dataObjects.row(id));
+    }
+    Scalar finalize(const Context& ctx, int id, Scalar score) const
+    {
+        if(dataNorms != nullptr) {
+            score = calc_l2_sqr(dim, ctx.query, dataObjects.row(id));
+        }
+        return takeSqrt ? std::sqrt(score) : score;
+    }
+    void prefetch(int id) const
+    {
+        prefetch_bytes(dataObjects.row(id), dim*sizeof(Scalar));
+    }
+    int size() const
+    {
+        return dataObjects.rows;
+    }
+
+    int dim;
+    MatrixView<Scalar> dataObjects;
+    const Scalar* dataNorms;
+    bool takeSqrt;
+};
+
+//ids below numBase are scored by base, the extraObjects rows after them (e.g. rows inserted after build)
+//by extraDist, which is reported as is, or its sqrt if takeSqrt
+template<class Scalar, class Base, class ExtraDist=DistfPtr<Scalar> >
+struct AppendedScorer
+{
+    struct Context
+    {
+        typename Base::Context base;
+        const Scalar* query;
+    };
+
+    AppendedScorer(Base base, int numBase, MatrixView<Scalar> extraObjects, ExtraDist extraDist, bool takeSqrt)
+        :base(std::move(base)), numBase(numBase), extraObjects(extraObjects), extraDist(std::move(extraDist)), takeSqrt(takeSqrt)
+    {
+    }
+
+    Context query_context(const Scalar* query) const
+    {
+        return Context{base.query_context(query), query};
+    }
+    Scalar score(const Context& ctx, int id) const
+    {
+        if(id < numBase) {
+            return base.score(ctx.base, id);
+        }
+        return extraDist(extraObjects.cols, ctx.query, extraObjects.row(id - numBase));
+    }
+    Scalar finalize(const Context& ctx, int id, Scalar score) const
+    {
+        if(id < numBase) {
+            return base.finalize(ctx.base, id, score);
+        }
+        return takeSqrt ? std::sqrt(score) : score;
+    }
+    void prefetch(int id) const
+    {
+        if(id < numBase) {
+            base.prefetch(id);
+        } else {
+            prefetch_bytes(extraObjects.row(id - numBase), extraObjects.cols*sizeof(Scalar));
+        }
+    }
+    int size() const
+    {
+        return numBase + extraObjects.rows;
+    }
+
+    Base base;
+    int numBase;
+    MatrixView<Scalar> extraObjects;
+    ExtraDist extraDist;
+    bool takeSqrt;
+};
+
+template<class Scalar, class Base, class ExtraDist=DistfPtr<Scalar> >
+AppendedScorer<Scalar, Base, ExtraDist> append_rows(Base base, int numBase, MatrixView<Scalar> extraObjects,
+        ExtraDist extraDist=calc_l2_sqr<Scalar>, bool takeSqrt=true)
+{
+    return AppendedScorer<Scalar, Base, ExtraDist>(std::move(base), numBase, extraObjects, std::move(extraDist), takeSqrt);
+}
+
+//count-aware limits on the candidates re-ranked for a query, the defaults re-rank all of them
+struct CandidateBudget
+{
+    //candidates whose count is below minCountRatio times the best count of the query are dropped
+    float minCountRatio = 0;
+    //a query stops once that many candidates in a row did not enter its top-k, 0 for never;
+    //candidates are then scored by count descendingly instead of by id
+    int stableAfter = 0;
+};
+
+//queries of one batch are spread over threads, each query keeps its top-k in a fixed-capacity slot of a flat buffer
+//with numOut < topk, only the best numOut after finalize are reported, i.e. topk candidates are refined
+template<class Scalar, class Scorer>
+class ReRanker
+{
+public:
+    using ResPair = std::pair<Scalar, int>;
+
+    ReRanker(int topk, MatrixView<Scalar> queryObjects, Scorer scorer, int numOut=0, CandidateBudget budget=CandidateBudget())
+        :topk(topk), numOut(numOut > 0 ? std::min(numOut, topk) : topk), queryObjects(queryObjects), scorer(std::move(scorer)),
+        budget(budget), heaps(size_t(queryObjects.rows)*topk), heapSizes(queryObjects.rows, 0), numScored(0)
+    {
+    }
+
+    //candidatess[i] are the candidates of query qidStart+i
+    void push_batch(int qidStart, const std::vector<std::vector<Candidate> >& candidatess)
+    {
+        assert(qidStart + candidatess.size() <= queryObjects.rows);
+        parallel_for(0, candidatess.size(), queriesPerChunk, [&](int , int beg, int end){
+            std::vector<Candidate>& scratch = get_scratch();
+            for(int i=beg;i<end;i++){
+                push(qidStart+i, candidatess[i], scratch);
+            }
+        });
+    }
+
+    //#candidates scored so far over all queries
+    int64_t num_scored() const
+    {
+        return numScored.load();
+    }
+
+    //results of each query sorted by distance ascendingly, the buffers are consumed
+    std::vector<std::vector<ResPair> > fetch_res_vec()
+    {
+        std::vector<std::vector<ResPair> > ret(queryObjects.rows);
+        parallel_for(0, ret.size(), 64, [&](int , int beg, int end){
+            for(int qid=beg;qid<end;qid++){
+                ResPair* heap = &heaps[size_t(qid)*topk];
+                auto ctx = scorer.query_context(queryObjects.row(qid));
+                for(int i=0;i<heapSizes[qid];i++){
+                    heap[i].first = scorer.finalize(ctx, heap[i].second, heap[i].first);
+                }
+                std::sort(heap, heap+heapSizes[qid]);
+                ret[qid].assign(heap, heap+std::min(heapSizes[qid], numOut));
+                heapSizes[qid] = 0;
+            }
+        });
+        return ret;
+    }
+
+    const static int queriesPerChunk = 4;
+    //#candidates to prefetch ahead
+    const static int prefetchDistance = 4;
+
+private:
+    static std::vector<Candidate>& get_scratch()
+    {
+        thread_local std::vector<Candidate> scratch;
+        return scratch;
+    }
+
+    void push(int qid, const std::vector<Candidate>& candidates, std::vector<Candidate>& uniq)
+    {
+        StageTimer<Stage::Rerank> timer;
+        //duplicated and invalid candidates are dropped, and those below the count threshold
+        int minCount = 0;
+        if(budget.minCountRatio > 0) {
+            int bestCount = 0;
+            for(const Candidate& c:candidates){
+                bestCount = std::max(bestCount, c.count);
+            }
+            minCount = int(std::ceil(budget.minCountRatio * bestCount));
+        }
+        uniq.clear();
+        for(const Candidate& c:candidates){
+            if(c.id >= 0 && c.id < scorer.size() && c.count >= minCount) {
+                uniq.push_back(c);
+            }
+        }
+        std::sort(uniq.begin(), uniq.end(), [](const Candidate& a, const Candidate& b){
+            return a.id < b.id || (a.id == b.id && a.count > b.count);
+        });
+        uniq.erase(std::unique(uniq.begin(), uniq.end(), [](const Candidate& a, const Candidate& b){
+            return a.id == b.id;
+        }), uniq.end());
+        if(budget.stableAfter > 0) {
+            std::sort(uniq.begin(), uniq.end(), [](const Candidate& a, const Candidate& b){
+                return a.count > b.count || (a.count == b.count && a.id < b.id);
+            });
+        }
+
+        auto ctx = scorer.query_context(queryObjects.row(qid));
+        ResPair* heap = &heaps[size_t(qid)*topk];
+        int& heapSize = heapSizes[qid];
+        for(int j=0;j<std::min<int>(prefetchDistance, uniq.size());j++){
+            scorer.prefetch(uniq[j].id);
+        }
+        int j = 0, sinceChange = 0;
+        for(;j<uniq.size();j++){
+            if(budget.stableAfter > 0 && sinceChange >= budget.stableAfter) {
+                break;
+            }
+            if(j + prefetchDistance < uniq.size()) {
+                scorer.prefetch(uniq[j+prefetchDistance].id);
+            }
+            int id = uniq[j].id;
+            Scalar dist = scorer.score(ctx, id);
+            sinceChange++;
+            if(heapSize < topk) {
+                heap[heapSize++] = ResPair(dist, id);
+                std::push_heap(heap, heap+heapSize);
+                sinceChange = 0;
+            } else if(dist < heap[0].first) {
+                std::pop_heap(heap, heap+heapSize);
+                heap[heapSize-1] = ResPair(dist, id);
+                std::push_heap(heap, heap+heapSize);
+                sinceChange = 0;
+            }
+        }
+        numScored += j;
+    }
+
+    int topk;
+    int numOut;
+    MatrixView<Scalar> queryObjects;
+    Scorer scorer;
+    CandidateBudget budget;
+
+    //max-heaps, topk slots per query
+    std::vector<ResPair> heaps;
+    std::vector<int> heapSizes;
+    std::atomic<int64_t> numScored;
+};
+
+template<class Scalar, class Scorer>
+ReRanker<Scalar, Scorer> make_reranker(int topk, MatrixView<Scalar> queryObjects, Scorer scorer, int numOut=0,
+        CandidateBudget budget=CandidateBudget())
+{
+    return ReRanker<Scalar, Scorer>(topk, queryObjects, std::move(scorer), numOut, budget);
+}
+
+//squared l2 norm of each row
+template<class Scalar>
+std::vector<Scalar> calc_row_norms(MatrixView<Scalar> objects)
+{
+    std::vector<Scalar> norms(objects.rows);
+    parallel_for(0, objects.rows, 1024, [&](int , int beg, int end){
+        for(int i=beg;i<end;i++){
+            norms[i] = calc_inner_product(objects.cols, objects.row(i), objects.row(i));
+        }
+    });
+    return norms;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+//what an index keeps for l2 re-ranking besides the dataset itself:
+//the squared norms of the rows and optionally a compressed copy of the rows (sq8, fp16 or pq)
+
+#include <vector>
+#include <boost/serialization/vector.hpp>
+
+#include "matrix.h"
+#include "rerank.h"
+#include "quantized_store.h"
+#include "product_quantizer.h"
+#include "index_file.h"
+
+template<class Scalar>
+class RerankStore
+{
+public:
+    using ResPair = std::pair<Scalar, int>;
+
+    //a compressed copy is built by the next build() unless type is QUANT_NONE,
+    //candidates are then ranked on the codes and the best refineFactor*topk are re-scored with the full rows
+    //refineFactor 0 reports the approximate distances of the top-k and never touches the full rows
+    void set_quantization(QuantType type, int refineFactor_=4)
+    {
+        quantType = type;
+        refineFactor = std::max(0, refineFactor_);
+    }
+
+    void build(MatrixView<Scalar> dataObjects)
+    {
+        dataNorms = calc_row_norms(dataObjects);
+        quantStore.build(dataObjects, quantType);
+        if(quantType == QUANT_PQ) {
+            pq.build(dataObjects, pqSubspaces);
+        } else {
+            pq = ProductQuantizer<Scalar>();
+        }
+    }
+
+    //top-k by l2 of the candidates produced by queryBatches
+    //QueryBatches :: BatchScanner -> IO, calling the scanner with (first-query-id, candidates of each query in the batch)
+    //candidates are pruned by budget, see CandidateBudget
+    //the cached norms and codes are only used for the objects the index was built on
+    //ids from dataObjects.rows on are rows of extraObjects (inserted after build), always scored exactly
+    template<class QueryBatches>
+    std::vector<std::vector<ResPair> > query_l2(int topk, MatrixView<Scalar> queries, MatrixView<Scalar> dataObjects,
+            bool takeSqrt, const QueryBatches& queryBatches, MatrixView<Scalar> extraObjects=MatrixView<Scalar>()) const
+    {
+        const bool refine = refineFactor > 0;
+        const int numKept = topk*std::max(1, refineFactor);
+        const int n = dataObjects.rows;
+        if(pq.enabled() && pq.rows == n) {
+            return run(make_reranker(numKept, queries, 
+                    append_rows(PQScorer<Scalar>(pq, dataObjects, refine, takeSqrt), n, extraObjects, calc_l2_sqr<Scalar>, takeSqrt), topk, budget),
+                    queryBatches);
+        }
+        if(quantStore.enabled() && quantStore.rows == n) {
+            return run(make_reranker(numKept, queries, 
+                    append_rows(QuantScorer<Scalar>(quantStore, dataObjects, refine, takeSqrt), n, extraObjects, calc_l2_sqr<Scalar>, takeSqrt), topk, budget),
+                    queryBatches);
+        }
+        bool useNorms = normTrick && dataNorms.size() == n;
+        return run(make_reranker(topk, queries, 
+                append_rows(L2Scorer<Scalar>(dataObjects.cols, dataObjects, useNorms ? dataNorms.data() : nullptr, takeSqrt), n, extraObjects, calc_l2_sqr<Scalar>, takeSqrt),
+                0, budget),
+                queryBatches);
+    }
+
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int )
+    {
+        ar & dataNorms;
+        ar & quantType;
+        //refineFactor is a query-time setting, still in the archive such that older ones load, but not restored
+        int storedRefineFactor = refineFactor;
+        ar & storedRefineFactor;
+        ar & quantStore;
+        ar & pqSubspaces;
+        ar & pq;
+    }
+
+    //see index_file.h
+    void save_flat(IndexWriter& w, const std::string& prefix) const
+    {
+        w.add_array(prefix + "dataNorms", dataNorms);
+        w.add_value(prefix + "quantType", int(quantType));
+        quantStore.save_flat(w, prefix + "quant.");
+        w.add_value(prefix + "pqSubspaces", pqSubspaces);
+        pq.save_flat(w, prefix + "pq.");
+    }
+    void load_flat(const IndexReader& r, const std::string& prefix)
+    {
+        dataNorms = r.array<Scalar>(prefix + "dataNorms");
+        quantType = QuantType(r.value<int>(prefix + "quantType"));
+        quantStore.load_flat(r, prefix + "quant.");
+        pqSubspaces = r.value<int>(prefix + "pqSubspaces");
+        pq.load_flat(r, prefix + "pq.");
+    }
+
+    //rank l2 candidates by ||q||^2 + ||x||^2 - 2q.x, false to always use plain squared l2
+    bool normTrick = true;
+    QuantType quantType = QUANT_NONE;
+    //a query-time setting like budget, not restored by loading
+    int refineFactor = 4;
+    //#bytes per object of pq
+    int pqSubspaces = 16;
+    //count-aware pruning of the candidates of each query, a query-time setting that is not stored
+    CandidateBudget budget;
+
+    //||x||^2 of each object
+    FlatArray<Scalar> dataNorms;
+    QuantizedStore<Scalar> quantStore;
+    ProductQuantizer<Scalar> pq;
+
+private:
+    template<class ReRankerT, class QueryBatches>
+    static std::vector<std::vector<ResPair> > run(ReRankerT reranker, const QueryBatches& queryBatches)
+    {
+        queryBatches([&](int start, const std::vector<std::vector<Candidate> >& candidatessBatch){
+            reranker.push_batch(start, candidatessBatch);
+        });
+        return reranker.fetch_res_vec();
+    }
+};
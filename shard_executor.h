@@ -0,0 +1,226 @@
+#pragma once
+
+//persistent worker threads, one per shard, each pinned to the cpus of a numa node
+//shards are spread over the nodes round-robin; memory a shard allocates on its own worker is placed
+//on that node by the first-touch policy, thus shards should be built through run() to stay node-local
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <fmt/format.h>
+
+//"0-3,8,10-11" -> 0 1 2 3 8 10 11
+inline std::vector<int> parse_cpu_list(const std::string& list)
+{
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while(std::getline(ss, range, ',')) {
+        int lo, hi;
+        char dash;
+        std::stringstream rs(range);
+        if(!(rs >> lo)) {
+            continue;
+        }
+        hi = (rs >> dash >> hi) ? hi : lo;
+        for(int c=lo;c<=hi;c++){
+            cpus.push_back(c);
+        }
+    }
+    return cpus;
+}
+
+//cpus the process may run on (its affinity mask, as set by taskset, mpirun binding or a cpuset),
+//all cpus if unknown
+inline std::vector<int> process_cpus()
+{
+    std::vector<int> ret;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for(int c=0;c<CPU_SETSIZE;c++){
+            if(CPU_ISSET(c, &set)) {
+                ret.push_back(c);
+            }
+        }
+    }
+#endif
+    if(ret.empty()) {
+        for(int c=0;c<int(std::max(1u, std::thread::hardware_concurrency()));c++){
+            ret.push_back(c);
+        }
+    }
+    return ret;
+}
+
+//cpus of each numa node from sysfs that the process may run on, nodes without any are left out,
+//a single node of the cpus of the process if unknown
+inline const std::vector<std::vector<int> >& numa_node_cpus()
+{
+    static const std::vector<std::vector<int> > nodes = [](){
+        std::vector<int> allowed = process_cpus();
+        std::vector<std::vector<int> > ret;
+        for(int node=0;;node++){
+            std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string list;
+            if(!in || !std::getline(in, list)) {
+                break;
+            }
+            std::vector<int> cpus;
+            for(int c:parse_cpu_list(list)){
+                if(std::binary_search(allowed.begin(), allowed.end(), c)) {
+                    cpus.push_back(c);
+                }
+            }
+            if(!cpus.empty()) {
+                ret.push_back(std::move(cpus));
+            }
+        }
+        if(ret.empty()) {
+            ret.push_back(std::move(allowed));
+        }
+        return ret;
+    }();
+    return nodes;
+}
+
+//restrict the calling thread to cpus, return false if not supported
+inline bool pin_current_thread(const std::vector<int>& cpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int c:cpus){
+        if(c >= 0 && c < CPU_SETSIZE) {
+            CPU_SET(c, &set);
+        }
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+class ShardExecutor
+{
+public:
+    //init(shard) runs once on each worker after pinning, e.g. to select the device of the shard
+    ShardExecutor(int numShards, std::function<void(int)> init=nullptr)
+        :numShards(numShards)
+    {
+        workers.reserve(numShards);
+        for(int s=0;s<numShards;s++){
+            workers.emplace_back([this, s, init](){ worker_loop(s, init); });
+        }
+    }
+    ~ShardExecutor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        jobCond.notify_all();
+        for(auto& t:workers){
+            t.join();
+        }
+    }
+    ShardExecutor(const ShardExecutor& ) = delete;
+    ShardExecutor& operator=(const ShardExecutor& ) = delete;
+
+    //run f(shard) on the worker of every shard and wait for all of them, one run at a time
+    //the first exception thrown by f is rethrown here
+    template<class F>
+    void run(const F& f)
+    {
+        std::lock_guard<std::mutex> running(runMtx);
+        std::unique_lock<std::mutex> lock(mtx);
+        job = [&f](int shard){ f(shard); };
+        error = nullptr;
+        pending = numShards;
+        generation++;
+        jobCond.notify_all();
+        doneCond.wait(lock, [&](){ return pending == 0; });
+        job = nullptr;
+        if(error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    int size() const
+    {
+        return numShards;
+    }
+    static int node_of(int shard)
+    {
+        return shard % int(numa_node_cpus().size());
+    }
+
+private:
+    void worker_loop(int shard, const std::function<void(int)>& init)
+    {
+        if(!pin_current_thread(numa_node_cpus()[node_of(shard)])) {
+            //the workers still run, only unpinned, which is reported once
+            static std::atomic<bool> reported(false);
+            if(!reported.exchange(true)) {
+                fmt::print("could not pin the worker of shard {} to numa node {}, shard workers run unpinned\n", shard, node_of(shard));
+            }
+        }
+        if(init) {
+            init(shard);
+        }
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mtx);
+        for(;;){
+            jobCond.wait(lock, [&](){ return stopping || generation != seen; });
+            if(stopping) {
+                break;
+            }
+            seen = generation;
+            lock.unlock();
+            std::exception_ptr e;
+            try {
+                job(shard);
+            } catch(...) {
+                e = std::current_exception();
+            }
+            lock.lock();
+            if(e && !error) {
+                error = e;
+            }
+            if(--pending == 0) {
+                doneCond.notify_all();
+            }
+        }
+    }
+
+    int numShards;
+    std::vector<std::thread> workers;
+
+    std::mutex runMtx;
+    //guards everything below
+    std::mutex mtx;
+    std::condition_variable jobCond;
+    std::condition_variable doneCond;
+    std::function<void(int)> job;
+    std::exception_ptr error;
+    int pending = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+};
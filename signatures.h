@@ -0,0 +1,197 @@
+#pragma once
+
+//hash signatures of objects: sigDim values per object, stored flat row by row without padding
+//the hashers produce ints, get_sigs keeps the low GENIE4L2_SIG_BITS bits of each, so by default
+//a value fits in 16 bits; SigValue widens to 32 bits if the build sets more bits
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+#include <cmath>
+
+#include "matrix.h"
+#include "flat_array.h"
+#include "index_file.h"
+
+#ifndef GENIE4L2_SIG_BITS
+#define GENIE4L2_SIG_BITS 15
+#endif
+static_assert(GENIE4L2_SIG_BITS > 0 && GENIE4L2_SIG_BITS <= 31, "signature values have to be non-negative ints");
+
+using SigValue = std::conditional<(GENIE4L2_SIG_BITS <= 16), uint16_t, uint32_t>::type;
+const static int sigMask = int((1u << GENIE4L2_SIG_BITS) - 1);
+
+//sigs of a range of objects, stride == cols
+using SigView = MatrixView<SigValue>;
+
+inline void mask_sigs(const int* in, size_t n, SigValue* out)
+{
+    for(size_t i=0;i<n;i++){
+        out[i] = SigValue(in[i] & sigMask);
+    }
+}
+
+struct SigMatrix
+{
+    SigMatrix() {}
+    SigMatrix(int rows, int cols)
+    {
+        resize(rows, cols);
+    }
+
+    //content is not kept
+    void resize(int rows_, int cols_)
+    {
+        rows = rows_;
+        cols = cols_;
+        values.assign(size_t(rows)*cols, 0);
+    }
+
+    SigValue* row(int i)
+    {
+        assert(i >= 0 && i < rows);
+        return values.data() + size_t(i)*cols;
+    }
+    const SigValue* row(int i) const
+    {
+        assert(i >= 0 && i < rows);
+        return values.data() + size_t(i)*cols;
+    }
+    size_t size() const
+    {
+        return rows;
+    }
+
+    //rows of sigs are added after the existing ones
+    void append(SigView sigs)
+    {
+        assert(rows == 0 || sigs.rows == 0 || sigs.cols == cols);
+        if(rows == 0) {
+            cols = sigs.cols;
+        }
+        values.resize(size_t(rows + sigs.rows)*cols);
+        for(int i=0;i<sigs.rows;i++){
+            std::copy(sigs.row(i), sigs.row(i) + cols, values.data() + size_t(rows + i)*cols);
+        }
+        rows += sigs.rows;
+    }
+
+    SigView view() const
+    {
+        return SigView(values.data(), rows, cols, cols);
+    }
+    operator SigView() const
+    {
+        return view();
+    }
+
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int )
+    {
+        ar & rows;
+        ar & cols;
+        ar & values;
+    }
+
+    //see index_file.h
+    void save_flat(IndexWriter& w, const std::string& prefix) const
+    {
+        w.add_value(prefix + "rows", rows);
+        w.add_value(prefix + "cols", cols);
+        w.add_array(prefix + "values", values);
+    }
+    void load_flat(const IndexReader& r, const std::string& prefix)
+    {
+        rows = r.value<int>(prefix + "rows");
+        cols = r.value<int>(prefix + "cols");
+        values = r.array<SigValue>(prefix + "values");
+        if(values.size() != size_t(rows)*cols) {
+            throw std::runtime_error("index section " + prefix + "values does not match its shape");
+        }
+    }
+
+    int rows = 0;
+    int cols = 0;
+    FlatArray<SigValue> values;
+};
+
+//multi-probe: besides its own value in each dimension a query also looks up a few neighboring values,
+//each counted with a weight out of probeScale, the weight of the query's own values
+const static int probeScale = 4;
+
+struct Probe
+{
+    int dim = 0;
+    SigValue value = 0;
+    //0 for an unused slot
+    uint16_t weight = 0;
+};
+
+//perRow probe slots for each query of a batch, empty for no multi-probe
+struct ProbeList
+{
+    void resize(int rows_, int perRow_)
+    {
+        rows = rows_;
+        perRow = perRow_;
+        probes.assign(size_t(rows)*perRow, Probe());
+    }
+    bool empty() const
+    {
+        return perRow == 0;
+    }
+    Probe* row(int i)
+    {
+        return probes.data() + size_t(i)*perRow;
+    }
+    const Probe* row(int i) const
+    {
+        return probes.data() + size_t(i)*perRow;
+    }
+
+    int rows = 0;
+    int perRow = 0;
+    std::vector<Probe> probes;
+};
+
+//probes of one query hashed by floor(projection/r): sigs are the unmasked values, fracs the positions
+//inside their buckets in [0, 1); the numProbes dimensions closest to a bucket border probe the bucket
+//across it, with the full weight right on the border down to none in the middle of the bucket
+inline void select_probes(const int* sigs, const float* fracs, int sigDim, int numProbes, Probe* out)
+{
+    thread_local std::vector<std::pair<float, int> > byBorder;
+    byBorder.resize(sigDim);
+    for(int d=0;d<sigDim;d++){
+        byBorder[d] = std::make_pair(std::min(fracs[d], 1.f - fracs[d]), d);
+    }
+    numProbes = std::min(numProbes, sigDim);
+    std::partial_sort(byBorder.begin(), byBorder.begin()+numProbes, byBorder.end());
+    for(int j=0;j<numProbes;j++){
+        int d = byBorder[j].second;
+        int neighbor = fracs[d] < 0.5f ? sigs[d] - 1 : sigs[d] + 1;
+        out[j].dim = d;
+        out[j].value = SigValue(neighbor & sigMask);
+        out[j].weight = uint16_t(std::lround(probeScale * (1.f - 2*byBorder[j].first)));
+    }
+}
+
+//a candidate of a query and its count, the #dimensions it matched (weighted with probes)
+struct Candidate
+{
+    int id;
+    int count;
+};
+
+//the std::vector<std::vector<int> > layout expected by genie
+inline std::vector<std::vector<int> > sig_rows(SigView sigs)
+{
+    std::vector<std::vector<int> > ret(sigs.rows);
+    for(int i=0;i<sigs.rows;i++){
+        ret[i].assign(sigs.row(i), sigs.row(i) + sigs.cols);
+    }
+    return ret;
+}
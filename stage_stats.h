@@ -0,0 +1,284 @@
+#pragma once
+
+//time spent in the stages of the query path, cheap enough to stay on in production
+//
+//  StageTimer<Stage::Match> timer;     //the rest of the scope is recorded as a match
+//  StageSnapshot s = stage_snapshot(); //from any thread, also while queries are running
+//
+//each thread records into its own block of counters, so recording takes no lock: a duration is added to
+//the count, the total and a log-bucketed histogram of its stage with relaxed stores of the owner thread only.
+//a snapshot sums the blocks of all threads without stopping them. the block of an exited thread is handed
+//to the next new thread with its counts kept, so nothing is lost and the #blocks is the peak #threads
+//
+//every stage is counted per query, whether it runs a query or a batch at a time: a timer around a batch of
+//n queries is given n and records n samples of its duration / n. thus counts, means and quantiles are per query
+//on every backend (the cpu bucketer matches a query at a time, genie a batch), and the spread within a batch is not seen
+//
+//compile with -DGENIE4L2_NO_STAGE_STATS to remove the timers altogether
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include <fmt/format.h>
+
+enum class Stage : int
+{
+    Hash,       //projecting queries into signatures, and selecting their probes
+    QueryBuild, //building the query of the bucketer
+    Match,      //counting the matches of queries in the posting lists
+    Extract,    //taking the candidates with the largest counts
+    Rerank,     //scoring the candidates
+    Merge,      //merging candidates or results of the main table and the delta, shards or ranks
+    Count
+};
+const static int numStages = int(Stage::Count);
+
+inline const char* stage_name(Stage s)
+{
+    static const char* names[numStages] = {"hash", "query_build", "match", "extract", "rerank", "merge"};
+    return names[int(s)];
+}
+
+//a duration in ns goes to the bucket of its highest bit and the histSubBits bits below it,
+//thus a quantile is within 1/2^histSubBits of the true one
+const static int histSubBits = 2;
+const static int histBuckets = 64 << histSubBits;
+
+inline int hist_bucket(uint64_t ns)
+{
+    if(ns < (1u << histSubBits)) {
+        return int(ns);
+    }
+    int hi = 63 - __builtin_clzll(ns);
+    return ((hi - histSubBits + 1) << histSubBits) | int((ns >> (hi - histSubBits)) & ((1u << histSubBits) - 1));
+}
+
+//the smallest duration in ns of bucket b
+inline uint64_t hist_bucket_begin(int b)
+{
+    if(b < (1 << histSubBits)) {
+        return uint64_t(b);
+    }
+    int hi = (b >> histSubBits) + histSubBits - 1;
+    return (uint64_t((1 << histSubBits) | (b & ((1 << histSubBits) - 1)))) << (hi - histSubBits);
+}
+
+//the counters of one thread, only written by it
+struct StageBlock
+{
+    std::atomic<uint64_t> counts[numStages] = {};
+    std::atomic<uint64_t> totalNs[numStages] = {};
+    std::atomic<uint64_t> hist[numStages][histBuckets] = {};
+
+    //ns spent on n queries
+    void record(Stage s, uint64_t ns, uint64_t n=1)
+    {
+        int i = int(s);
+        add(counts[i], n);
+        add(totalNs[i], ns);
+        add(hist[i][hist_bucket(ns / n)], n);
+    }
+
+private:
+    //a single writer needs no read-modify-write
+    static void add(std::atomic<uint64_t>& a, uint64_t v)
+    {
+        a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+    }
+};
+
+//the summed counters of one stage
+struct StageStats
+{
+    uint64_t count = 0;
+    uint64_t totalNs = 0;
+    std::array<uint64_t, histBuckets> hist = {};
+
+    double total_sec() const
+    {
+        return totalNs * 1e-9;
+    }
+    double mean_ms() const
+    {
+        return count > 0 ? totalNs * 1e-6 / count : 0.;
+    }
+    //the end of the bucket the q-quantile falls into
+    double quantile_ms(double q) const
+    {
+        if(count == 0) {
+            return 0.;
+        }
+        uint64_t rank = std::min<uint64_t>(count - 1, uint64_t(q * count));
+        uint64_t seen = 0;
+        for(int b=0;b<histBuckets;b++){
+            seen += hist[b];
+            if(seen > rank) {
+                return (b + 1 < histBuckets ? hist_bucket_begin(b + 1) : hist_bucket_begin(b)) * 1e-6;
+            }
+        }
+        return 0.;
+    }
+};
+
+struct StageSnapshot
+{
+    std::array<StageStats, numStages> stages;
+
+    const StageStats& operator[](Stage s) const
+    {
+        return stages[int(s)];
+    }
+
+    //what was recorded between two snapshots, e.g. by one run of a benchmark
+    StageSnapshot operator-(const StageSnapshot& before) const
+    {
+        StageSnapshot ret = *this;
+        for(int s=0;s<numStages;s++){
+            ret.stages[s].count -= before.stages[s].count;
+            ret.stages[s].totalNs -= before.stages[s].totalNs;
+            for(int b=0;b<histBuckets;b++){
+                ret.stages[s].hist[b] -= before.stages[s].hist[b];
+            }
+        }
+        return ret;
+    }
+
+    //{"hash": {"count": .., "total_s": .., "mean_ms": .., "p50_ms": .., "p99_ms": ..}, ...}
+    std::string to_json() const
+    {
+        std::string ret = "{";
+        for(int s=0;s<numStages;s++){
+            const StageStats& st = stages[s];
+            ret += fmt::format("{}\"{}\": {{\"count\": {}, \"total_s\": {:.6f}, \"mean_ms\": {:.4f}, \"p50_ms\": {:.4f}, \"p99_ms\": {:.4f}}}",
+                s > 0 ? ", " : "", stage_name(Stage(s)), st.count, st.total_sec(), st.mean_ms(), st.quantile_ms(0.5), st.quantile_ms(0.99));
+        }
+        return ret + "}";
+    }
+
+    //one line per stage that was recorded
+    std::string to_table() const
+    {
+        std::string ret = fmt::format("{:<12} {:>10} {:>10} {:>10} {:>10} {:>10}\n", "stage", "count", "total_s", "mean_ms", "p50_ms", "p99_ms");
+        for(int s=0;s<numStages;s++){
+            const StageStats& st = stages[s];
+            if(st.count > 0) {
+                ret += fmt::format("{:<12} {:>10} {:>10.4f} {:>10.4f} {:>10.4f} {:>10.4f}\n",
+                    stage_name(Stage(s)), st.count, st.total_sec(), st.mean_ms(), st.quantile_ms(0.5), st.quantile_ms(0.99));
+            }
+        }
+        return ret;
+    }
+};
+
+//owns the blocks of all threads, the lock is only taken when a thread starts or exits and by snapshots
+class StageRegistry
+{
+public:
+    //never destroyed, threads may exit after static destructors ran
+    static StageRegistry& get()
+    {
+        static StageRegistry* registry = new StageRegistry();
+        return *registry;
+    }
+
+    StageBlock* acquire()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(!freeBlocks.empty()) {
+            StageBlock* block = freeBlocks.back();
+            freeBlocks.pop_back();
+            return block;
+        }
+        blocks.emplace_back(new StageBlock());
+        return blocks.back().get();
+    }
+    void release(StageBlock* block)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        freeBlocks.push_back(block);
+    }
+
+    StageSnapshot snapshot()
+    {
+        StageSnapshot ret;
+        std::lock_guard<std::mutex> lock(mtx);
+        for(const auto& block:blocks){
+            for(int s=0;s<numStages;s++){
+                StageStats& st = ret.stages[s];
+                st.count += block->counts[s].load(std::memory_order_relaxed);
+                st.totalNs += block->totalNs[s].load(std::memory_order_relaxed);
+                for(int b=0;b<histBuckets;b++){
+                    st.hist[b] += block->hist[s][b].load(std::memory_order_relaxed);
+                }
+            }
+        }
+        return ret;
+    }
+
+private:
+    StageRegistry() = default;
+
+    std::mutex mtx;
+    std::vector<std::unique_ptr<StageBlock> > blocks;
+    std::vector<StageBlock*> freeBlocks;
+};
+
+inline StageBlock& thread_stage_block()
+{
+    struct Holder
+    {
+        StageBlock* block = StageRegistry::get().acquire();
+        ~Holder()
+        {
+            StageRegistry::get().release(block);
+        }
+    };
+    thread_local Holder holder;
+    return *holder.block;
+}
+
+inline void record_stage(Stage s, std::chrono::steady_clock::duration d, int numQueries=1)
+{
+    if(numQueries > 0) {
+        thread_stage_block().record(s, uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()), uint64_t(numQueries));
+    }
+}
+
+//the sum over all threads so far
+inline StageSnapshot stage_snapshot()
+{
+    return StageRegistry::get().snapshot();
+}
+
+//records the time from its construction to its destruction as S of numQueries queries
+template<Stage S>
+class StageTimer
+{
+public:
+#ifndef GENIE4L2_NO_STAGE_STATS
+    explicit StageTimer(int numQueries=1)
+        :numQueries(numQueries), t0(std::chrono::steady_clock::now())
+    {
+    }
+    ~StageTimer()
+    {
+        record_stage(S, std::chrono::steady_clock::now() - t0, numQueries);
+    }
+
+private:
+    int numQueries;
+    std::chrono::steady_clock::time_point t0;
+#else
+    explicit StageTimer(int =1)
+    {
+    }
+#endif
+    StageTimer(const StageTimer& ) = delete;
+    StageTimer& operator=(const StageTimer& ) = delete;
+};
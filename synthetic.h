@@ -0,0 +1,49 @@
+#pragma once
+
+//seeded synthetic data: a mixture of isotropic gaussians
+//the same seed and shape always give the same rows, so benchmarks need no dataset files
+
+#include <random>
+#include <vector>
+#include <cstdint>
+
+#include "matrix.h"
+#include "parallel.h"
+
+struct GaussianMixture
+{
+    //numClusters centers drawn from N(0, centerSpread^2) in each coordinate, rows are a center plus N(0, 1) noise
+    GaussianMixture(int dim, int numClusters, uint64_t seed, double centerSpread=4.)
+        :dim(dim), seed(seed), centers(numClusters, dim)
+    {
+        std::mt19937_64 rng(seed);
+        std::normal_distribution<float> normal(0.f, float(centerSpread));
+        for(int c=0;c<numClusters;c++){
+            for(int j=0;j<dim;j++){
+                centers[c][j] = normal(rng);
+            }
+        }
+    }
+
+    //n rows of stream, different streams of the same mixture are independent
+    //every row has its own generator, thus the rows do not depend on the number of threads
+    Matrix<float> sample(int n, uint64_t stream) const
+    {
+        Matrix<float> ret(n, dim);
+        parallel_for(0, n, 1024, [&](int , int beg, int end){
+            for(int i=beg;i<end;i++){
+                std::mt19937_64 rng(seed ^ (stream * 0x9e3779b97f4a7c15ull) ^ (uint64_t(i) * 0xbf58476d1ce4e5b9ull));
+                std::normal_distribution<float> normal(0.f, 1.f);
+                int c = int(rng() % uint64_t(centers.rows));
+                for(int j=0;j<dim;j++){
+                    ret[i][j] = centers[c][j] + normal(rng);
+                }
+            }
+        });
+        return ret;
+    }
+
+    int dim;
+    uint64_t seed;
+    Matrix<float> centers;
+};
@@ -0,0 +1,205 @@
+#include <boost/program_options.hpp>
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <random>
+#include <numeric>
+#include <algorithm>
+#include <unistd.h>
+#include "genie4l2.h"
+#include "cpu_bucketer.h"
+#include "dataset_io.h"
+#include "synthetic.h"
+#include "exact_knn.h"
+#include "tuner.h"
+#include "util.h"
+
+#include <fmt/format.h>
+
+using namespace std;
+using namespace boost::program_options;
+
+template<class T>
+static vector<T> parse_list(const string& s)
+{
+    vector<T> ret;
+    stringstream ss(s);
+    string item;
+    while(getline(ss, item, ',')) {
+        if(!item.empty()) {
+            stringstream is(item);
+            T v;
+            is >> v;
+            ret.push_back(v);
+        }
+    }
+    return ret;
+}
+
+static Matrix<float> take_rows(MatrixView<float> rows, const vector<int>& ids)
+{
+    Matrix<float> ret(ids.size(), rows.cols);
+    for(int i=0;i<ids.size();i++){
+        copy(rows.row(ids[i]), rows.row(ids[i]) + rows.cols, ret.row(i));
+    }
+    return ret;
+}
+
+static string point_csv(const TunePoint& p, bool pareto)
+{
+    const TuneConfig& c = p.config;
+    return fmt::format("{},{},{},{},{},{:.4f},{:.1f},{:.4f},{}\n",
+        c.method, c.nLines, c.r, c.nPivots, c.numCandidates, p.recall, p.qps, p.buildSec, int(pareto));
+}
+
+//search nLines, r, nPivots and the candidate budget on a sample of the dataset for the fastest config
+//reaching a recall@k, and report the pareto frontier of recall vs. qps, see tuner.h
+int main(int argc, char **argv)
+{
+    int n, qn, d, sampleRows, numClusters;
+    uint64_t seed;
+    double targetRecall;
+    string datasetFilename, queryFilename, backend, format, outputFilename;
+    string nLinesList, rList, nPivotsList, factorList;
+    TuneSpace space;
+
+    options_description desc("Allowed options");
+    desc.add_options()
+        ("help,h", "produce help message")
+
+        ("n,n", value(&n)->default_value(100000), "the number of data points")
+        ("d,d", value(&d)->default_value(64), "the dimension of data")
+        ("qn,q", value(&qn)->default_value(500), "the number of held-out queries")
+        ("dataset_filename,D", value(&datasetFilename)->default_value(""), "path to dataset filename, a synthetic gaussian mixture if empty")
+        ("queryset_filename,Q", value(&queryFilename)->default_value(""), "path to query filename, rows of the dataset outside the sample if empty")
+        ("sample", value(&sampleRows)->default_value(100000), "#rows of the dataset sampled for tuning")
+        ("clusters", value(&numClusters)->default_value(100), "#gaussians of the synthetic mixture")
+        ("seed", value(&seed)->default_value(1), "seed of the sampling and the synthetic mixture")
+
+        ("target_recall", value(&targetRecall)->default_value(0.9), "the recall@k the chosen config has to reach")
+        ("k,k", value(&space.topk)->default_value(10), "k of recall@k")
+        ("queryPerBatch,b", value(&space.queryPerBatch)->default_value(256), "#query per batch")
+        ("nLines,L", value(&nLinesList)->default_value("16,32,64,128"), "comma separated #projection lines to try, empty to skip")
+        ("r,r", value(&rList)->default_value(""), "comma separated projection radii to try, around the distance to the k-th neighbor if empty")
+        ("nPivots", value(&nPivotsList)->default_value(""), "comma separated #pivots of GeniePivot to try, empty to skip")
+        ("candidate_factors", value(&factorList)->default_value("1,2,3,4,6"), "comma separated candidate budgets to try, as multiples of k+nLines (k+nPivots)")
+
+        ("backend", value(&backend)->default_value("cpu"), "bucketer backend: genie (gpu) or cpu")
+        ("GPUID", value(&space.GPUID)->default_value(0), "GPUID used for genie")
+        ("format", value(&format)->default_value("json"), "json, or csv of all points with a pareto column")
+        ("output_filename,O", value(&outputFilename)->default_value(""), "where the results go, stdout if empty (anything else printed goes to stderr)")
+    ;
+
+    variables_map vm;
+    try {
+        store(parse_command_line(argc, argv, desc), vm);
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 1;
+        }
+        notify(vm);
+    } catch (const boost::program_options::error & e) {
+        std::cout << e.what() << std::endl << desc << std::endl;
+        return 1;
+    }
+    if(format != "json" && format != "csv") {
+        fmt::print("Unknown format {}\n", format);
+        return 1;
+    }
+    if(backend != "cpu" && backend != "genie") {
+        fmt::print("Unknown backend {}\n", backend);
+        return 1;
+    }
+    space.nLines = parse_list<int>(nLinesList);
+    space.radii = parse_list<double>(rList);
+    space.nPivots = parse_list<int>(nPivotsList);
+    space.candidateFactors = parse_list<double>(factorList);
+    if((space.nLines.empty() && space.nPivots.empty()) || space.candidateFactors.empty()) {
+        fmt::print("Nothing to tune\n");
+        return 1;
+    }
+
+    //the results go to the real stdout, everything else printed goes to stderr
+    FILE* out = nullptr;
+    if(outputFilename.empty()) {
+        fflush(stdout);
+        out = fdopen(dup(1), "w");
+        dup2(2, 1);
+    } else {
+        out = fopen(outputFilename.c_str(), "w");
+    }
+    if(out == nullptr) {
+        fmt::print("Could not open {}\n", outputFilename);
+        return 1;
+    }
+
+    Matrix<float> full;
+    if(datasetFilename != "") {
+        if(read_data_binary(n, d, datasetFilename.c_str(), full) == 1) {
+            fmt::print("Reading dataset error!\n");
+            return 1;
+        }
+    } else {
+        full = GaussianMixture(d, numClusters, seed).sample(n, 0);
+    }
+
+    //a random sample of rows, and the held-out queries from the rows left
+    vector<int> ids(full.rows);
+    iota(ids.begin(), ids.end(), 0);
+    shuffle(ids.begin(), ids.end(), mt19937_64(seed));
+    int numSampled = min(sampleRows, full.rows - (queryFilename == "" ? min(qn, full.rows) : 0));
+    Matrix<float> data = take_rows(full, vector<int>(ids.begin(), ids.begin() + numSampled));
+    Matrix<float> queries;
+    if(queryFilename != "") {
+        if(read_data_binary(qn, d, queryFilename.c_str(), queries) == 1) {
+            fmt::print("Reading query set error!\n");
+            return 1;
+        }
+    } else {
+        queries = take_rows(full, vector<int>(ids.begin() + numSampled, ids.begin() + min<int>(numSampled + qn, full.rows)));
+    }
+    full = Matrix<float>();
+    if(data.rows == 0 || queries.rows == 0) {
+        fmt::print("No rows to tune on\n");
+        return 1;
+    }
+
+    MyTimer::pusht();
+    auto truth = exact_knn(data.view(), queries.view(), space.topk);
+    fmt::print("exact top-{} of {} queries over {} sampled rows, time={}\n", space.topk, queries.rows, data.rows, MyTimer::popt());
+    if(space.radii.empty()) {
+        space.radii = default_radii(truth);
+    }
+
+    auto points = backend == "cpu" ? tune<float, CpuBucketer>(space, data, queries, truth)
+        : tune<float, GenieBucketer>(space, data, queries, truth);
+    auto frontier = pareto_frontier(points);
+    const TunePoint* best = cheapest_config(points, targetRecall);
+    if(best) {
+        fmt::print("fastest config reaching recall {}: {}\n", targetRecall, best->to_json());
+    } else {
+        fmt::print("no config reaches recall {}, the best recall is {}\n", targetRecall, frontier.empty() ? 0. : frontier.back().recall);
+    }
+
+    if(format == "csv") {
+        fmt::print(out, "method,nLines,r,nPivots,numCandidates,recall,qps,build_s,pareto\n");
+        for(const TunePoint& p:points){
+            bool pareto = any_of(frontier.begin(), frontier.end(), [&](const TunePoint& f){
+                return f.config.to_json() == p.config.to_json();
+            });
+            fmt::print(out, "{}", point_csv(p, pareto));
+        }
+    } else {
+        auto json_list = [](const vector<TunePoint>& ps){
+            string ret;
+            for(size_t i=0;i<ps.size();i++){
+                ret += fmt::format("    {}{}\n", ps[i].to_json(), i+1 < ps.size() ? "," : "");
+            }
+            return ret;
+        };
+        fmt::print(out, "{{\n  \"target_recall\": {},\n  \"best\": {},\n  \"frontier\": [\n{}  ],\n  \"points\": [\n{}  ]\n}}\n",
+            targetRecall, best ? best->to_json() : "null", json_list(frontier), json_list(points));
+    }
+    fclose(out);
+    return 0;
+}
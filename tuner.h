@@ -0,0 +1,240 @@
+#pragma once
+
+//search for the parameters reaching a recall@k at the largest throughput, on a sample of the dataset
+//
+//every config is scored by recall@k and QPS of held-out queries against exact ground truth,
+//builds and matching are shared where the parameters allow:
+//  nLines      for each radius the data is hashed once with the largest nLines, a smaller one takes
+//              a prefix of its lines and the same columns of the signatures (RandProjHasher::prefix)
+//  candidates  a bucketer returns candidates by count descendingly, so those of a smaller budget are a prefix
+//              of those of the largest one: each build matches once and re-ranks the prefix of every budget
+//QPS is #queries over the time of matching plus re-ranking, i.e. without the overlap of the pipeline,
+//and matching is timed once with the largest budget, so smaller budgets are slightly underrated
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+
+#include <fmt/format.h>
+
+#include "genie4l2.h"
+#include "exact_knn.h"
+
+struct TuneConfig
+{
+    //"lines" for Genie4l2, "pivots" for GeniePivot
+    std::string method;
+    int nLines = 0;
+    double r = 0.;
+    int nPivots = 0;
+    //#candidates per query from the bucketer
+    int numCandidates = 0;
+
+    std::string to_json() const
+    {
+        return fmt::format("\"method\": \"{}\", \"nLines\": {}, \"r\": {}, \"nPivots\": {}, \"numCandidates\": {}",
+            method, nLines, r, nPivots, numCandidates);
+    }
+};
+
+struct TunePoint
+{
+    TuneConfig config;
+    double recall = 0.;
+    double qps = 0.;
+    double buildSec = 0.;
+
+    std::string to_json() const
+    {
+        return fmt::format("{{{}, \"recall\": {:.4f}, \"qps\": {:.1f}, \"build_s\": {:.4f}}}", config.to_json(), recall, qps, buildSec);
+    }
+};
+
+//the parameter space, empty lists skip a method
+struct TuneSpace
+{
+    std::vector<int> nLines;
+    std::vector<double> radii;
+    std::vector<int> nPivots;
+    //the candidate budgets are factor*(topk+nLines) or factor*(topk+nPivots), the constructors use 3
+    std::vector<double> candidateFactors = {1, 2, 3, 4, 6};
+    int topk = 10;
+    int queryPerBatch = 256;
+    int GPUID = 0;
+};
+
+//the points no other point beats on both recall and qps, by qps descendingly and thus recall ascendingly
+inline std::vector<TunePoint> pareto_frontier(std::vector<TunePoint> points)
+{
+    std::sort(points.begin(), points.end(), [](const TunePoint& a, const TunePoint& b){
+        return a.qps > b.qps || (a.qps == b.qps && a.recall > b.recall);
+    });
+    std::vector<TunePoint> ret;
+    for(const TunePoint& p:points){
+        if(ret.empty() || p.recall > ret.back().recall) {
+            ret.push_back(p);
+        }
+    }
+    return ret;
+}
+
+//the fastest point reaching targetRecall, nullptr if none does
+inline const TunePoint* cheapest_config(const std::vector<TunePoint>& points, double targetRecall)
+{
+    const TunePoint* ret = nullptr;
+    for(const TunePoint& p:points){
+        if(p.recall >= targetRecall && (ret == nullptr || p.qps > ret->qps)) {
+            ret = &p;
+        }
+    }
+    return ret;
+}
+
+//the budgets of factors*base, distinct and ascending
+inline std::vector<int> candidate_budgets(const std::vector<double>& factors, int base)
+{
+    std::vector<int> ret;
+    for(double f:factors){
+        ret.push_back(std::max(1, int(std::lround(f*base))));
+    }
+    std::sort(ret.begin(), ret.end());
+    ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+    return ret;
+}
+
+//a point per budget of a built index, whose bucketer returns budgets.back() candidates
+template<class Scalar, class Index>
+std::vector<TunePoint> tune_budgets(Index& index, const TuneConfig& base, const std::vector<int>& budgets, int topk, int queryPerBatch,
+    MatrixView<Scalar> data, MatrixView<Scalar> queries, const std::vector<std::vector<std::pair<Scalar, int> > >& truth, double buildSec)
+{
+    using Clock = std::chrono::steady_clock;
+    std::vector<std::vector<Candidate> > candidatess(queries.rows);
+    auto t0 = Clock::now();
+    index.query_batches(queries, [&](int start, const std::vector<std::vector<Candidate> >& candidatessBatch){
+        for(int i=0;i<candidatessBatch.size();i++){
+            candidatess[start+i] = candidatessBatch[i];
+        }
+    });
+    double matchSec = std::chrono::duration<double>(Clock::now() - t0).count();
+
+    std::vector<TunePoint> ret;
+    for(int budget:budgets){
+        auto t1 = Clock::now();
+        auto ress = index.rerankStore.query_l2(topk, queries, data, true, [&](const auto& g){
+            std::vector<std::vector<Candidate> > batch;
+            for(int beg=0;beg<queries.rows;beg+=queryPerBatch){
+                int end = std::min(beg + queryPerBatch, queries.rows);
+                batch.resize(end - beg);
+                for(int i=beg;i<end;i++){
+                    batch[i-beg].assign(candidatess[i].begin(), candidatess[i].begin() + std::min<int>(budget, candidatess[i].size()));
+                }
+                g(beg, batch);
+            }
+        });
+        double rerankSec = std::chrono::duration<double>(Clock::now() - t1).count();
+
+        TunePoint p;
+        p.config = base;
+        p.config.numCandidates = budget;
+        p.recall = recall_at_k(ress, truth, topk);
+        p.qps = queries.rows / std::max(matchSec + rerankSec, 1e-9);
+        p.buildSec = buildSec;
+        ret.push_back(p);
+    }
+    return ret;
+}
+
+//signatures of all rows under hasher
+template<class Scalar>
+SigMatrix hash_rows(const RandProjHasher<Scalar, int>& hasher, MatrixView<Scalar> rows)
+{
+    SigMatrix ret(rows.rows, hasher.sigdim);
+    std::vector<int> sigs(size_t(rows.rows)*hasher.sigdim);
+    hasher.getSigBatch(rows.row(0), rows.rows, sigs.data(), rows.stride);
+    mask_sigs(sigs.data(), sigs.size(), ret.row(0));
+    return ret;
+}
+
+//the first cols columns of sigs
+inline SigMatrix first_cols(const SigMatrix& sigs, int cols)
+{
+    SigMatrix ret(sigs.rows, cols);
+    for(int i=0;i<sigs.rows;i++){
+        std::copy(sigs.row(i), sigs.row(i) + cols, ret.row(i));
+    }
+    return ret;
+}
+
+//all points of the space, truth are the exact topk of the queries in data
+template<class Scalar, class Bucketer>
+std::vector<TunePoint> tune(const TuneSpace& space, MatrixView<Scalar> data, MatrixView<Scalar> queries,
+    const std::vector<std::vector<std::pair<Scalar, int> > >& truth)
+{
+    using Clock = std::chrono::steady_clock;
+    const int dim = data.cols, topk = space.topk;
+    std::vector<TunePoint> ret;
+    if(data.rows == 0 || queries.rows == 0) {
+        return ret;
+    }
+
+    std::vector<int> nLines = space.nLines;
+    std::sort(nLines.begin(), nLines.end());
+    for(double r:space.radii){
+        if(nLines.empty()) {
+            break;
+        }
+        auto t0 = Clock::now();
+        RandProjHasher<Scalar, int> fullHasher(dim, nLines.back(), r);
+        SigMatrix fullSigs = hash_rows(fullHasher, data);
+        double hashSec = std::chrono::duration<double>(Clock::now() - t0).count();
+        for(int L:nLines){
+            auto budgets = candidate_budgets(space.candidateFactors, topk + L);
+            fmt::print("tuning lines: nLines={} r={} candidates up to {}\n", L, r, budgets.back());
+            auto t1 = Clock::now();
+            Genie4l2<Scalar, Bucketer> index(dim, L, r, topk, space.queryPerBatch, space.GPUID, budgets.back());
+            index.build(data, fullHasher.prefix(L), first_cols(fullSigs, L));
+            double buildSec = hashSec + std::chrono::duration<double>(Clock::now() - t1).count();
+
+            TuneConfig base;
+            base.method = "lines";
+            base.nLines = L;
+            base.r = r;
+            auto points = tune_budgets(index, base, budgets, topk, space.queryPerBatch, data, queries, truth, buildSec);
+            ret.insert(ret.end(), points.begin(), points.end());
+        }
+    }
+
+    for(int P:space.nPivots){
+        auto budgets = candidate_budgets(space.candidateFactors, topk + P);
+        fmt::print("tuning pivots: nPivots={} candidates up to {}\n", P, budgets.back());
+        auto t0 = Clock::now();
+        GeniePivot<Scalar, Bucketer> index(dim, P, topk, space.queryPerBatch, space.GPUID, data, calc_l2_dist<Scalar>, budgets.back());
+        index.build(data);
+        double buildSec = std::chrono::duration<double>(Clock::now() - t0).count();
+
+        TuneConfig base;
+        base.method = "pivots";
+        base.nPivots = P;
+        auto points = tune_budgets(index, base, budgets, topk, space.queryPerBatch, data, queries, truth, buildSec);
+        ret.insert(ret.end(), points.begin(), points.end());
+    }
+    return ret;
+}
+
+//radii around the mean distance of the queries to their k-th nearest neighbor, which the radius should be near
+template<class Scalar>
+std::vector<double> default_radii(const std::vector<std::vector<std::pair<Scalar, int> > >& truth)
+{
+    double sum = 0.;
+    int n = 0;
+    for(const auto& t:truth){
+        if(!t.empty()) {
+            sum += std::sqrt(double(t.back().first));
+            n++;
+        }
+    }
+    double dk = n > 0 && sum > 0 ? sum / n : 1.;
+    return {dk/2, dk, 2*dk, 4*dk};
+}
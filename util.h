@@ -5,6 +5,12 @@
 #include <chrono>
 #include <iostream>
 #include <stack>
+#include <vector>
+#include <cstdlib>
+#include <new>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 
 struct Result
 {
@@ -14,6 +20,40 @@ struct Result
 
 const static int MAXK = 100;
 
+//allocator returning memory aligned to Align bytes (cache line by default)
+template<class T, size_t Align=64>
+struct AlignedAllocator
+{
+    using value_type = T;
+    template<class U> struct rebind { using other = AlignedAllocator<U, Align>; };
+
+    AlignedAllocator() = default;
+    template<class U>
+    AlignedAllocator(const AlignedAllocator<U, Align>& ) {}
+
+    T* allocate(size_t n)
+    {
+        size_t bytes = (n*sizeof(T) + Align-1) / Align * Align;
+        void *p = aligned_alloc(Align, std::max<size_t>(bytes, Align));
+        if(p == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+    void deallocate(T* p, size_t ) 
+    {
+        free(p);
+    }
+
+    template<class U>
+    bool operator==(const AlignedAllocator<U, Align>& ) const { return true; }
+    template<class U>
+    bool operator!=(const AlignedAllocator<U, Align>& ) const { return false; }
+};
+
+template<class T>
+using aligned_vector = std::vector<T, AlignedAllocator<T> >;
+
 template<class ScalarType>
 ScalarType sqr(ScalarType x)
 {
@@ -123,6 +163,14 @@ inline ScalarType calc_inner_product(int dim, const ScalarType* x, const ScalarT
 	return fast_reduce(dim, x, y, fProd, fSum);
 }
 
+//the float versions are dispatched at runtime to SSE/AVX2/AVX-512 kernels, see distance_simd.cpp
+template<>
+float calc_l2_sqr<float>(int dim, const float* x, const float* y);
+template<>
+float calc_l1_dist<float>(int dim, const float* x, const float* y);
+template<>
+float calc_inner_product<float>(int dim, const float* x, const float* y);
+
 // -----------------------------------------------------------------------------
 template<class ScalarType>
 ScalarType calc_l2_dist(					// calc L2 distance
@@ -134,6 +182,75 @@ ScalarType calc_l2_dist(					// calc L2 distance
 }
 
 
+//ieee half precision <-> float, round to nearest even
+inline uint16_t float_to_half(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, 4);
+    uint32_t sign = (x >> 16) & 0x8000;
+    int32_t exp = int32_t((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = x & 0x7fffff;
+    if(((x >> 23) & 0xff) == 0xff) {
+        //inf or nan
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    }
+    if(exp >= 31) {
+        return sign | 0x7c00;
+    }
+    if(exp <= 0) {
+        //subnormal or zero
+        if(exp < -10) {
+            return sign;
+        }
+        mant |= 0x800000;
+        int shift = 14 - exp;
+        uint32_t half = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t mid = 1u << (shift - 1);
+        if(rem > mid || (rem == mid && (half & 1))) {
+            half++;
+        }
+        return sign | half;
+    }
+    uint32_t half = sign | (uint32_t(exp) << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1fff;
+    //a carry into the exponent is the right result
+    if(rem > 0x1000 || (rem == 0x1000 && (half & 1))) {
+        half++;
+    }
+    return half;
+}
+
+inline float half_to_float(uint16_t h)
+{
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+    if(exp == 0) {
+        if(mant == 0) {
+            x = sign;
+        } else {
+            //subnormal, normalize it
+            exp = 127 - 15 + 1;
+            while(!(mant & 0x400)) {
+                mant <<= 1;
+                exp--;
+            }
+            x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+        }
+    } else if(exp == 31) {
+        //nan is made quiet as f16c does
+        x = sign | 0x7f800000 | (mant << 13) | (mant ? 0x400000 : 0);
+    } else {
+        x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+    }
+    float f;
+    memcpy(&f, &x, 4);
+    return f;
+}
+
+
 inline double calc_recall(
     std::vector<double> &res,
     std::vector<double> &ground_truth,
@@ -152,6 +269,8 @@ inline double calc_recall(
 
 
 
+//coarse timings on a monotonic clock, pusht/popt nest per thread while named timers are for a single thread;
+//stages of the query path are timed by stage_stats.h
 class MyTimer
 {
 public:
@@ -166,12 +285,12 @@ public:
 		end();
 	};
 	void start() {
-		startTime = std::chrono::system_clock::now();
+		startTime = std::chrono::steady_clock::now();
 		isRunning = true;
 	}
 	void end() {
 		if(isRunning){
-			endTime = std::chrono::system_clock::now();
+			endTime = std::chrono::steady_clock::now();
 			t_type t = endTime - startTime;
 			// printf(" %s: %f\n", name.c_str(), t.count());
 			if(name != ""){
@@ -182,25 +301,25 @@ public:
 		}
 	}
 	double getTime(){
-		return (endTime-startTime).count();
+		return t_type(endTime-startTime).count();
 	} 
 
 	template<typename F, typename... Args>
 	static t_type funcTime(F&& func, Args&&... args){
-		auto t0 = std::chrono::system_clock::now();
+		auto t0 = std::chrono::steady_clock::now();
 		func(std::forward<Args>(args)...);
-		auto t1 = std::chrono::system_clock::now();
+		auto t1 = std::chrono::steady_clock::now();
 		return t_type(t1-t0);
 	}
 
 	static void pusht() {
-		auto t = std::chrono::system_clock::now();
+		auto t = std::chrono::steady_clock::now();
 		return get_tstack().push(t);
 	}
 	static double popt() {
 		auto t = get_tstack().top();
 		get_tstack().pop();
-        auto duration = std::chrono::duration_cast<t_type>(std::chrono::system_clock::now() - t);
+        auto duration = std::chrono::duration_cast<t_type>(std::chrono::steady_clock::now() - t);
 		return duration.count();
 	}
 
@@ -215,9 +334,9 @@ public:
 		return _tmMap()[name].count();
 	}
 
-	static std::stack< std::chrono::time_point<std::chrono::system_clock> >& get_tstack()
+	static std::stack< std::chrono::time_point<std::chrono::steady_clock> >& get_tstack()
 	{
-		static std::stack< std::chrono::time_point<std::chrono::system_clock> > _tstack;
+		thread_local std::stack< std::chrono::time_point<std::chrono::steady_clock> > _tstack;
 		return _tstack;
 	}
 	
@@ -252,11 +371,11 @@ public:
 
     template<typename F, typename ...Args>
     static double measure(F func, Args&&... args) {
-        auto start = std::chrono::system_clock::now();
+        auto start = std::chrono::steady_clock::now();
 
         func(std::forward<Args>(args)...);
 
-        auto duration = std::chrono::duration_cast<t_type>(std::chrono::system_clock::now() - start);
+        auto duration = std::chrono::duration_cast<t_type>(std::chrono::steady_clock::now() - start);
 
         return duration.count();
     }
@@ -272,8 +391,8 @@ private:
 	}
 //	static std::map<std::string, t_type> g_tmMap;
 //	static std::map<std::string, int> g_tmMapCnt;
-	std::chrono::time_point<std::chrono::system_clock> startTime;
-	std::chrono::time_point<std::chrono::system_clock> endTime;
+	std::chrono::time_point<std::chrono::steady_clock> startTime;
+	std::chrono::time_point<std::chrono::steady_clock> endTime;
 	std::string name;
 	bool isRunning;
 